@@ -0,0 +1,76 @@
+-- decoding and encoding of the values that go through the request arena
+--
+--   lua bench-arena.lua server 12352
+--   lua bench-arena.lua client 12352 [calls]
+--
+-- strings, function names, functions and error messages are held in the
+-- connection's arena while a request is decoded and its reply encoded.
+-- the client times calls that move many short strings, one large string,
+-- a function and a failing call, and then prints the server's resident
+-- memory, which should not keep the temporaries of the largest request.
+-- build the commit before the arena was added and run the client against
+-- both servers to compare. luasocket provides the wall clock.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12352)
+
+function echo(v)
+	return v
+end
+
+function apply(f, x)
+	return f(x)
+end
+
+function fail(s)
+	error(s)
+end
+
+-- resident memory of the server process in KB, where /proc has it
+function rss()
+	local f = io.open("/proc/self/status")
+	if not f then return 0 end
+	local s = f:read("*a")
+	f:close()
+	return tonumber(s:match("VmRSS:%s*(%d+)")) or 0
+end
+
+if mode == "server" then
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+local calls = tonumber(arg[3] or 2000)
+local slave = assert(rpc.client("localhost", port))
+local before = slave.rss()
+
+local words = {}
+for i = 1, 1000 do
+	words[i] = "word number " .. i
+end
+local blob = string.rep("0123456789abcdef", 65536)
+local function square(x)
+	local t = {}
+	for i = 1, 10 do t[i] = x * i end
+	return x * x
+end
+
+local cases = {
+	{"1000 strings", function() assert(#slave.echo(words) == #words) end},
+	{"1 MB string", function() assert(#slave.echo(blob) == #blob) end},
+	{"function", function() assert(slave.apply(square, 9) == 81) end},
+	{"error", function() assert(not pcall(slave.fail, "no good")) end},
+}
+
+for _, case in ipairs(cases) do
+	local t0 = socket.gettime()
+	for i = 1, calls do
+		case[2]()
+	end
+	io.write(string.format("%-14s %8.1f us/call\n", case[1],
+		(socket.gettime() - t0) * 1e6 / calls))
+end
+io.write(string.format("server rss %d KB before, %d KB after\n", before, slave.rss()))
@@ -0,0 +1,46 @@
+-- throughput of large arrays of numbers, with and without arrays=true
+--
+--   lua bench-arrays.lua server 12347 [arrays]
+--   lua bench-arrays.lua client 12347 [arrays] [n] [calls]
+--
+-- the client sends n integers and then n fractions to a function that
+-- returns the array's length, so the time is mostly encoding and decoding.
+-- run both sides with and without "arrays" and compare. luasocket provides
+-- the wall clock.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12347)
+rpc.encoding{arrays = arg[3] == "arrays"}
+
+function count(t)
+	return #t
+end
+
+if mode == "server" then
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+local n, calls = tonumber(arg[4] or 1000000), tonumber(arg[5] or 10)
+local slave = assert(rpc.client("localhost", port))
+local e = rpc.encoding(slave)
+io.write("arrays " .. tostring(e.arrays) .. ", " .. n .. " elements\n")
+
+local ints, reals = {}, {}
+for i = 1, n do
+	ints[i] = i % 30000
+	reals[i] = i / 7
+end
+
+for _, case in ipairs{{"i16", ints}, {"f64", reals}} do
+	local t0 = socket.gettime()
+	for i = 1, calls do
+		assert(slave.count(case[2]) == n)
+	end
+	local s = socket.gettime() - t0
+	io.write(string.format("%s %8.1f ms/call %8.2f M elements/s\n",
+		case[1], s * 1000 / calls, n * calls / s / 1e6))
+end
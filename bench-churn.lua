@@ -0,0 +1,81 @@
+-- connection churn: connections opened, called once and closed per second
+--
+--   lua bench-churn.lua server 12350
+--   lua bench-churn.lua client 12350 [clients] [seconds]
+--
+-- the client starts that many copies of itself, each connecting, making one
+-- call and closing as fast as it can, and prints the total connections per
+-- second and the server's resident memory before and after. the server
+-- takes connections from a table that grows to the peak and is reused
+-- afterwards, so its memory should not grow while the churn goes on. each
+-- copy connects to its own loopback address (127.0.0.1, 127.0.0.2, ...) so
+-- the closed connections waiting out TIME_WAIT do not use up one address's
+-- ephemeral ports; that needs Linux, elsewhere use one client. luasocket
+-- provides the wall clock.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12350)
+
+function ping(n)
+	return n
+end
+
+-- resident memory of the server process in KB, where /proc has it
+function rss()
+	local f = io.open("/proc/self/status")
+	if not f then return 0 end
+	local s = f:read("*a")
+	f:close()
+	return tonumber(s:match("VmRSS:%s*(%d+)")) or 0
+end
+
+if mode == "server" then
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+
+if mode == "worker" then
+	local host, seconds = arg[3], tonumber(arg[4])
+	local n, t0 = 0, socket.gettime()
+	while socket.gettime() - t0 < seconds do
+		local slave = assert(rpc.client(host, port))
+		assert(slave.ping(n) == n)
+		rpc.close(slave)
+		n = n + 1
+	end
+	io.write(n, " ", socket.gettime() - t0, "\n")
+	return
+end
+
+local clients, seconds = tonumber(arg[3] or 4), tonumber(arg[4] or 10)
+local lua = arg[-1] or "lua"
+
+local function server_rss()
+	local slave = assert(rpc.client("localhost", port))
+	local kb = slave.rss()
+	rpc.close(slave)
+	return kb
+end
+
+local before = server_rss()
+local workers = {}
+for i = 1, clients do
+	workers[i] = assert(io.popen(string.format("%s %s worker %d 127.0.0.%d %d",
+		lua, arg[0], port, i, seconds)))
+end
+
+local total, elapsed = 0, 0
+for i = 1, clients do
+	local n, s = workers[i]:read("*n", "*n")
+	workers[i]:close()
+	total = total + n
+	elapsed = math.max(elapsed, s)
+end
+
+io.write(string.format("%d clients: %d connections in %.1f s, %.0f connections/s\n",
+	clients, total, elapsed, total / elapsed))
+io.write(string.format("server rss %d KB before, %d KB after\n", before, server_rss()))
@@ -0,0 +1,85 @@
+-- throughput and latency through rpc.gateway with several clients at once
+--
+--   lua bench-gateway.lua device /dev/ttyS1       (with a serial build of rpc)
+--   lua bench-gateway.lua gateway 12348 /dev/ttyS0 [gc_step]
+--   lua bench-gateway.lua client 12348 [clients] [calls] [size]
+--
+-- without hardware, a pty pair from "socat -d -d pty,raw,echo=0
+-- pty,raw,echo=0" stands in for the cable. the client starts that many
+-- copies of itself, each making calls back to back with a string of size
+-- bytes, and prints the calls per second through the gateway and the
+-- latencies the callers saw. with one client the link is idle between a
+-- reply and the next request; with several, requests are pipelined onto it,
+-- so throughput should grow with the clients until the device is the
+-- limit. luasocket provides the wall clock.
+
+require("rpc")
+
+local mode = arg[1]
+
+function echo(s)
+	return s
+end
+
+if mode == "device" then
+	io.write("serving on " .. arg[2] .. "\n")
+	rpc.server(arg[2])
+	return
+end
+
+local port = tonumber(arg[2] or 12348)
+
+if mode == "gateway" then
+	local step = tonumber(arg[4] or 0)
+	io.write("gateway on " .. port .. " to " .. arg[3] .. ", gc_step " .. step .. "\n")
+	rpc.gateway(port, arg[3], {gc_step = step})
+	return
+end
+
+local socket = require("socket")
+
+if mode == "worker" then
+	local calls, s = tonumber(arg[3]), string.rep("x", tonumber(arg[4]))
+	local slave = assert(rpc.client("localhost", port))
+	local times = {}
+	local t0 = socket.gettime()
+	for i = 1, calls do
+		local t = socket.gettime()
+		assert(slave.echo(s) == s)
+		times[i] = (socket.gettime() - t) * 1e6
+	end
+	io.write(socket.gettime() - t0, "\n")
+	for i = 1, calls do io.write(times[i], "\n") end
+	return
+end
+
+local clients, calls = tonumber(arg[3] or 8), tonumber(arg[4] or 2000)
+local size = tonumber(arg[5] or 16)
+local lua = arg[-1] or "lua"
+local workers = {}
+for i = 1, clients do
+	workers[i] = assert(io.popen(string.format("%s %s worker %d %d %d",
+		lua, arg[0], port, calls, size)))
+end
+
+local times, elapsed = {}, 0
+for i = 1, clients do
+	local first = true
+	for line in workers[i]:lines() do
+		if first then
+			elapsed = math.max(elapsed, tonumber(line))
+			first = false
+		else
+			times[#times + 1] = tonumber(line)
+		end
+	end
+	workers[i]:close()
+end
+
+io.write(string.format("%d clients, %d calls of %d bytes: %.0f calls/s\n",
+	clients, #times, size, #times / elapsed))
+table.sort(times)
+for _, p in ipairs{50, 90, 99, 99.9} do
+	io.write(string.format("p%-5s %8.0f us\n", p, times[math.ceil(#times * p / 100)]))
+end
+io.write(string.format("max    %8.0f us\n", times[#times]))
@@ -0,0 +1,60 @@
+-- server memory per idle connection
+--
+--   lua bench-idle.lua server 12351
+--   lua bench-idle.lua client 12351 [connections] [addresses]
+--
+-- the client opens that many connections (100000 by default), spread over
+-- that many loopback addresses (127.0.0.1, 127.0.0.2, ...) so no address
+-- runs out of ephemeral ports, makes one call on each and leaves them all
+-- idle. it then prints the server's resident memory and what that comes
+-- to per connection. both processes need a descriptor limit above the
+-- connection count (ulimit -n), and addresses past 127.0.0.1 need Linux.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12351)
+
+function ping(n)
+	return n
+end
+
+-- resident memory of the server process in KB, where /proc has it
+function rss()
+	local f = io.open("/proc/self/status")
+	if not f then return 0 end
+	local s = f:read("*a")
+	f:close()
+	return tonumber(s:match("VmRSS:%s*(%d+)")) or 0
+end
+
+if mode == "server" then
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local n, addresses = tonumber(arg[3] or 100000), tonumber(arg[4] or 4)
+local slaves = {}
+slaves[1] = assert(rpc.client("127.0.0.1", port))
+local before = slaves[1].rss()
+
+for i = 2, n do
+	local host = "127.0.0." .. (i % addresses + 1)
+	local ok, slave = pcall(rpc.client, host, port)
+	if not ok then
+		io.write("connection ", i, " failed: ", tostring(slave), "\n")
+		n = i - 1
+		break
+	end
+	assert(slave.ping(i) == i)
+	slaves[i] = slave
+	if i % 10000 == 0 then
+		io.write(i, " connections\n")
+	end
+end
+
+collectgarbage("collect")
+local after = slaves[1].rss()
+io.write(string.format("%d idle connections: server rss %d KB, was %d KB with one\n",
+	n, after, before))
+io.write(string.format("%.2f KB per connection\n", (after - before) / math.max(n - 1, 1)))
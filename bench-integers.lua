@@ -0,0 +1,45 @@
+-- encoding and decoding of integer heavy values, for comparing Lua versions
+-- and integers=true
+--
+--   lua bench-integers.lua server 12348 [integers]
+--   lua bench-integers.lua client 12348 [integers] [rows] [calls]
+--
+-- the client sends rows of small and large integers to a function that
+-- returns them, so each call encodes and decodes them twice. run it under
+-- lua5.1 and lua5.4 (server and client alike), with and without
+-- "integers", and compare. luasocket provides the wall clock.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12348)
+rpc.encoding{integers = arg[3] == "integers"}
+
+function echo(t)
+	return t
+end
+
+if mode == "server" then
+	io.write(_VERSION .. " serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+local rows, calls = tonumber(arg[4] or 10000), tonumber(arg[5] or 50)
+local slave = assert(rpc.client("localhost", port))
+io.write(_VERSION .. ", integers " .. tostring(rpc.encoding(slave).integers) .. "\n")
+
+local t = {}
+for i = 1, rows do
+	t[i] = {id = i, count = i % 100, stamp = 1500000000000 + i}
+end
+
+local t0 = socket.gettime()
+local back
+for i = 1, calls do
+	back = slave.echo(t)
+end
+local s = socket.gettime() - t0
+assert(back[rows].stamp == t[rows].stamp)
+io.write(string.format("%8.2f ms/call %8.2f M values/s\n",
+	s * 1000 / calls, rows * 3 * 2 * calls / s / 1e6))
@@ -0,0 +1,60 @@
+-- call latency histogram, for comparing server settings such as gc_step
+--
+--   lua bench-latency.lua server 12346 [gc_step] [pause]
+--   lua bench-latency.lua client 12346 [calls] [objects]
+--
+-- the server's handler builds and drops a table of small tables each call,
+-- which is what makes the collector run in the middle of requests. run the
+-- client once against "server 12346" and once against "server 12346 64" (or
+-- "server 12346 64 pause") and compare the tails. luasocket provides the
+-- wall clock and the gaps between calls.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12346)
+
+function churn(n)
+	local t = {}
+	for i = 1, n do
+		t[i] = {i, tostring(i)}
+	end
+	return #t
+end
+
+if mode == "server" then
+	local step = tonumber(arg[3] or 0)
+	io.write("serving on " .. port .. ", gc_step " .. step .. "\n")
+	rpc.server(port, {gc_step = step, gc_pause = arg[4] == "pause"})
+	return
+end
+
+local socket = require("socket")
+local calls, objects = tonumber(arg[3] or 20000), tonumber(arg[4] or 2000)
+local slave = assert(rpc.client("localhost", port))
+
+-- buckets of doubling width, starting at 32 us
+local buckets, times = {}, {}
+for i = 1, calls do
+	local t0 = socket.gettime()
+	slave.churn(objects)
+	local us = (socket.gettime() - t0) * 1e6
+	times[i] = us
+	local b = 0
+	while us >= 32 * 2 ^ b do b = b + 1 end
+	buckets[b] = (buckets[b] or 0) + 1
+	socket.sleep(0.001) -- leave the server some idle time
+end
+
+local max = 0
+for b in pairs(buckets) do if b > max then max = b end end
+for b = 0, max do
+	local n = buckets[b] or 0
+	io.write(string.format("< %7d us %7d %s\n", 32 * 2 ^ b,
+		n, string.rep("#", math.ceil(60 * n / calls))))
+end
+
+table.sort(times)
+for _, p in ipairs{50, 90, 99, 99.9} do
+	io.write(string.format("p%-5s %8.0f us\n", p, times[math.ceil(#times * p / 100)]))
+end
+io.write(string.format("max    %8.0f us\n", times[#times]))
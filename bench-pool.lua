@@ -0,0 +1,57 @@
+-- latency of a call on a new connection against one on a pooled connection
+--
+--   lua bench-pool.lua server 12349
+--   lua bench-pool.lua client 12349 [calls]
+--
+-- "cold" opens a connection with rpc.client, makes one call and closes it,
+-- which is what a caller without a pool pays each time; "pooled" makes the
+-- same call through pool:call. the difference is the connect and handshake
+-- the pool saves. luasocket provides the wall clock.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12349)
+
+function ping(n)
+	return n
+end
+
+if mode == "server" then
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+local calls = tonumber(arg[3] or 5000)
+
+local function report(name, times)
+	table.sort(times)
+	io.write(string.format("%-6s", name))
+	for _, p in ipairs{50, 90, 99} do
+		io.write(string.format("  p%s %6.0f us", p, times[math.ceil(#times * p / 100)]))
+	end
+	io.write(string.format("  max %6.0f us\n", times[#times]))
+end
+
+local cold = {}
+for i = 1, calls do
+	local t0 = socket.gettime()
+	local slave = assert(rpc.client("localhost", port))
+	assert(slave.ping(i) == i)
+	rpc.close(slave)
+	cold[i] = (socket.gettime() - t0) * 1e6
+end
+
+local pool = rpc.pool("localhost", port, {min = 1, max = 1})
+local pooled = {}
+for i = 1, calls do
+	local t0 = socket.gettime()
+	assert(pool:call("ping", i) == i)
+	pooled[i] = (socket.gettime() - t0) * 1e6
+end
+pool:close()
+
+io.write(string.format("%d calls each\n", calls))
+report("cold", cold)
+report("pooled", pooled)
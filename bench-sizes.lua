@@ -0,0 +1,122 @@
+-- bytes on the wire with and without refs=true, strings=true and dict=true
+--
+--   lua bench-sizes.lua server 12353
+--   lua bench-sizes.lua client 12353
+--
+-- the server enables every encoding measured here and the client turns
+-- them on one combination at a time, so each connection uses just that
+-- combination. the client runs each case on its own connection through a
+-- relay (a copy of itself listening on port + 1) that counts the bytes
+-- both ways, and prints what each case took beyond the handshake. needs
+-- luasocket for the relay.
+
+require("rpc")
+
+local mode, port = arg[1], tonumber(arg[2] or 12353)
+local features = {"refs", "strings", "dict"}
+
+function echo(v)
+	return v
+end
+
+if mode == "server" then
+	local all = {}
+	for _, name in ipairs(features) do all[name] = true end
+	rpc.encoding(all)
+	io.write("serving on " .. port .. "\n")
+	rpc.server(port)
+	return
+end
+
+local socket = require("socket")
+
+if mode == "relay" then
+	local listener = assert(socket.bind("127.0.0.1", port + 1))
+	io.write("ready\n")
+	io.flush()
+	for n = 1, tonumber(arg[3]) do
+		local a = assert(listener:accept())
+		local b = assert(socket.connect("127.0.0.1", port))
+		local bytes, peer = {[a] = 0, [b] = 0}, {[a] = b, [b] = a}
+		local open = true
+		while open do
+			for _, s in ipairs(socket.select({a, b})) do
+				s:settimeout(0)
+				local data, err, partial = s:receive(65536)
+				local chunk = data or partial or ""
+				if #chunk > 0 then
+					bytes[s] = bytes[s] + #chunk
+					peer[s]:settimeout(nil)
+					assert(peer[s]:send(chunk))
+				end
+				if err == "closed" then open = false end
+			end
+		end
+		a:close()
+		b:close()
+		io.write(bytes[a], " ", bytes[b], "\n")
+		io.flush()
+	end
+	return
+end
+
+local rows = {}
+for i = 1, 1000 do
+	rows[i] = {name = "sensor " .. i % 10, unit = "celsius", value = i}
+end
+local shared = {}
+for i = 1, 100 do shared[i] = "item " .. i end
+local repeated = {}
+for i = 1, 50 do repeated[i] = shared end
+
+local cases = {
+	{"1000 records", function(slave) assert(#slave.echo(rows) == #rows) end},
+	{"1 table x 50", function(slave) assert(#slave.echo(repeated) == #repeated) end},
+	{"100 small calls", function(slave)
+		for i = 1, 100 do
+			assert(slave.echo({name = "sensor", unit = "celsius", value = i}).value == i)
+		end
+	end},
+}
+
+local combinations = {{}}
+for _, name in ipairs(features) do
+	combinations[#combinations + 1] = {[name] = true}
+end
+local all = {}
+for _, name in ipairs(features) do all[name] = true end
+combinations[#combinations + 1] = all
+
+local lua = arg[-1] or "lua"
+local relay = assert(io.popen(string.format("%s %s relay %d %d",
+	lua, arg[0], port, #combinations * (#cases + 1))))
+assert(relay:read("*l") == "ready")
+
+-- bytes up and down of a connection that makes the calls of fn
+local function measure(fn)
+	local slave = assert(rpc.client("127.0.0.1", port + 1))
+	fn(slave)
+	rpc.close(slave)
+	return relay:read("*n", "*n")
+end
+
+io.write(string.format("%-22s", "bytes up+down"))
+for _, case in ipairs(cases) do
+	io.write(string.format("%16s", case[1]))
+end
+io.write("\n")
+for _, on in ipairs(combinations) do
+	local names = {}
+	for _, name in ipairs(features) do
+		rpc.encoding{[name] = on[name] or false}
+		if on[name] then names[#names + 1] = name end
+	end
+	local up0, down0 = measure(function() end)
+	io.write(string.format("%-22s", #names > 0 and table.concat(names, "+") or "none"))
+	for _, case in ipairs(cases) do
+		local up, down = measure(case[2])
+		io.write(string.format("%16d", up + down - up0 - down0))
+	end
+	io.write("\n")
+end
+relay:close()
@@ -0,0 +1,111 @@
+/*****************************************************************************
+* Lua-RPC library, Copyright (C) 2001 Russell L. Smith. All rights reserved. *
+*   Email: russ@q12.org   Web: www.q12.org                                   *
+* For documentation, see http://www.q12.org/lua. For the license agreement,  *
+* see the file LICENSE that comes with this distribution.                    *
+*****************************************************************************/
+
+// Number block kernel microbenchmark
+//   make bench-swap && ./bench-swap [elements] [rounds]
+//
+//   times swap_block, array_pack and array_unpack (luarpc_swap.c) on blocks
+//   of elements numbers, the work done for each array block exchanged with
+//   a peer of the other byte order. on x86 every kernel is timed at each
+//   level the CPU has (plain C, SSSE3, AVX2); elsewhere only the level the
+//   build picked.
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "luarpc_swap.c"
+
+static double now_s (void)
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t elements;
+static int rounds;
+static uint8_t *wire;
+static double *nums;
+
+// the kernel under test, on all elements
+enum { SWAP16, SWAP32, SWAP64, PACK_I32, UNPACK_I32, PACK_F32, UNPACK_F32 };
+static const char *names[] = {
+  "swap 16", "swap 32", "swap 64", "pack i32", "unpack i32", "pack f32", "unpack f32"
+};
+
+static void run (int kernel)
+{
+  switch( kernel )
+  {
+    case SWAP16: swap_block( wire, elements, 2 ); break;
+    case SWAP32: swap_block( wire, elements, 4 ); break;
+    case SWAP64: swap_block( wire, elements, 8 ); break;
+    case PACK_I32: array_pack( wire, nums, elements, ARRAY_I32 ); break;
+    case UNPACK_I32: array_unpack( nums, wire, elements, ARRAY_I32 ); break;
+    case PACK_F32: array_pack( wire, nums, elements, ARRAY_F32 ); break;
+    case UNPACK_F32: array_unpack( nums, wire, elements, ARRAY_F32 ); break;
+  }
+}
+
+// M elements per second of the kernel at the current level
+static double measure (int kernel)
+{
+  double t0;
+  int i;
+
+  run( kernel );
+  t0 = now_s();
+  for( i = 0; i < rounds; i ++ )
+    run( kernel );
+  return elements * ( double )rounds / ( now_s() - t0 ) / 1e6;
+}
+
+int main (int argc, char **argv)
+{
+  size_t i;
+  int k;
+
+  elements = argc > 1 ? ( size_t )atol( argv[ 1 ] ) : 65536;
+  rounds = argc > 2 ? atoi( argv[ 2 ] ) : 2000;
+  wire = malloc( elements * 8 );
+  nums = malloc( elements * sizeof( double ) );
+  if( wire == NULL || nums == NULL )
+    return 1;
+  for( i = 0; i < elements; i ++ )
+    nums[ i ] = ( double )( i % 100000 ) - 50000;
+  memset( wire, 0x5a, elements * 8 );
+
+  printf( "%lu elements, M elements/s\n%-12s", ( unsigned long )elements, "" );
+#if defined( SWAP_X86 )
+  {
+    int top = cpu_level(), l;
+    printf( "%10s%10s%10s\n", "c", "ssse3", "avx2" );
+    for( k = 0; k <= UNPACK_F32; k ++ )
+    {
+      printf( "%-12s", names[ k ] );
+      for( l = LEVEL_C; l <= top; l ++ )
+      {
+        level = l;
+        printf( "%10.0f", measure( k ) );
+      }
+      printf( "\n" );
+    }
+  }
+#else
+  printf( "%10s\n", "built" );
+  for( k = 0; k <= UNPACK_F32; k ++ )
+    printf( "%-12s%10.0f\n", names[ k ], measure( k ) );
+#endif
+  free( wire );
+  free( nums );
+  return 0;
+}
@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include "lua.h"
 #include "lualib.h"
@@ -31,31 +32,250 @@
 #include "lrotable.h"
 #endif
 
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#endif
+
 #include "luarpc_rpc.h"
 #include "luarpc_protocol.h"
 
 
-struct timeval timeval_from_ms( double ms ){
-  struct timeval t;
-  t.tv_sec = (int)(ms / 1000);
-  ms -= t.tv_sec * 1000;
-  t.tv_usec = (int)(ms * 1000);
-  return t;
-}
-
 double ms_from_timeval( struct timeval t ){
   return t.tv_sec * 1000.0 + t.tv_usec / 1000.0;
 }
 
+// numeric field of an options table, or def if absent or there is no table
+static double opt_number( lua_State *L, int opts, const char *name, double def )
+{
+  double v = def;
+  if( lua_istable( L, opts ) )
+  {
+    lua_getfield( L, opts, name );
+    if( lua_isnumber( L, -1 ) )
+      v = lua_tonumber( L, -1 );
+    lua_pop( L, 1 );
+  }
+  return v;
+}
+
+// **************************************************************************
+// connection table
+//   transports for accepted connections are carved out of slabs of
+//   TRANSPORT_SLAB_SIZE that are never handed back to the heap, so once the
+//   table has grown to the peak number of connections, churn costs no malloc
+//   or free. free slots are chained through their list link. a slot's id
+//   holds its index and a generation that is bumped when the slot is taken
+//   and again when it is freed (odd = in use), so an id kept after its
+//   connection closed no longer resolves.
+
+#define SLOT_INDEX_BITS 20
+#define SLOT_INDEX( id ) ( ( id ) & ( ( 1u << SLOT_INDEX_BITS ) - 1 ) )
+#define SLOT_NEXT_GEN( id ) ( ( id ) + ( 1u << SLOT_INDEX_BITS ) )
+#define SLOT_IN_USE( id ) ( ( ( id ) >> SLOT_INDEX_BITS ) & 1 )
+
+static Transport **slabs = NULL;
+static uint32_t nslabs = 0;
+static struct transport_node *free_slots = NULL;
+
+static void transport_slab_grow( void )
+{
+  struct exception e;
+  Transport **grown;
+  Transport *slab;
+  uint32_t i;
+
+  if( ( nslabs + 1 ) * TRANSPORT_SLAB_SIZE > ( 1u << SLOT_INDEX_BITS ) )
+  {
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  grown = ( Transport ** )realloc( slabs, ( nslabs + 1 ) * sizeof( Transport * ) );
+  if( grown != NULL )
+    slabs = grown;
+  slab = ( Transport * )malloc( TRANSPORT_SLAB_SIZE * sizeof( Transport ) );
+  if( grown == NULL || slab == NULL )
+  {
+    free( slab );
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  slabs[ nslabs ] = slab;
+  // chain in reverse so slots are handed out in index order
+  for( i = TRANSPORT_SLAB_SIZE; i > 0; i -- )
+  {
+    Transport *t = &slab[ i - 1 ];
+    t->id = nslabs * TRANSPORT_SLAB_SIZE + i - 1;
+    t->link.t = t;
+    t->link.next = free_slots;
+    free_slots = &t->link;
+  }
+  nslabs ++;
+}
+
 Transport * transport_create (void){
-  Transport* t = malloc(sizeof(Transport));
+  Transport* t;
+  uint32_t id;
+
+  if( free_slots == NULL )
+    transport_slab_grow();
+  t = free_slots->t;
+  free_slots = free_slots->next;
+  id = SLOT_NEXT_GEN( t->id );
   memset(t,0,sizeof(Transport));
+  t->id = id;
+  t->link.t = t;
+  t->link.prev = t->link.next = &t->link;
   t->fd = -1;
-  t->wait_timeout.tv_sec = 3;
-  t->com_timeout.tv_sec = 1;
+  t->wait_timeout = 3000;
+  t->com_timeout = 1000;
   return t;
 }
 
+void transport_free (Transport *t){
+  timer_cancel( &t->timer );
+  arena_reset( &t->arena );
+  t->id = SLOT_NEXT_GEN( t->id );
+  t->link.t = t;
+  t->link.next = free_slots;
+  free_slots = &t->link;
+}
+
+Transport * transport_from_id (uint32_t id){
+  uint32_t i = SLOT_INDEX( id );
+  Transport *t;
+
+  if( i >= nslabs * TRANSPORT_SLAB_SIZE )
+    return NULL;
+  t = &slabs[ i / TRANSPORT_SLAB_SIZE ][ i % TRANSPORT_SLAB_SIZE ];
+  return ( t->id == id && SLOT_IN_USE( id ) ) ? t : NULL;
+}
+
+// **************************************************************************
+// shared I/O buffers
+
+static IOBuf *free_iobufs = NULL;
+static int nfree_iobufs = 0;
+
+IOBuf *iobuf_get (void){
+  struct exception e;
+  IOBuf *b = free_iobufs;
+
+  if( b != NULL )
+  {
+    free_iobufs = b->next;
+    nfree_iobufs --;
+  }
+  else if( ( b = ( IOBuf * )malloc( sizeof( IOBuf ) ) ) == NULL )
+  {
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  b->pos = b->len = 0;
+  return b;
+}
+
+void iobuf_put (IOBuf *b){
+  if( nfree_iobufs >= IOBUF_POOL_MAX )
+  {
+    free( b );
+    return;
+  }
+  b->next = free_iobufs;
+  free_iobufs = b;
+  nfree_iobufs ++;
+}
+
+// **************************************************************************
+// request arenas
+
+#define ARENA_ALIGN 8
+
+struct _ArenaLarge {
+  ArenaLarge *next;
+  uint64_t data[];
+};
+
+// offset of the next aligned byte free in an arena block
+static size_t arena_top (IOBuf *b){
+  return b->len + ( ( 0 - ( uintptr_t )( b->data + b->len ) ) & ( ARENA_ALIGN - 1 ) );
+}
+
+void *arena_alloc (Arena *a, size_t n){
+  struct exception e;
+  IOBuf *b = a->blocks;
+  size_t at = 0;
+
+  if( n > ARENA_MAX - a->used )
+  {
+    e.errnum = ENOMEM;
+    e.type = fatal;
+    Throw( e );
+  }
+  if( n > IOBUF_SIZE - ARENA_ALIGN )
+  {
+    ArenaLarge *l = ( ArenaLarge * )malloc( offsetof( ArenaLarge, data ) + n );
+    if( l == NULL )
+    {
+      e.errnum = ENOMEM;
+      e.type = fatal;
+      Throw( e );
+    }
+    l->next = a->large;
+    a->large = l;
+    a->used += n;
+    return l->data;
+  }
+  if( b != NULL )
+    at = arena_top( b );
+  if( b == NULL || at + n > IOBUF_SIZE )
+  {
+    b = iobuf_get();
+    b->next = a->blocks;
+    a->blocks = b;
+    at = arena_top( b );
+  }
+  b->len = ( uint16_t )( at + n );
+  a->used += n;
+  return b->data + at;
+}
+
+void arena_mark (Arena *a, ArenaMark *m){
+  m->block = a->blocks;
+  m->len = a->blocks != NULL ? a->blocks->len : 0;
+  m->large = a->large;
+  m->used = a->used;
+}
+
+void arena_release (Arena *a, const ArenaMark *m){
+  while( a->blocks != m->block )
+  {
+    IOBuf *b = a->blocks;
+    a->blocks = b->next;
+    iobuf_put( b );
+  }
+  if( a->blocks != NULL )
+    a->blocks->len = m->len;
+  while( a->large != m->large )
+  {
+    ArenaLarge *l = a->large;
+    a->large = l->next;
+    free( l );
+  }
+  a->used = m->used;
+}
+
+void arena_reset (Arena *a){
+  static const ArenaMark empty = { NULL, 0, NULL, 0 };
+  arena_release( a, &empty );
+}
+
 struct transport_node* transport_list;
 
 
@@ -101,10 +321,11 @@ struct transport_node* transport_new_list(){
   return node;
 }
 
+// transports carry their own list link, so neither call allocates and
+// removal needs no search. remove returns the previous node so a caller
+// walking the list can carry on from there.
 void transport_insert_to_list(struct transport_node* head, Transport* t){
-  struct transport_node* node = (struct transport_node*) malloc(sizeof(struct transport_node));
-  memset(node,0,sizeof(struct transport_node));
-  //  printf("node %p\n",node);
+  struct transport_node* node = &t->link;
   node->t = t;
   node->prev = head;
   node->next = head->next;
@@ -113,17 +334,12 @@ void transport_insert_to_list(struct transport_node* head, Transport* t){
 }
 
 struct transport_node* transport_remove_from_list(struct transport_node* head, Transport* t){
-  struct transport_node* node = head;
-  struct transport_node* prev = head;
-  while( (node = node->next) != head ){
-    if( node->t == t ){
-      node->next->prev = node->prev;
-      node->prev->next = node->next;
-      prev = node->prev;
-      free(node);
-      break;
-    }
-  }
+  struct transport_node* node = &t->link;
+  struct transport_node* prev = node->prev;
+  ( void )head;
+  node->next->prev = prev;
+  prev->next = node->next;
+  node->prev = node->next = node;
   return prev;
 }
 
@@ -135,13 +351,14 @@ Transport *client_create( lua_State *L );
 // **************************************************************************
 // server side handle userdata objects. 
 
-static Transport *server_create( lua_State *L )
+static Transport *server_create( lua_State *L, int backlog, int flags )
 {
   Transport *server = ( Transport * )lua_newuserdata( L, sizeof( Transport ) );
+  memset( server, 0, sizeof( Transport ) );
   luaL_getmetatable( L, "rpc.server" );
   lua_setmetatable( L, -2 );
   transport_init( server );
-  transport_open_listener(L,server);
+  transport_open_listener(L,server,backlog,flags);
   return server;
 }
 
@@ -165,9 +382,9 @@ static int rpc_client( lua_State *L )
     double wait_timeout_ms = luaL_optnumber(L,5,3000.0);
     client = client_create ( L );
 
-    client->com_timeout = timeval_from_ms( com_timeout_ms );
-    client->wait_timeout = timeval_from_ms( wait_timeout_ms );    
-    client->timeout = client->com_timeout;
+    client->com_timeout = ( uint32_t )com_timeout_ms;
+    client->wait_timeout = ( uint32_t )wait_timeout_ms;
+    transport_set_timeout( client, client->com_timeout );
 
     transport_open_connection( L, client );    
     client_negotiate( client );
@@ -180,6 +397,295 @@ static int rpc_client( lua_State *L )
 }
 
 
+#ifdef LUARPC_ENABLE_SOCKET
+
+// **************************************************************************
+// client connection pools
+//   a pool keeps negotiated connections to one host/port open between uses.
+//   idle connections are reused most recently returned first, so the ones
+//   that sit unused longest age out past idle_timeout and get closed.
+
+typedef struct _Pool Pool;
+struct _Pool {
+  char host[ 256 ];
+  int port;
+  int idle_ref;                       // registry ref: idle clients, newest last
+  int since_ref;                      // registry ref: client -> timer_now() when returned
+  int nidle, nbusy;
+  int min, max;                       // open connections kept / allowed
+  uint32_t idle_timeout;              // ms
+  uint32_t checked;                   // timer_now() when idle connections were last checked
+  double com_timeout, wait_timeout;
+};
+
+// open and negotiate a new connection, leaving its handle on the stack.
+// if quiet is set a failure leaves nothing and returns 0, else it is raised
+static int pool_connect( lua_State *L, Pool *p, int quiet )
+{
+  lua_pushcfunction( L, rpc_client );
+  lua_pushstring( L, p->host );
+  lua_pushnumber( L, p->port );
+  lua_pushnumber( L, p->com_timeout );
+  lua_pushnil( L );
+  lua_pushnumber( L, p->wait_timeout );
+  if( !quiet )
+    lua_call( L, 5, 1 );
+  else if( lua_pcall( L, 5, 1, 0 ) != 0 )
+  {
+    lua_pop( L, 1 );
+    return 0;
+  }
+  return 1;
+}
+
+// put the client at the top of the stack on the idle list (pops it)
+static void pool_push_idle( lua_State *L, Pool *p )
+{
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->since_ref );
+  lua_pushvalue( L, -2 );
+  lua_pushnumber( L, timer_now() );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  lua_insert( L, -2 );
+  lua_rawseti( L, -2, ++p->nidle );
+  lua_pop( L, 1 );
+}
+
+// take idle entry i off the list, leaving the client on the stack
+static void pool_take_idle( lua_State *L, Pool *p, int i )
+{
+  int j;
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+  lua_rawgeti( L, -1, i );
+  for( j = i; j < p->nidle; j ++ )
+  {
+    lua_rawgeti( L, -2, j + 1 );
+    lua_rawseti( L, -3, j );
+  }
+  lua_pushnil( L );
+  lua_rawseti( L, -3, p->nidle-- );
+  lua_remove( L, -2 );
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, p->since_ref );
+  lua_pushvalue( L, -2 );
+  lua_pushnil( L );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+}
+
+// close idle connections that are closed already or have data waiting
+// (i.e. the server hung up)
+static void pool_check( lua_State *L, Pool *p )
+{
+  int i = 1;
+  while( i <= p->nidle )
+  {
+    Transport *client;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+    lua_rawgeti( L, -1, i );
+    client = ( Transport * )lua_touserdata( L, -1 );
+    lua_pop( L, 2 );
+    if( transport_is_open( client ) && !transport_readable( client ) )
+      i ++;
+    else
+    {
+      pool_take_idle( L, p, i );
+      transport_close( client );
+      lua_pop( L, 1 );
+    }
+  }
+}
+
+// close connections that have been idle too long, keeping at least min
+// open. every POOL_CHECK_INTERVAL ms the idle connections are also checked,
+// and ones that failed are replaced, or opened, until min are open again;
+// the first connection the server refuses ends that until the next check
+static void pool_reap( lua_State *L, Pool *p )
+{
+  uint32_t now = timer_now();
+
+  if( now - p->checked >= POOL_CHECK_INTERVAL )
+  {
+    p->checked = now;
+    pool_check( L, p );
+    while( p->nidle + p->nbusy < p->min && pool_connect( L, p, 1 ) )
+      pool_push_idle( L, p );
+  }
+  while( p->nidle > 0 && p->nidle + p->nbusy > p->min )
+  {
+    uint32_t since;
+    lua_rawgeti( L, LUA_REGISTRYINDEX, p->since_ref );
+    lua_rawgeti( L, LUA_REGISTRYINDEX, p->idle_ref );
+    lua_rawgeti( L, -1, 1 );
+    lua_rawget( L, -3 );
+    since = ( uint32_t )lua_tonumber( L, -1 );
+    lua_pop( L, 3 );
+    if( now - since < p->idle_timeout )
+      break;
+    pool_take_idle( L, p, 1 );
+    transport_close( ( Transport * )lua_touserdata( L, -1 ) );
+    lua_pop( L, 1 );
+  }
+}
+
+// hand out a connection, leaving it on the stack. idle connections that
+// have been closed or have data waiting (i.e. the server hung up) are
+// discarded rather than returned.
+static void pool_checkout( lua_State *L, Pool *p )
+{
+  pool_reap( L, p );
+  while( p->nidle > 0 )
+  {
+    Transport *client;
+    pool_take_idle( L, p, p->nidle );
+    client = ( Transport * )lua_touserdata( L, -1 );
+    if( transport_is_open( client ) && !transport_readable( client ) )
+    {
+      p->nbusy ++;
+      return;
+    }
+    transport_close( client );
+    lua_pop( L, 1 );
+  }
+  if( p->nbusy >= p->max )
+    luaL_error( L, "connection pool for %s:%d exhausted", p->host, p->port );
+  pool_connect( L, p, 0 );
+  p->nbusy ++;
+}
+
+static void pool_checkin( lua_State *L, Pool *p, int idx )
+{
+  Transport *client = ( Transport * )luaL_checkudata( L, idx, "rpc.client" );
+  if( p->nbusy > 0 )
+    p->nbusy --;
+  if( transport_is_open( client ) && client->batch_count == 0 )
+  {
+    lua_pushvalue( L, idx );
+    pool_push_idle( L, p );
+  }
+  else
+    transport_close( client );
+  pool_reap( L, p );
+}
+
+// rpc_pool( host, port [, options] )
+//     returns the pool for host:port, creating it on first use. options is
+//     a table with any of min, max, idle_timeout (ms), com_timeout and
+//     wait_timeout (ms, as for rpc.client); they only apply on creation.
+
+static int rpc_pool( lua_State *L )
+{
+  Pool *p;
+  const char *host = luaL_checkstring( L, 1 );
+  int port = luaL_checkint( L, 2 );
+  int i;
+
+  lua_settop( L, 3 );
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.pools" );
+  lua_pushfstring( L, "%s:%d", host, port );
+  lua_pushvalue( L, -1 );
+  lua_rawget( L, -3 );
+  if( !lua_isnil( L, -1 ) )
+    return 1;
+  lua_pop( L, 1 );
+
+  if( strlen( host ) >= sizeof( p->host ) )
+    return luaL_error( L, "host name too long" );
+
+  p = ( Pool * )lua_newuserdata( L, sizeof( Pool ) );
+  luaL_getmetatable( L, "rpc.pool" );
+  lua_setmetatable( L, -2 );
+  strcpy( p->host, host );
+  p->port = port;
+  p->nidle = p->nbusy = 0;
+  p->min = ( int )opt_number( L, 3, "min", 0 );
+  p->max = ( int )opt_number( L, 3, "max", 16 );
+  p->idle_timeout = ( uint32_t )opt_number( L, 3, "idle_timeout", 30000.0 );
+  p->com_timeout = opt_number( L, 3, "com_timeout", 1000.0 );
+  p->wait_timeout = opt_number( L, 3, "wait_timeout", 3000.0 );
+  p->checked = timer_now();
+  lua_newtable( L );
+  p->idle_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  lua_newtable( L );
+  p->since_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  // pools live as long as the process, keyed by host:port
+  lua_pushvalue( L, -2 );
+  lua_pushvalue( L, -2 );
+  lua_rawset( L, -5 );
+
+  for( i = 0; i < p->min; i ++ )
+  {
+    pool_connect( L, p, 0 );
+    pool_push_idle( L, p );
+  }
+  return 1;
+}
+
+// pool:checkout() -> client handle, to be given back with pool:checkin()
+static int pool_checkout_method( lua_State *L )
+{
+  pool_checkout( L, ( Pool * )luaL_checkudata( L, 1, "rpc.pool" ) );
+  return 1;
+}
+
+// pool:checkin( client )
+static int pool_checkin_method( lua_State *L )
+{
+  pool_checkin( L, ( Pool * )luaL_checkudata( L, 1, "rpc.pool" ), 2 );
+  return 0;
+}
+
+// pool:call( "name.of.function", ... )
+//     runs one call on a pooled connection and returns it to the pool.
+static int pool_call_method( lua_State *L )
+{
+  Pool *p = ( Pool * )luaL_checkudata( L, 1, "rpc.pool" );
+  const char *name = luaL_checkstring( L, 2 );
+  const char *dot;
+  int i, ci, status, nargs = lua_gettop( L ) - 2;
+
+  pool_checkout( L, p );
+  ci = lua_gettop( L );
+
+  // index down to the remote function the same way handle.a.b would
+  lua_pushvalue( L, ci );
+  while( ( dot = strchr( name, '.' ) ) != NULL )
+  {
+    lua_pushlstring( L, name, dot - name );
+    lua_gettable( L, -2 );
+    lua_remove( L, -2 );
+    name = dot + 1;
+  }
+  lua_getfield( L, -1, name );
+  lua_remove( L, -2 );
+
+  for( i = 0; i < nargs; i ++ )
+    lua_pushvalue( L, 3 + i );
+  status = lua_pcall( L, nargs, LUA_MULTRET, 0 );
+  pool_checkin( L, p, ci );
+  if( status != 0 )
+    return lua_error( L );
+  return lua_gettop( L ) - ci;
+}
+
+// pool:close() closes all idle connections
+static int pool_close_method( lua_State *L )
+{
+  Pool *p = ( Pool * )luaL_checkudata( L, 1, "rpc.pool" );
+  while( p->nidle > 0 )
+  {
+    pool_take_idle( L, p, p->nidle );
+    transport_close( ( Transport * )lua_touserdata( L, -1 ) );
+    lua_pop( L, 1 );
+  }
+  return 0;
+}
+
+#endif
+
+
 // rpc_close( handle )
 //     this closes the transport, but does not free the handle object. that's
 //     because the handle will still be in the user's name space and might be
@@ -222,11 +728,11 @@ static int rpc_wait_timeout( lua_State *L )
       Transport *client = ( Transport * )lua_touserdata( L, 1 );
       double timeout_ms = luaL_optnumber(L,2,-1.0);
       if( timeout_ms != -1.0 ){
-        client->wait_timeout = timeval_from_ms( timeout_ms );
+        client->wait_timeout = ( uint32_t )timeout_ms;
         return 0;
       }
       else {
-        lua_pushnumber(L,ms_from_timeval( client->wait_timeout ) );
+        lua_pushnumber(L,client->wait_timeout );
         return 1;
       }
     }
@@ -246,11 +752,11 @@ static int rpc_com_timeout( lua_State *L )
       
       double timeout_ms = luaL_optnumber(L,2,-1.0);
       if( timeout_ms != -1.0 ){
-        client->com_timeout = timeval_from_ms( timeout_ms );
+        client->com_timeout = ( uint32_t )timeout_ms;
         return 0;
       }
       else {
-        lua_pushnumber(L,ms_from_timeval( client->com_timeout ) );
+        lua_pushnumber(L,client->com_timeout );
         return 1;
       }
     }
@@ -261,11 +767,11 @@ static int rpc_com_timeout( lua_State *L )
 
       double timeout_ms = luaL_optnumber(L,2,-1.0);
       if( timeout_ms != -1.0 ){
-        server->com_timeout = timeval_from_ms( timeout_ms );
+        server->com_timeout = ( uint32_t )timeout_ms;
         return 0;
       }
       else {
-        lua_pushnumber(L,ms_from_timeval( server->com_timeout ) );
+        lua_pushnumber(L,server->com_timeout );
         return 1;
       }
     }
@@ -275,6 +781,50 @@ static int rpc_com_timeout( lua_State *L )
 }
 
 
+// rpc_batch( handle [, window_ms] )
+//     turns on batching of calls made from coroutines: a call writes its
+//     request and suspends the coroutine until the batch is flushed, either
+//     by rpc.flush(handle) or by a call made once window_ms have passed
+//     since the oldest pending one. a window of 0 flushes only on demand.
+//     without window_ms (or with nil/false) batching is switched off again.
+
+static int rpc_batch( lua_State *L )
+{
+  Transport *client = ( Transport * )luaL_checkudata( L, 1, "rpc.client" );
+
+  if( lua_isnoneornil( L, 2 ) || ( lua_isboolean( L, 2 ) && !lua_toboolean( L, 2 ) ) )
+  {
+    if( client->batch_ref != LUA_NOREF )
+    {
+      batch_flush( L, client );
+      luaL_unref( L, LUA_REGISTRYINDEX, client->batch_ref );
+      client->batch_ref = LUA_NOREF;
+    }
+    return 0;
+  }
+
+  client->batch_window = ( uint32_t )luaL_checknumber( L, 2 );
+  if( client->batch_ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    client->batch_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    client->batch_count = 0;
+  }
+  return 0;
+}
+
+// rpc_flush( handle )
+//     sends all batched calls and resumes their coroutines with the replies.
+
+static int rpc_flush( lua_State *L )
+{
+  Transport *client = ( Transport * )luaL_checkudata( L, 1, "rpc.client" );
+  lua_settop( L, 1 );
+  batch_flush( L, client );
+  return 0;
+}
+
+
 // rpc_async (handle,)
 //     this sets a handle's asynchronous calling mode (0/nil=off, other=on).
 //     (this is for the client only).
@@ -300,39 +850,303 @@ static int rpc_com_timeout( lua_State *L )
 
 
 
-static void rpc_dispatch_accept(Transport* listener)
+// server settings, from the options table given to rpc.server
+typedef struct _ServerOptions ServerOptions;
+struct _ServerOptions {
+  int backlog;
+  int flags;                          // LISTEN_* bits
+  uint32_t handshake_timeout;         // ms a new connection has to send its header
+  uint32_t idle_timeout;              // ms a connection may sit unused, 0 = no limit
+  uint32_t drain_timeout;             // ms a drain has to answer what has arrived
+  int max_connections;                // open connections, 0 = no limit
+  int pool_alloc;                     // install the pooled Lua allocator
+  size_t max_request_memory;          // bytes a handler may allocate, 0 = no limit
+  int gc_step;                        // KB collected per idle slice, 0 = leave GC to Lua
+  int gc_pause;                       // no automatic collection while busy
+};
+
+static void server_options( lua_State *L, int opts, ServerOptions *o )
+{
+  o->backlog = ( int )opt_number( L, opts, "backlog", MAXCON );
+  o->handshake_timeout = ( uint32_t )opt_number( L, opts, "handshake_timeout", HANDSHAKE_TIMEOUT );
+  o->idle_timeout = ( uint32_t )opt_number( L, opts, "idle_timeout", 0 );
+  o->drain_timeout = ( uint32_t )opt_number( L, opts, "drain_timeout", DRAIN_TIMEOUT );
+  o->max_connections = ( int )opt_number( L, opts, "max_connections", 0 );
+  o->max_request_memory = ( size_t )opt_number( L, opts, "max_request_memory", 0 );
+  o->gc_step = ( int )opt_number( L, opts, "gc_step", 0 );
+  o->gc_pause = 0;
+  o->flags = 0;
+  o->pool_alloc = o->max_request_memory > 0;
+  if( lua_istable( L, opts ) ){
+    lua_getfield( L, opts, "reuseport" );
+    if( lua_toboolean( L, -1 ) )
+      o->flags |= LISTEN_REUSEPORT;
+    lua_getfield( L, opts, "pool_alloc" );
+    if( lua_toboolean( L, -1 ) )
+      o->pool_alloc = 1;
+    lua_getfield( L, opts, "gc_pause" );
+    if( lua_toboolean( L, -1 ) && o->gc_step > 0 )
+      o->gc_pause = 1;
+    lua_pop( L, 3 );
+  }
+}
+
+// deadlines of the connections being served
+static TimerWheel server_timers;
+
+// accepted connections in transport_list, which is kept in most recently
+// used order: a client goes to the front each time it is served
+static int server_nconn;
+
+// the listener of the running rpc.server, and whether rpc.drain was called
+static Transport *serving = NULL;
+static int draining;
+
+// a connection's timer ran out: it never sent its header, or it has been
+// idle for longer than idle_timeout
+// a listener taken out of the loop after a failed accept (see
+// rpc_dispatch_accept), or NULL
+static Transport *accept_paused = NULL;
+
+static void server_on_timer( Timer *t )
+{
+  Transport *tpt = transport_of_timer( t );
+
+  if( tpt == accept_paused ){
+    accept_paused = NULL;
+    if( transport_is_open( tpt ) )
+      transport_insert_to_list( transport_list, tpt );
+    return;
+  }
+  tpt->must_die = 1;
+}
+
+// a client has just been served: make it the most recently used connection
+// and restart its idle timer (once its header is in, the handshake timer
+// gives way to that)
+static void server_touch( Transport *client, const ServerOptions *o )
+{
+  transport_remove_from_list( transport_list, client );
+  transport_insert_to_list( transport_list, client );
+  if( !client->negotiated )
+    return;
+  if( o->idle_timeout > 0 )
+    timer_arm( &server_timers, &client->timer, timer_now() + o->idle_timeout );
+  else
+    timer_cancel( &client->timer );
+}
+
+// close the least recently used connection that has nothing pending.
+// returns 0 if there is none (listeners, clients still in their handshake
+// and gateway clients waiting on the device are never picked)
+static int server_evict( void )
+{
+  struct transport_node* node;
+
+  for( node = transport_list->prev; node != transport_list; node = node->prev ){
+    Transport* client = node->t;
+    if( client->negotiated && !client->must_die && !transport_buffered( client ) &&
+        client->batch_count == 0 && client->gateway_waiting == 0 ){
+      transport_remove_from_list( transport_list, client );
+      transport_delete( client );
+      server_nconn --;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// close the connections marked to die
+static void server_reap( void )
+{
+  struct transport_node* node = transport_list;
+
+  while( (node = node->next) != transport_list ){
+    Transport* client = node->t;
+    if( client->must_die ){
+      node = transport_remove_from_list(transport_list,client);
+      transport_delete(client);
+      server_nconn --;
+    }
+  }
+}
+
+// accept every connection queued on the listener. handshakes are not read
+// here: a new worker is answered by rpc_dispatch_worker once its header
+// arrives, like any other request, and dropped if that takes too long.
+// at max_connections an idle connection makes way for the new one; if
+// every connection is busy the new one is closed straight away, so the
+// queue does not keep waking the loop. if accept itself fails (out of
+// descriptors, say) the listener would stay readable, so it is left out of
+// the loop for ACCEPT_RETRY ms.
+static void rpc_dispatch_accept(Transport* listener, const ServerOptions *o)
 {
-  
   struct exception e;
-    // if accepting transport is not open, accept a new connection from the
-      // listening transport
-  Transport* worker = transport_create();
-  worker->timeout = worker->com_timeout;
-  transport_insert_to_list(transport_list,worker);
+  Transport* volatile worker = NULL;
+  int accepted = 1;
+
   Try{
-    transport_accept( listener, worker );
-    server_negotiate( worker );
+    while( accepted ){
+      worker = transport_create();
+      accepted = transport_accept( listener, worker );
+      // only a connection that has actually arrived may evict another
+      if( accepted && ( o->max_connections <= 0 ||
+                        server_nconn < o->max_connections || server_evict() ) ){
+        transport_insert_to_list(transport_list,worker);
+        server_nconn ++;
+        timer_arm( &server_timers, &worker->timer,
+                   timer_now() + o->handshake_timeout );
+      }
+      else
+        transport_delete( worker );
+      worker = NULL;
+    }
   }
   Catch(e){
-    transport_remove_from_list(transport_list,worker);
-    transport_delete( worker );
+    if( worker )
+      transport_delete( worker );
+    if( e.type == fatal ){
+      transport_remove_from_list( transport_list, listener );
+      listener->is_set = 0;
+      accept_paused = listener;
+      timer_arm( &server_timers, &listener->timer, timer_now() + ACCEPT_RETRY );
+    }
   }
 }
 
 
-// rpc_server( transport_identifier )
-static int rpc_server( lua_State *L )
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+// written to on SIGTERM in a forked worker to wake its event loop
+static int stop_pipe[ 2 ] = { -1, -1 };
+// in a forked worker, written to once it is listening (-1 if nobody waits)
+static int ready_pipe = -1;
+static int worker_up;                 // the worker got as far as listening
+#endif
+
+// incremental collection in idle time
+//   once gc_step KB have been allocated since the last cycle finished, the
+//   loop runs lua_gc( LUA_GCSTEP, gc_step ) slices for as long as a poll
+//   finds nothing to do, so garbage is collected between requests rather
+//   than in the middle of one. with gc_pause the collector is kept stopped
+//   while requests are served, unless the heap grows to twice its size after
+//   the last cycle, in which case each wakeup gets one slice.
+static int gc_live;                   // KB in use when the last cycle ended
+static int gc_cycle;                  // a cycle has been started in idle time
+
+static void server_gc_step( lua_State *L, const ServerOptions *o )
 {
-  int shref;
-  Transport *server;
+  gc_cycle = 1;
+  if( lua_gc( L, LUA_GCSTEP, o->gc_step ) ){
+    gc_cycle = 0;
+    gc_live = lua_gc( L, LUA_GCCOUNT, 0 );
+  }
+  // in 5.1 a step re-arms the automatic collector
+  if( o->gc_pause )
+    lua_gc( L, LUA_GCSTOP, 0 );
+}
+
+// set up the allocator and collector as the options ask, before serving
+static void server_gc_init( lua_State *L, const ServerOptions *o )
+{
+  if( o->pool_alloc )
+    memory_install( L, o->max_request_memory );
+  gc_live = lua_gc( L, LUA_GCCOUNT, 0 );
+  gc_cycle = 0;
+  if( o->gc_pause )
+    lua_gc( L, LUA_GCSTOP, 0 );
+}
+
+// wait for work, collecting garbage while there is none. wait is the most
+// ms to wait besides the server's timers (-1 = until one is due)
+static int server_wait( lua_State *L, const ServerOptions *o, int wait )
+{
+  int ready, next;
+
+  while( o->gc_step > 0 && wait != 0 &&
+         ( gc_cycle || lua_gc( L, LUA_GCCOUNT, 0 ) >= gc_live + o->gc_step ) ){
+    if( ( ready = transport_select( transport_list, 0 ) ) != 0 ||
+        timer_next( &server_timers, timer_now() ) == 0 )
+      return ready;
+    server_gc_step( L, o );
+  }
+  next = timer_next( &server_timers, timer_now() );
+  if( wait < 0 || ( next >= 0 && next < wait ) )
+    wait = next;
+  return transport_select( transport_list, wait );
+}
 
+// answer one request from a client, counting the memory it takes
+static void server_serve( lua_State *L, Transport *client )
+{
+  memory_request_begin( client );
+  rpc_dispatch_worker( L, client );
+  memory_request_end();
+}
+
+// stop accepting and answer the requests that have already arrived, then
+// drop the remaining connections. a request counts as arrived if its
+// connection was readable when the drain began, or it came in the same read
+// as one that was; nothing else is read, and once drain_timeout has passed
+// whatever is left is dropped
+static void server_drain( lua_State *L, Transport *server, const ServerOptions *o )
+{
+  uint32_t deadline = timer_now() + o->drain_timeout;
   struct transport_node* node;
 
-  server = server_create( L );
+  transport_remove_from_list( transport_list, server );
+  transport_close( server );
+  if( transport_select( transport_list, 0 ) > 0 ){
+    for( node = transport_list->next; node != transport_list; node = node->next ){
+      Transport* client = node->t;
+      if( !client->is_set )
+        continue;
+      do {
+        int32_t left = ( int32_t )( deadline - timer_now() );
+        if( left <= 0 )
+          break;
+        // the connection is closed afterwards, so its reads may be cut short
+        if( client->com_timeout > ( uint32_t )left )
+          client->com_timeout = ( uint32_t )left;
+        server_serve( L, client );
+      } while( !client->must_die && transport_buffered( client ) );
+    }
+  }
+  while( (node = transport_list->next) != transport_list ){
+    Transport* client = node->t;
+    transport_remove_from_list( transport_list, client );
+    transport_delete( client );
+  }
+}
+
+// listen on the port at stack index 1 and run the event loop until the
+// listener is closed
+static void server_run( lua_State *L, const ServerOptions *o )
+{
+  int shref;
+  Transport *server;
+  Transport *waker = NULL;
+
+  struct transport_node *node, *next;
+
+  server = server_create( L, o->backlog, o->flags );
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+  worker_up = 1;
+  if( ready_pipe != -1 ){
+    char c = 1;
+    ssize_t n = write( ready_pipe, &c, 1 );
+    ( void )n;
+    close( ready_pipe );
+    ready_pipe = -1;
+  }
+#endif
 
   transport_list = transport_new_list();
   transport_insert_to_list( transport_list, server ); 
-  node = transport_list;
+  timer_init( &server_timers, timer_now() );
+  server_nconn = 0;
+  serving = server;
+  draining = 0;
+  server_gc_init( L, o );
   // Anchor handle in the registry
   //   This is needed because garbage collection can steal our handle, 
   //   which isn't otherwise referenced
@@ -343,34 +1157,648 @@ static int rpc_server( lua_State *L )
   
   shref = luaL_ref( L, LUA_REGISTRYINDEX );
   lua_rawgeti(L, LUA_REGISTRYINDEX, shref );
+
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+  if( stop_pipe[ 0 ] != -1 ){
+    waker = transport_create();
+    waker->fd = stop_pipe[ 0 ];
+    transport_insert_to_list( transport_list, waker );
+  }
+#endif
   
   while ( transport_is_open( server ) ){
     //    printf("luarpc: listening on %p\n",(void*)listener);
-    if( transport_select(transport_list) > -1 ){
-      while( (node = node->next) != transport_list ){
+    if( server_wait( L, o, -1 ) > -1 ){
+      for( node = transport_list->next; node != transport_list; node = next ){
         Transport* client = node->t;
-        if( client->is_set && client != server ){
-          rpc_dispatch_worker(L,client);
+        next = node->next;
+        if( client->is_set && client != server && client != waker ){
+          // a client may have written several requests at once
+          do {
+            server_serve(L,client);
+          } while( !client->must_die && transport_buffered( client ) );
+          server_touch( client, o );
         }
       }
-      while( (node = node->next) != transport_list ){
-        Transport* client = node->t;        
-        if( client->must_die ){
-          node = transport_remove_from_list(transport_list,client);
-          transport_delete(client);
+      if( o->gc_pause && lua_gc( L, LUA_GCCOUNT, 0 ) >= 2 * gc_live + o->gc_step )
+        server_gc_step( L, o );
+      timer_advance( &server_timers, timer_now(), server_on_timer );
+      server_reap();
+      if( server->is_set && !draining ){
+        rpc_dispatch_accept(server,o);
+      }
+      if( waker != NULL && ( waker->is_set || draining ) ){
+        transport_remove_from_list( transport_list, waker );
+        transport_delete( waker );
+        waker = NULL;
+        draining = 1;
+      }
+      if( draining )
+        server_drain( L, server, o );
+    }
+  }
+    
+  serving = NULL;
+  accept_paused = NULL;
+  timer_cancel( &server->timer );
+  if( o->gc_pause )
+    lua_gc( L, LUA_GCRESTART, 0 );
+  luaL_unref( L, LUA_REGISTRYINDEX, shref );
+  transport_close(server);
+}
+
+// rpc_drain()
+//   from code running inside rpc.server (a served function, say): once the
+//   current wakeup has been handled, stop accepting, answer the requests
+//   already received, close every connection and return from rpc.server
+static int rpc_drain( lua_State *L )
+{
+  if( serving == NULL )
+    return luaL_error( L, "no server is running" );
+  draining = 1;
+  return 0;
+}
+
+// rpc_memstats()
+//   memory of this state, and with the pooled allocator installed, the
+//   size of its pool and what the request being served (and its
+//   connection) has allocated
+static int rpc_memstats( lua_State *L )
+{
+  memory_push_stats( L );
+  return 1;
+}
+
+// rpc_max_depth( [n] )
+//   deepest nesting of tables and functions that values sent or received
+//   may have; a deeper one fails the call with "data nested too deeply".
+//   n is capped at MAX_DEPTH_LIMIT: each level costs the codec arena a few
+//   bytes for its whole walk
+static int rpc_max_depth( lua_State *L )
+{
+  int n;
+
+  if( lua_gettop( L ) == 0 )
+  {
+    lua_pushnumber( L, value_max_depth );
+    return 1;
+  }
+  n = luaL_checkint( L, 1 );
+  luaL_argcheck( L, n > 0, 1, "must be positive" );
+  value_max_depth = n < MAX_DEPTH_LIMIT ? n : MAX_DEPTH_LIMIT;
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  uint8_t mask;
+} encoding_names[] = {
+  { "refs", ENCODING_REFS },
+  { "strings", ENCODING_STRINGS },
+  { "dict", ENCODING_DICT },
+  { "cache", ENCODING_CACHE },
+  { "arrays", ENCODING_ARRAYS },
+  { "integers", ENCODING_INTEGERS },
+  { "float32", ENCODING_FLOAT32 },
+  { "series", ENCODING_SERIES },
+  { NULL, 0 }
+};
+
+static void push_encoding( lua_State *L, uint8_t features )
+{
+  int i;
+
+  lua_newtable( L );
+  for( i = 0; encoding_names[ i ].name != NULL; i ++ )
+  {
+    lua_pushboolean( L, ( features & encoding_names[ i ].mask ) != 0 );
+    lua_setfield( L, -2, encoding_names[ i ].name );
+  }
+}
+
+// rpc_encoding( [options | handle] )
+//   with a table of booleans, sets the encoding features that new
+//   connections offer (as a client) or accept (as a server); they are used
+//   when both ends have them. without arguments returns the current
+//   setting, and with a client handle what that connection agreed on.
+static int rpc_encoding( lua_State *L )
+{
+  int i;
+
+  if( lua_isuserdata( L, 1 ) && ismetatable_type( L, 1, "rpc.client" ) )
+  {
+    push_encoding( L, ( ( Transport * )lua_touserdata( L, 1 ) )->features );
+    return 1;
+  }
+  if( lua_isnoneornil( L, 1 ) )
+  {
+    push_encoding( L, encoding_features );
+    return 1;
+  }
+  luaL_checktype( L, 1, LUA_TTABLE );
+  for( i = 0; encoding_names[ i ].name != NULL; i ++ )
+  {
+    lua_getfield( L, 1, encoding_names[ i ].name );
+    if( !lua_isnil( L, -1 ) )
+    {
+      if( lua_toboolean( L, -1 ) )
+        encoding_features |= encoding_names[ i ].mask;
+      else
+        encoding_features &= ( uint8_t )~encoding_names[ i ].mask;
+    }
+    lua_pop( L, 1 );
+  }
+  return 0;
+}
+
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+
+// **************************************************************************
+// multi-process servers
+//   with options.workers = N, rpc.server forks N processes that each bind the
+//   port with SO_REUSEPORT and run their own event loop on their own copy of
+//   the Lua state, so the kernel spreads connections across cores. whatever
+//   the script set up before calling rpc.server is the shared bootstrap.
+//   the calling process stays behind as a supervisor: it replaces workers
+//   that die, SIGHUP replaces them all one at a time, and SIGTERM or SIGINT
+//   stops them and returns from rpc.server. a worker sent SIGTERM stops
+//   accepting, answers the requests it has already received and exits.
+
+#define WORKER_INIT_FAILED 3             // exit status: never got to listen
+
+static const int supervisor_signals[] = { SIGCHLD, SIGHUP, SIGTERM, SIGINT };
+#define NUM_SUPERVISOR_SIGNALS 4
+
+static volatile sig_atomic_t supervisor_hup, supervisor_stop;
+
+static void supervisor_on_signal( int sig )
+{
+  if( sig == SIGHUP )
+    supervisor_hup = 1;
+  else if( sig != SIGCHLD )
+    supervisor_stop = 1;
+}
+
+static void worker_on_term( int sig )
+{
+  char c = ( char )sig;
+  ssize_t n = write( stop_pipe[ 1 ], &c, 1 );
+  ( void )n;
+}
+
+static void set_handler( int sig, void ( *handler )( int ), struct sigaction *old )
+{
+  struct sigaction sa;
+  memset( &sa, 0, sizeof( sa ) );
+  sa.sa_handler = handler;
+  sigemptyset( &sa.sa_mask );
+  sigaction( sig, &sa, old );
+}
+
+// the worker's event loop, under lua_pcall: ( port, options )
+static int worker_main( lua_State *L )
+{
+  ServerOptions wo = *( const ServerOptions * )lua_touserdata( L, 2 );
+  struct exception e;
+
+  lua_settop( L, 1 );
+  Try
+  {
+    wo.flags |= LISTEN_REUSEPORT;
+    server_run( L, &wo );
+  }
+  Catch( e )
+  {
+    return luaL_error( L, "%s", error_string( e.errnum ) );
+  }
+  return 0;
+}
+
+// fork worker n (counting from 1). returns the child's pid, or -1 if the
+// fork failed; the child itself never returns. with ready set, *ready is a
+// pipe that gets a byte once the worker is listening, or reaches end of
+// file if it never gets that far.
+static pid_t worker_spawn( lua_State *L, int n, const ServerOptions *o,
+                           const sigset_t *mask, int *ready )
+{
+  int fds[ 2 ] = { -1, -1 };
+  pid_t pid;
+
+  if( ready != NULL && pipe( fds ) != 0 )
+    return -1;
+  fflush( NULL );
+  if( ( pid = fork() ) != 0 ){
+    if( ready != NULL ){
+      close( fds[ 1 ] );
+      if( pid > 0 )
+        *ready = fds[ 0 ];
+      else
+        close( fds[ 0 ] );
+    }
+    return pid;
+  }
+
+  if( ready != NULL )
+    close( fds[ 0 ] );
+  ready_pipe = fds[ 1 ];
+  set_handler( SIGCHLD, SIG_DFL, NULL );
+  set_handler( SIGHUP, SIG_DFL, NULL );
+  set_handler( SIGINT, SIG_IGN, NULL ); // the supervisor passes it on as SIGTERM
+  if( pipe( stop_pipe ) != 0 )
+    _exit( WORKER_INIT_FAILED );
+  set_handler( SIGTERM, worker_on_term, NULL );
+  sigprocmask( SIG_SETMASK, mask, NULL );
+
+  lua_getfield( L, 2, "init" );
+  if( LUA_ISCALLABLE( L, -1 ) ){
+    lua_pushnumber( L, n );
+    if( lua_pcall( L, 1, 0, 0 ) != 0 ){
+      fprintf( stderr, "luarpc: worker %d: %s\n", n, lua_tostring( L, -1 ) );
+      fflush( NULL );
+      _exit( WORKER_INIT_FAILED );
+    }
+  }
+  lua_settop( L, 1 );
+
+  // whatever goes wrong, the child must not return into the script
+  lua_pushcfunction( L, worker_main );
+  lua_insert( L, 1 );
+  lua_pushlightuserdata( L, ( void * )o );
+  if( lua_pcall( L, 2, 0, 0 ) != 0 ){
+    fprintf( stderr, "luarpc: worker %d: %s\n", n, lua_tostring( L, -1 ) );
+    fflush( NULL );
+    _exit( worker_up ? EXIT_FAILURE : WORKER_INIT_FAILED );
+  }
+  fflush( NULL );
+  _exit( 0 );
+}
+
+// wait for a worker spawned with a ready pipe to be listening. returns 0 if
+// it died first
+static int worker_wait_ready( int fd )
+{
+  char c;
+  ssize_t n;
+
+  do {
+    n = read( fd, &c, 1 );
+  } while( n < 0 && errno == EINTR );
+  close( fd );
+  return n == 1;
+}
+
+typedef struct {
+  pid_t pid;                          // -1 while waiting to be replaced
+  uint32_t at;                        // when started, or when to replace it
+} Worker;
+
+static int server_supervise( lua_State *L, int nworkers, const ServerOptions *o )
+{
+  Worker *workers = ( Worker * )lua_newuserdata( L, nworkers * sizeof( Worker ) );
+  struct sigaction old[ NUM_SUPERVISOR_SIGNALS ];
+  sigset_t block, mask, wait_mask;
+  const char *failure = NULL;
+  pid_t pid;
+  int i, status, ready;
+
+  // signals are only taken inside pselect, so none can slip in between
+  // checking the flags and going to sleep
+  sigemptyset( &block );
+  for( i = 0; i < NUM_SUPERVISOR_SIGNALS; i ++ )
+    sigaddset( &block, supervisor_signals[ i ] );
+  sigprocmask( SIG_BLOCK, &block, &mask );
+  wait_mask = mask;
+  for( i = 0; i < NUM_SUPERVISOR_SIGNALS; i ++ ){
+    sigdelset( &wait_mask, supervisor_signals[ i ] );
+    set_handler( supervisor_signals[ i ], supervisor_on_signal, &old[ i ] );
+  }
+  supervisor_hup = supervisor_stop = 0;
+
+  for( i = 0; i < nworkers; i ++ )
+    workers[ i ].pid = -1;
+  for( i = 0; i < nworkers && !failure; i ++ ){
+    workers[ i ].at = timer_now();
+    if( ( workers[ i ].pid = worker_spawn( L, i + 1, o, &mask, NULL ) ) < 0 )
+      failure = "could not fork worker";
+  }
+
+  while( !supervisor_stop && !failure ){
+    uint32_t now = timer_now();
+    int32_t wait = -1;
+
+    // workers that have gone away are replaced, after WORKER_RESPAWN_DELAY
+    // if they did not last that long, so one that keeps dying does not spin
+    while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ){
+      for( i = 0; i < nworkers; i ++ ){
+        if( workers[ i ].pid != pid )
+          continue;
+        workers[ i ].pid = -1;
+        if( WIFEXITED( status ) && WEXITSTATUS( status ) == WORKER_INIT_FAILED )
+          failure = "worker failed to start";
+        else if( now - workers[ i ].at < WORKER_RESPAWN_DELAY )
+          workers[ i ].at = now + WORKER_RESPAWN_DELAY;
+        else
+          workers[ i ].at = now;
+      }
+    }
+    for( i = 0; i < nworkers && !failure; i ++ ){
+      int32_t left = ( int32_t )( workers[ i ].at - now );
+      if( workers[ i ].pid != -1 )
+        continue;
+      if( left > 0 ){
+        if( wait < 0 || left < wait )
+          wait = left;
+        continue;
+      }
+      workers[ i ].at = now;
+      if( ( workers[ i ].pid = worker_spawn( L, i + 1, o, &mask, NULL ) ) < 0 )
+        failure = "could not fork worker";
+    }
+    // rolling restart: each replacement is listening before its
+    // predecessor is told to finish. one that dies first leaves its
+    // predecessor serving
+    if( supervisor_hup && !failure ){
+      supervisor_hup = 0;
+      for( i = 0; i < nworkers && !failure; i ++ ){
+        pid_t prev = workers[ i ].pid;
+        if( ( pid = worker_spawn( L, i + 1, o, &mask, &ready ) ) < 0 ){
+          failure = "could not fork worker";
+          break;
+        }
+        if( worker_wait_ready( ready ) ){
+          workers[ i ].pid = pid;
+          workers[ i ].at = timer_now();
+          if( prev > 0 ){
+            kill( prev, SIGTERM );
+            waitpid( prev, &status, 0 );
+          }
+        }
+        else {
+          waitpid( pid, &status, 0 );
+          if( WIFEXITED( status ) && WEXITSTATUS( status ) == WORKER_INIT_FAILED )
+            failure = "worker failed to start";
+        }
+      }
+    }
+    if( !supervisor_stop && !failure ){
+      struct timespec ts;
+      ts.tv_sec = wait / 1000;
+      ts.tv_nsec = ( wait % 1000 ) * 1000000L;
+      pselect( 0, NULL, NULL, NULL, wait < 0 ? NULL : &ts, &wait_mask );
+    }
+  }
+
+  for( i = 0; i < nworkers; i ++ )
+    if( workers[ i ].pid > 0 )
+      kill( workers[ i ].pid, SIGTERM );
+  for( i = 0; i < nworkers; i ++ )
+    if( workers[ i ].pid > 0 )
+      waitpid( workers[ i ].pid, &status, 0 );
+
+  for( i = 0; i < NUM_SUPERVISOR_SIGNALS; i ++ )
+    sigaction( supervisor_signals[ i ], &old[ i ], NULL );
+  sigprocmask( SIG_SETMASK, &mask, NULL );
+
+  if( failure )
+    return luaL_error( L, failure );
+  return 0;
+}
+
+#endif
+
+// rpc_server( transport_identifier [, options ] )
+//   options.backlog    connections the OS may queue (default MAXCON)
+//   options.reuseport  let other processes listen on the same port
+//   options.workers    serve from this many forked processes (see above)
+//   options.init       function( n ) run in worker n before it serves
+//   options.handshake_timeout
+//                      ms a new connection has to send its header
+//                      (default HANDSHAKE_TIMEOUT)
+//   options.idle_timeout
+//                      ms before an unused connection is closed (default
+//                      0 = never)
+//   options.max_connections
+//                      at most this many open connections; the least
+//                      recently used idle one is closed to admit a new
+//                      one (default 0 = no limit)
+//   options.drain_timeout
+//                      ms rpc.drain has to answer the requests already
+//                      received (default DRAIN_TIMEOUT)
+//   options.pool_alloc install the pooled Lua allocator
+//   options.max_request_memory
+//                      bytes a request may allocate while its handler
+//                      runs (default 0 = no limit; implies pool_alloc)
+//   options.gc_step    KB of collection per slice run while the server is
+//                      idle (default 0 = leave the collector alone)
+//   options.gc_pause   with gc_step, only collect in idle time unless the
+//                      heap doubles
+static int rpc_server( lua_State *L )
+{
+  ServerOptions o;
+
+  server_options( L, 2, &o );
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+  if( opt_number( L, 2, "workers", 0 ) >= 1 )
+    return server_supervise( L, ( int )opt_number( L, 2, "workers", 0 ), &o );
+#endif
+
+  lua_settop( L, 1 );
+  server_run( L, &o );
+  return 0;
+}
+
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+
+// start a new session on the device link after a failure. whatever was in
+// flight is thrown away first, so stale replies cannot be taken for the
+// header. the link is out of the event loop until the device answers.
+// returns 0 if it did not; the first such failure after the link was up
+// (was_up) is reported on stderr, the retries that follow are not
+static int gateway_reconnect( Transport *link, GatewayQueue *q, int was_up )
+{
+  struct exception e;
+  int ok = 1;
+
+  gateway_fail( q );
+  transport_remove_from_list( transport_list, link );
+  arena_reset( &link->arena );
+  transport_discard_serial( link );
+  Try
+  {
+    transport_set_timeout( link, link->com_timeout );
+    client_negotiate( link );
+    transport_insert_to_list( transport_list, link );
+  }
+  Catch( e )
+  {
+    ok = 0;
+    if( was_up )
+      fprintf( stderr, "luarpc: gateway: device link down: %s\n",
+               error_string( e.errnum ) );
+  }
+  return ok;
+}
+
+// the sooner of a wait in ms (-1 = none) and a due time
+static int gateway_wait( int wait, uint32_t due )
+{
+  int32_t left = ( int32_t )( due - timer_now() );
+
+  if( left < 0 )
+    left = 0;
+  return ( wait < 0 || wait > left ) ? left : wait;
+}
+
+// rpc_gateway( port, serial_path [, options ] )
+//   serve many socket clients from a single device on a serial port. each
+//   wakeup reads one request from every ready client and writes them to the
+//   device in arrival order; replies are routed back as they come in, while
+//   the loop carries on serving. at most GATEWAY_MAX_PIPELINE requests are
+//   waiting on the device at once: clients with more are parked, out of the
+//   event loop, until there is room. if the device takes longer than
+//   wait_timeout to answer, or the link fails, the waiting clients are
+//   dropped and the link is renegotiated every GATEWAY_RETRY ms until the
+//   device answers. options are as for rpc.server, except that workers,
+//   drain_timeout and max_request_memory have no effect: no handlers run
+//   here, so there is nothing to drain or cap (pool_alloc still applies).
+static int rpc_gateway( lua_State *L )
+{
+  struct exception e;
+  ServerOptions o;
+  int shref, nreq;
+  int link_up = 1;
+  uint32_t retry_at = 0;
+  Transport *server;
+  const char *path = luaL_checkstring( L, 2 );
+  Transport * volatile link = NULL;
+  GatewayRequest reqs[ GATEWAY_MAX_PIPELINE ];
+  GatewayQueue q;
+  struct transport_node *parked;
+  struct transport_node *node, *next;
+
+  Try
+  {
+    link = transport_create();
+    transport_set_timeout( link, link->com_timeout );
+    transport_open_serial( link, path );
+    client_negotiate( link );
+  }
+  Catch( e )
+  {
+    if( link != NULL )
+      transport_delete( link );
+    return luaL_error( L, error_string( e.errnum ) );
+  }
+  server_options( L, 3, &o );
+  lua_settop( L, 1 );
+
+  server = server_create( L, o.backlog, o.flags );
+
+  transport_list = transport_new_list();
+  parked = transport_new_list();
+  transport_insert_to_list( transport_list, server ); 
+  transport_insert_to_list( transport_list, link );
+  timer_init( &server_timers, timer_now() );
+  server_nconn = 0;
+  q.head = q.count = 0;
+  server_gc_init( L, &o );
+  shref = luaL_ref( L, LUA_REGISTRYINDEX );
+
+  while ( transport_is_open( server ) ){
+    int wait = -1;
+    int room;
+    if( q.count > 0 )
+      wait = gateway_wait( wait, q.due );
+    if( !link_up )
+      wait = gateway_wait( wait, retry_at );
+    if( server_wait( L, &o, wait ) > -1 ){
+      int top = lua_gettop( L );
+      if( !link_up && ( int32_t )( retry_at - timer_now() ) <= 0 ){
+        link_up = gateway_reconnect( link, &q, 0 );
+        retry_at = timer_now() + GATEWAY_RETRY;
+      }
+      else if( link_up && link->is_set ){
+        Try
+        {
+          gateway_receive( L, link, &q );
+        }
+        Catch( e )
+        {
+          link_up = gateway_reconnect( link, &q, 1 );
+          retry_at = timer_now() + GATEWAY_RETRY;
+        }
+        lua_settop( L, top );
+      }
+      if( link_up && q.count > 0 && ( int32_t )( q.due - timer_now() ) <= 0 ){
+        link_up = gateway_reconnect( link, &q, 1 );
+        retry_at = timer_now() + GATEWAY_RETRY;
+      }
+
+      // parked clients come back once there is room. they still have
+      // is_set from when they were parked, so they are read below
+      room = link_up ? GATEWAY_MAX_PIPELINE - q.count : 0;
+      while( room > 0 && (node = parked->next) != parked ){
+        Transport* client = node->t;
+        transport_remove_from_list( parked, client );
+        transport_insert_to_list( transport_list, client );
+      }
+      nreq = 0;
+      for( node = transport_list->next; node != transport_list; node = next ){
+        Transport* client = node->t;
+        next = node->next;
+        if( !client->is_set || client->must_die || client == server || client == link )
+          continue;
+        if( nreq < room ){
+          memory_request_begin( client );
+          nreq += gateway_read_request( L, client, reqs, nreq );
+          memory_request_end();
+          server_touch( client, &o );
+        }
+        else if( !client->must_die ){
+          transport_remove_from_list( transport_list, client );
+          transport_insert_to_list( parked, client );
         }
       }
+      Try
+      {
+        gateway_send( L, link, reqs, nreq, &q );
+      }
+      Catch( e )
+      {
+        link_up = gateway_reconnect( link, &q, 1 );
+        retry_at = timer_now() + GATEWAY_RETRY;
+      }
+      lua_settop( L, top );
+      if( o.gc_pause && lua_gc( L, LUA_GCCOUNT, 0 ) >= 2 * gc_live + o.gc_step )
+        server_gc_step( L, &o );
+      timer_advance( &server_timers, timer_now(), server_on_timer );
+      server_reap();
       if( server->is_set ){
-        rpc_dispatch_accept(server);     
+        rpc_dispatch_accept(server,&o);
       }
     }
   }
-    
+
+  gateway_fail( &q );
+  while( (node = parked->next) != parked ){
+    Transport* client = node->t;
+    transport_remove_from_list( parked, client );
+    transport_delete( client );
+  }
+  free( parked );
+  transport_remove_from_list( transport_list, link );
+  transport_delete( link );
+  accept_paused = NULL;
+  timer_cancel( &server->timer );
+  if( o.gc_pause )
+    lua_gc( L, LUA_GCRESTART, 0 );
   luaL_unref( L, LUA_REGISTRYINDEX, shref );
   transport_close(server);
   return 0;
 }
 
+#endif
+
 // **************************************************************************
 // more error handling stuff 
 
@@ -561,7 +1989,13 @@ const LUA_REG_TYPE rpc_map[] =
   {  LSTRKEY( "connect" ), LFUNCVAL( rpc_connect ) },
   {  LSTRKEY( "close" ), LFUNCVAL( rpc_close ) },
   {  LSTRKEY( "server" ), LFUNCVAL( rpc_server ) },
+  {  LSTRKEY( "drain" ), LFUNCVAL( rpc_drain ) },
+  {  LSTRKEY( "memstats" ), LFUNCVAL( rpc_memstats ) },
+  {  LSTRKEY( "max_depth" ), LFUNCVAL( rpc_max_depth ) },
+  {  LSTRKEY( "encoding" ), LFUNCVAL( rpc_encoding ) },
   {  LSTRKEY( "on_error" ), LFUNCVAL( rpc_on_error ) },
+  {  LSTRKEY( "batch" ), LFUNCVAL( rpc_batch ) },
+  {  LSTRKEY( "flush" ), LFUNCVAL( rpc_flush ) },
   //  {  LSTRKEY( "listen" ), LFUNCVAL( rpc_listen ) },
   //  {  LSTRKEY( "peek" ), LFUNCVAL( rpc_peek ) },
   //  {  LSTRKEY( "dispatch" ), LFUNCVAL( rpc_dispatch ) },
@@ -616,32 +2050,82 @@ static const luaL_reg rpc_helper_mt[] =
 };
 
 
+#ifdef LUARPC_ENABLE_SOCKET
+static const luaL_reg rpc_pool_methods[] =
+{
+  { "checkout", pool_checkout_method },
+  { "checkin", pool_checkin_method },
+  { "call", pool_call_method },
+  { "close", pool_close_method },
+  { NULL, NULL }
+};
+#endif
+
 static const luaL_reg rpc_map[] =
 {
   { "client", rpc_client },
   { "close", rpc_close },
   { "server", rpc_server },
+  { "drain", rpc_drain },
+  { "memstats", rpc_memstats },
+  { "max_depth", rpc_max_depth },
+  { "encoding", rpc_encoding },
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+  { "gateway", rpc_gateway },
+#endif
   { "on_error", rpc_on_error },
   { "com_timeout", rpc_com_timeout },
   { "wait_timeout", rpc_wait_timeout },
+  { "batch", rpc_batch },
+  { "flush", rpc_flush },
+#ifdef LUARPC_ENABLE_SOCKET
+  { "pool", rpc_pool },
+#endif
   { NULL, NULL }
 };
 
 
+#if LUA_VERSION_NUM >= 502
+// luaL_register is gone: with a name, make the module table (also the
+// global of that name, as 5.1 did); without, fill the table on top
+static void register_funcs( lua_State *L, const char *name, const luaL_Reg *l )
+{
+  if( name != NULL )
+  {
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setglobal( L, name );
+  }
+  luaL_setfuncs( L, l, 0 );
+}
+#else
+#define register_funcs luaL_register
+#endif
+
 LUALIB_API int luaopen_rpc(lua_State *L)
 {
-  luaL_register( L, "rpc", rpc_map );
+  register_funcs( L, "rpc", rpc_map );
   lua_pushstring(L, LUARPC_MODE);
   lua_setfield(L, -2, "mode");
 
   luaL_newmetatable( L, "rpc.helper" );
-  luaL_register( L, NULL, rpc_helper_mt );
+  register_funcs( L, NULL, rpc_helper_mt );
   
   luaL_newmetatable( L, "rpc.client" );
-  luaL_register( L, NULL, rpc_client_mt );
+  register_funcs( L, NULL, rpc_client_mt );
   
   luaL_newmetatable( L, "rpc.server_handle" );
 
+#ifdef LUARPC_ENABLE_SOCKET
+  luaL_newmetatable( L, "rpc.pool" );
+  lua_newtable( L );
+  register_funcs( L, NULL, rpc_pool_methods );
+  lua_setfield( L, -2, "__index" );
+
+  lua_newtable( L );
+  lua_setfield( L, LUA_REGISTRYINDEX, "rpc.pools" );
+#endif
+
 #ifdef WIN32
   net_startup();
 #endif
@@ -0,0 +1,301 @@
+/*****************************************************************************
+* Lua-RPC library, Copyright (C) 2001 Russell L. Smith. All rights reserved. *
+*   Email: russ@q12.org   Web: www.q12.org                                   *
+* For documentation, see http://www.q12.org/lua. For the license agreement,  *
+* see the file LICENSE that comes with this distribution.                    *
+*****************************************************************************/
+
+// Pooled Lua allocator
+//   installed on the server's state by the pool_alloc option of rpc.server.
+//   blocks up to MEMPOOL_MAX_BLOCK bytes are rounded up to a size class and
+//   recycled through a free list per class, so handlers that build and drop
+//   tables reuse memory instead of going back to malloc. they are carved out
+//   of MEMPOOL_CHUNK_SIZE chunks, which are kept for the life of the
+//   process. larger blocks, and every block allocated before the pool was
+//   installed, are left to the state's original allocator: a pooled block
+//   is recognised by its chunk, which is aligned to its own size and
+//   recorded in a hash set.
+//
+//   every change in size is counted against the request being served and
+//   its connection. while a handler runs, growing the request past its cap
+//   fails, which Lua raises in the handler as a memory error.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "luarpc_rpc.h"
+
+#define CLASS_SHIFT 3                    // sizes are looked up in steps of 8
+#define NUM_SIZES ( ( MEMPOOL_MAX_BLOCK >> CLASS_SHIFT ) + 1 )
+#define CLASS_OF( n ) ( pool.size_class[ ( ( n ) + 7 ) >> CLASS_SHIFT ] )
+
+static const uint16_t class_size[] = {
+  16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 448, 512
+};
+#define NUM_CLASSES ( ( int )( sizeof( class_size ) / sizeof( class_size[ 0 ] ) ) )
+
+typedef struct _FreeBlock FreeBlock;
+struct _FreeBlock {
+  FreeBlock *next;
+};
+
+static struct {
+  lua_Alloc base;                        // the state's own allocator
+  void *base_ud;
+  uint8_t size_class[ NUM_SIZES ];
+  FreeBlock *free[ NUM_CLASSES ];
+  char *carve, *carve_end;               // unused end of the newest chunk
+  uintptr_t *chunks;                     // hash set of chunk addresses
+  size_t nchunks, chunk_slots;
+  size_t in_use;                         // bytes held by the state
+  size_t pooled;                         // bytes on the free lists
+  Transport *tpt;                        // connection being served, or NULL
+  long request;                          // net bytes allocated by its request
+  size_t cap;                            // request cap, 0 = none
+  int limited;                           // a handler is running
+} pool;
+
+static size_t chunk_hash( uintptr_t base )
+{
+  return ( size_t )( ( base / MEMPOOL_CHUNK_SIZE ) * 2654435761u ) &
+         ( pool.chunk_slots - 1 );
+}
+
+static int chunk_owned( void *p )
+{
+  uintptr_t base = ( uintptr_t )p & ~( uintptr_t )( MEMPOOL_CHUNK_SIZE - 1 );
+  size_t i;
+
+  if( pool.nchunks == 0 )
+    return 0;
+  for( i = chunk_hash( base ); pool.chunks[ i ] != 0; i = ( i + 1 ) & ( pool.chunk_slots - 1 ) )
+    if( pool.chunks[ i ] == base )
+      return 1;
+  return 0;
+}
+
+static void chunk_insert( uintptr_t base )
+{
+  size_t i = chunk_hash( base );
+
+  while( pool.chunks[ i ] != 0 )
+    i = ( i + 1 ) & ( pool.chunk_slots - 1 );
+  pool.chunks[ i ] = base;
+  pool.nchunks ++;
+}
+
+// record a new chunk, keeping the set at most half full
+static int chunk_add( uintptr_t base )
+{
+  if( ( pool.nchunks + 1 ) * 2 > pool.chunk_slots )
+  {
+    uintptr_t *old = pool.chunks;
+    size_t i, nold = pool.chunk_slots;
+    size_t n = nold > 0 ? nold * 2 : 64;
+    uintptr_t *chunks = ( uintptr_t * )calloc( n, sizeof( uintptr_t ) );
+
+    if( chunks == NULL )
+      return 0;
+    pool.chunks = chunks;
+    pool.chunk_slots = n;
+    pool.nchunks = 0;
+    for( i = 0; i < nold; i ++ )
+      if( old[ i ] != 0 )
+        chunk_insert( old[ i ] );
+    free( old );
+  }
+  chunk_insert( base );
+  return 1;
+}
+
+static char *chunk_new( void )
+{
+  void *p;
+
+#if defined( WIN32 )
+  p = _aligned_malloc( MEMPOOL_CHUNK_SIZE, MEMPOOL_CHUNK_SIZE );
+#else
+  if( posix_memalign( &p, MEMPOOL_CHUNK_SIZE, MEMPOOL_CHUNK_SIZE ) != 0 )
+    p = NULL;
+#endif
+  if( p != NULL && !chunk_add( ( uintptr_t )p ) )
+  {
+#if defined( WIN32 )
+    _aligned_free( p );
+#else
+    free( p );
+#endif
+    p = NULL;
+  }
+  return ( char * )p;
+}
+
+static void *block_alloc( int c )
+{
+  size_t size = class_size[ c ];
+  FreeBlock *b = pool.free[ c ];
+
+  if( b != NULL )
+  {
+    pool.free[ c ] = b->next;
+    pool.pooled -= size;
+    return b;
+  }
+  if( pool.carve == NULL || ( size_t )( pool.carve_end - pool.carve ) < size )
+  {
+    char *chunk = chunk_new();
+    if( chunk == NULL )
+      return NULL;
+    pool.carve = chunk;
+    pool.carve_end = chunk + MEMPOOL_CHUNK_SIZE;
+  }
+  b = ( FreeBlock * )pool.carve;
+  pool.carve += size;
+  return b;
+}
+
+static void block_free( void *p, int c )
+{
+  FreeBlock *b = ( FreeBlock * )p;
+
+  b->next = pool.free[ c ];
+  pool.free[ c ] = b;
+  pool.pooled += class_size[ c ];
+}
+
+static void *pool_alloc( void *ud, void *ptr, size_t osize, size_t nsize )
+{
+  void *p;
+
+  ( void )ud;
+  if( ptr == NULL )
+    osize = 0;
+  if( nsize > osize && pool.limited && pool.cap > 0 &&
+      pool.request + ( long )( nsize - osize ) > ( long )pool.cap )
+    return NULL;
+
+  if( ptr != NULL && osize <= MEMPOOL_MAX_BLOCK && chunk_owned( ptr ) )
+  {
+    int oc = CLASS_OF( osize );
+
+    if( nsize == 0 )
+    {
+      block_free( ptr, oc );
+      p = NULL;
+    }
+    else if( nsize <= MEMPOOL_MAX_BLOCK && CLASS_OF( nsize ) == oc )
+      p = ptr;
+    else
+    {
+      if( nsize <= MEMPOOL_MAX_BLOCK )
+        p = block_alloc( CLASS_OF( nsize ) );
+      else
+        p = pool.base( pool.base_ud, NULL, 0, nsize );
+      if( p == NULL )
+      {
+        // Lua does not expect shrinking to fail: keep the bigger block
+        if( nsize < osize )
+          p = ptr;
+        else
+          return NULL;
+      }
+      else
+      {
+        memcpy( p, ptr, osize < nsize ? osize : nsize );
+        block_free( ptr, oc );
+      }
+    }
+  }
+  else if( ptr == NULL && nsize > 0 && nsize <= MEMPOOL_MAX_BLOCK )
+  {
+    p = block_alloc( CLASS_OF( nsize ) );
+    if( p == NULL )
+      return NULL;
+  }
+  else
+  {
+    p = pool.base( pool.base_ud, ptr, osize, nsize );
+    if( p == NULL && nsize > 0 )
+      return NULL;
+  }
+
+  pool.in_use += nsize - osize;
+  if( pool.tpt != NULL )
+  {
+    pool.request += ( long )nsize - ( long )osize;
+    if( nsize > osize )
+      pool.tpt->mem_allocated += ( uint32_t )( nsize - osize );
+  }
+  return p;
+}
+
+void memory_install( lua_State *L, size_t request_cap )
+{
+  void *ud;
+  lua_Alloc f = lua_getallocf( L, &ud );
+
+  if( f != pool_alloc )
+  {
+    int c = 0, s;
+
+    for( s = 0; s < NUM_SIZES; s ++ )
+    {
+      while( class_size[ c ] < ( s << CLASS_SHIFT ) )
+        c ++;
+      pool.size_class[ s ] = ( uint8_t )c;
+    }
+    pool.base = f;
+    pool.base_ud = ud;
+    pool.in_use = ( size_t )lua_gc( L, LUA_GCCOUNT, 0 ) * 1024 +
+                  ( size_t )lua_gc( L, LUA_GCCOUNTB, 0 );
+    lua_setallocf( L, pool_alloc, NULL );
+  }
+  pool.cap = request_cap;
+}
+
+void memory_request_begin( Transport *tpt )
+{
+  pool.tpt = tpt;
+  pool.request = 0;
+}
+
+void memory_request_end( void )
+{
+  pool.tpt = NULL;
+  pool.limited = 0;
+}
+
+void memory_limit( int on )
+{
+  pool.limited = on;
+}
+
+void memory_push_stats( lua_State *L )
+{
+  void *ud;
+  int installed = lua_getallocf( L, &ud ) == pool_alloc;
+
+  lua_newtable( L );
+  lua_pushnumber( L, installed ? ( lua_Number )pool.in_use :
+                  ( lua_Number )lua_gc( L, LUA_GCCOUNT, 0 ) * 1024 +
+                  ( lua_Number )lua_gc( L, LUA_GCCOUNTB, 0 ) );
+  lua_setfield( L, -2, "memory" );
+  if( !installed )
+    return;
+  lua_pushnumber( L, ( lua_Number )pool.nchunks * MEMPOOL_CHUNK_SIZE );
+  lua_setfield( L, -2, "pool_chunks" );
+  lua_pushnumber( L, ( lua_Number )pool.pooled );
+  lua_setfield( L, -2, "pool_free" );
+  lua_pushnumber( L, ( lua_Number )pool.cap );
+  lua_setfield( L, -2, "request_cap" );
+  if( pool.tpt != NULL )
+  {
+    lua_pushnumber( L, ( lua_Number )pool.request );
+    lua_setfield( L, -2, "request" );
+    lua_pushnumber( L, ( lua_Number )pool.tpt->mem_allocated );
+    lua_setfield( L, -2, "connection" );
+  }
+}
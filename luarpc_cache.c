@@ -0,0 +1,197 @@
+/*****************************************************************************
+* Lua-RPC library, Copyright (C) 2001 Russell L. Smith. All rights reserved. *
+*   Email: russ@q12.org   Web: www.q12.org                                   *
+* For documentation, see http://www.q12.org/lua. For the license agreement,  *
+* see the file LICENSE that comes with this distribution.                    *
+*****************************************************************************/
+
+// Content cache
+//   with ENCODING_CACHE a client sends a large argument once per connection
+//   with its xxh64 hash; the server keeps the decoded value, and the next
+//   time the client only sends the hash. both ends run the same least
+//   recently used replacement over CACHE_ENTRIES slots, so the client always
+//   knows what the server holds and a hash never misses. the server's values
+//   live in the registry table "rpc.cache", one table per connection id;
+//   those of connections that are gone are dropped whenever a connection
+//   stores its first value.
+
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#include "luarpc_rpc.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64( x, r ) ( ( ( x ) << ( r ) ) | ( ( x ) >> ( 64 - ( r ) ) ) )
+
+static uint64_t read64( const uint8_t *p )
+{
+  return ( uint64_t )p[ 0 ] | ( uint64_t )p[ 1 ] << 8 | ( uint64_t )p[ 2 ] << 16 |
+         ( uint64_t )p[ 3 ] << 24 | ( uint64_t )p[ 4 ] << 32 | ( uint64_t )p[ 5 ] << 40 |
+         ( uint64_t )p[ 6 ] << 48 | ( uint64_t )p[ 7 ] << 56;
+}
+
+static uint32_t read32( const uint8_t *p )
+{
+  return ( uint32_t )p[ 0 ] | ( uint32_t )p[ 1 ] << 8 | ( uint32_t )p[ 2 ] << 16 |
+         ( uint32_t )p[ 3 ] << 24;
+}
+
+static uint64_t xxh_round( uint64_t acc, uint64_t input )
+{
+  acc += input * PRIME64_2;
+  acc = ROTL64( acc, 31 );
+  return acc * PRIME64_1;
+}
+
+static uint64_t xxh_merge( uint64_t acc, uint64_t val )
+{
+  acc ^= xxh_round( 0, val );
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+// xxh64 of len bytes at data, seed 0
+uint64_t cache_hash (const void *data, size_t len)
+{
+  const uint8_t *p = ( const uint8_t * )data;
+  const uint8_t *end = p + len;
+  uint64_t h;
+
+  if( len >= 32 )
+  {
+    const uint8_t *limit = end - 32;
+    uint64_t v1 = PRIME64_1 + PRIME64_2;
+    uint64_t v2 = PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - PRIME64_1;
+
+    do
+    {
+      v1 = xxh_round( v1, read64( p ) );
+      v2 = xxh_round( v2, read64( p + 8 ) );
+      v3 = xxh_round( v3, read64( p + 16 ) );
+      v4 = xxh_round( v4, read64( p + 24 ) );
+      p += 32;
+    } while( p <= limit );
+    h = ROTL64( v1, 1 ) + ROTL64( v2, 7 ) + ROTL64( v3, 12 ) + ROTL64( v4, 18 );
+    h = xxh_merge( h, v1 );
+    h = xxh_merge( h, v2 );
+    h = xxh_merge( h, v3 );
+    h = xxh_merge( h, v4 );
+  }
+  else
+    h = PRIME64_5;
+  h += ( uint64_t )len;
+
+  for( ; p + 8 <= end; p += 8 )
+  {
+    h ^= xxh_round( 0, read64( p ) );
+    h = ROTL64( h, 27 ) * PRIME64_1 + PRIME64_4;
+  }
+  if( p + 4 <= end )
+  {
+    h ^= ( uint64_t )read32( p ) * PRIME64_1;
+    h = ROTL64( h, 23 ) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for( ; p < end; p ++ )
+  {
+    h ^= *p * PRIME64_5;
+    h = ROTL64( h, 11 ) * PRIME64_1;
+  }
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+int cache_find (Cache *c, uint64_t h)
+{
+  int i;
+
+  for( i = 0; i < CACHE_ENTRIES; i ++ )
+    if( c->used[ i ] != 0 && c->hash[ i ] == h )
+    {
+      c->used[ i ] = ++ c->clock;
+      return i;
+    }
+  return -1;
+}
+
+int cache_insert (Cache *c, uint64_t h)
+{
+  int i, victim = 0;
+
+  for( i = 1; i < CACHE_ENTRIES; i ++ )
+    if( c->used[ i ] < c->used[ victim ] )
+      victim = i;
+  c->hash[ victim ] = h;
+  c->used[ victim ] = ++ c->clock;
+  return victim;
+}
+
+// push the table of tpt's values, creating it (and so first dropping
+// those of dead connections) if create is set. pushes nil if there is none
+static void cache_values (lua_State *L, Transport *tpt, int create)
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, "rpc.cache" );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, "rpc.cache" );
+  }
+  lua_pushnumber( L, tpt->id );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) && create )
+  {
+    lua_pop( L, 1 );
+    lua_pushnil( L );
+    while( lua_next( L, -2 ) )
+    {
+      lua_pop( L, 1 );
+      if( transport_from_id( ( uint32_t )lua_tonumber( L, -1 ) ) == NULL )
+      {
+        lua_pushvalue( L, -1 );
+        lua_pushnil( L );
+        lua_rawset( L, -4 );
+      }
+    }
+    lua_newtable( L );
+    lua_pushnumber( L, tpt->id );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  lua_remove( L, -2 );
+}
+
+void cache_store (lua_State *L, Transport *tpt, int slot)
+{
+  cache_values( L, tpt, 1 );
+  lua_pushvalue( L, -2 );
+  lua_rawseti( L, -2, slot + 1 );
+  lua_pop( L, 1 );
+}
+
+// push the value kept in slot. it is the very table decoded when it was
+// stored, not a copy, so every call that sends its hash gets the same
+// object: served functions must treat cached arguments as read-only (see
+// README). functions are never cached, so none is shared this way.
+void cache_push (lua_State *L, Transport *tpt, int slot)
+{
+  cache_values( L, tpt, 0 );
+  if( lua_istable( L, -1 ) )
+    lua_rawgeti( L, -1, slot + 1 );
+  else
+    lua_pushnil( L );
+  lua_remove( L, -2 );
+}
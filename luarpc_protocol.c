@@ -16,14 +16,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-
-#ifdef __MINGW32__
-void *alloca(size_t);
-#elif WIN32
-#define alloca _alloca
-#else
-#include <alloca.h>
-#endif
+#include <math.h>
+#include <float.h>
 
 #include "lua.h"
 #include "lualib.h"
@@ -71,7 +65,16 @@ enum {
   RPC_TABLE_END,
   RPC_FUNCTION,
   RPC_FUNCTION_END,
-  RPC_REMOTE
+  RPC_REMOTE,
+  RPC_REF,                               // table already sent in this message
+  RPC_STRING_REF,                        // string already sent, u8 number
+  RPC_STRING_REF16,                      // string already sent, u16 number
+  RPC_DICT,                              // string in the connection dictionary
+  RPC_CACHE_STORE,                       // argument for the content cache
+  RPC_CACHED,                            // argument from the content cache
+  RPC_ARRAY,                             // table starting with a block of numbers
+  RPC_INTEGER,                           // integer, zigzag varint
+  RPC_FLOAT32                            // number rounded to single precision
 };
 
 // RPC Commands
@@ -91,7 +94,9 @@ enum
   RPC_DONE
 };
 
-enum { RPC_PROTOCOL_VERSION = 3 };
+// a version 3 header has no features byte, and is still what a client
+// that wants no encoding features sends
+enum { RPC_PROTOCOL_VERSION = 4, RPC_PROTOCOL_VERSION_PLAIN = 3 };
 
 
 // return a string representation of an error number 
@@ -107,6 +112,7 @@ const char * error_string( int n )
     case ERR_HEADER: return "header exchanged failed";
     case ERR_LONGFNAME: return "function name too long";
     case ERR_TIMEOUT: return "timeout";
+    case ERR_DEPTH: return "data nested too deeply";
     default: return transport_strerror( n );
   }
 }
@@ -115,6 +121,18 @@ const char * error_string( int n )
 // **************************************************************************
 // transport layer generics
 
+void transport_set_timeout( Transport *tpt, uint32_t ms )
+{
+  tpt->deadline = timer_now() + ms;
+}
+
+// ms left before the current operation's deadline, 0 once it has passed
+uint32_t transport_remaining( Transport *tpt )
+{
+  uint32_t left = tpt->deadline - timer_now();
+  return ( int32_t )left > 0 ? left : 0;
+}
+
 // read arbitrary length from the transport into a string buffer. 
 void transport_read_string( Transport *tpt, char *buffer, int length )
 {
@@ -122,10 +140,64 @@ void transport_read_string( Transport *tpt, char *buffer, int length )
 }
 
 
+// a value being encoded for the content cache is collected here instead of
+// being written to its transport, to be hashed before it is sent
+static struct {
+  Transport *tpt;                        // NULL when not capturing
+  uint8_t *buf;
+  size_t len, size;
+  int overflow;                          // would pass CACHE_MAX_SIZE
+  int functions;                         // holds a function, so is not cached
+} capture;
+
+static void codec_write( Transport *tpt, const uint8_t *buffer, int length )
+{
+  if( tpt != capture.tpt )
+  {
+    transport_write_buffer( tpt, buffer, length );
+    return;
+  }
+  if( capture.overflow )
+    return;
+  if( capture.len + length > capture.size )
+  {
+    size_t size = capture.size > 0 ? capture.size : IOBUF_SIZE;
+    uint8_t *buf;
+
+    while( size < capture.len + length )
+      size *= 2;
+    if( size > CACHE_MAX_SIZE )
+      size = CACHE_MAX_SIZE;
+    if( capture.len + length > size ||
+        ( buf = ( uint8_t * )realloc( capture.buf, size ) ) == NULL )
+    {
+      capture.overflow = 1;
+      return;
+    }
+    capture.buf = buf;
+    capture.size = size;
+  }
+  memcpy( capture.buf + capture.len, buffer, length );
+  capture.len += length;
+}
+
+// done with the captured value; a big buffer is not kept around
+static void capture_end( void )
+{
+  capture.tpt = NULL;
+  capture.len = 0;
+  if( capture.size > 16 * IOBUF_SIZE )
+  {
+    free( capture.buf );
+    capture.buf = NULL;
+    capture.size = 0;
+  }
+}
+
 // write arbitrary length string buffer to the transport 
 void transport_write_string( Transport *tpt, const char *buffer, int length )
 {
-  transport_write_buffer( tpt, ( uint8_t * )buffer, length );
+  codec_write( tpt, ( uint8_t * )buffer, length );
 }
 
 
@@ -145,18 +217,12 @@ void transport_write_uint8_t( Transport *tpt, uint8_t x )
 {
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
-  transport_write_buffer( tpt, &x, 1 );
+  codec_write( tpt, &x, 1 );
 }
 
 static void swap_bytes( uint8_t *number, size_t numbersize )
 {
-  int i;
-  for ( i = 0 ; i < numbersize / 2 ; i ++ )
-  {
-    uint8_t temp = number[ i ];
-    number[ i ] = number[ numbersize - 1 - i ];
-    number[ numbersize - 1 - i ] = temp;
-  }
+  swap_block( number, 1, numbersize );
 }
 
 union uint32_t_bytes {
@@ -186,14 +252,20 @@ void transport_write_uint32_t( Transport *tpt, uint32_t x )
   ub.i = ( uint32_t )x;
   if( tpt->net_little != tpt->loc_little )
     swap_bytes( ( uint8_t * )ub.b, 4 );
-  transport_write_buffer( tpt, ub.b, 4 );
+  codec_write( tpt, ub.b, 4 );
 }
 
 // read a lua number from the transport 
 static lua_Number transport_read_number( Transport *tpt )
 {
   lua_Number x;
-  uint8_t* b = alloca(tpt->lnum_bytes); 
+  // lnum_bytes is negotiated down to at most sizeof( lua_Number )
+  union {
+    lua_Number n;
+    int64_t i;
+    uint8_t b[ 8 ];
+  } u;
+  uint8_t *b = u.b;
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   transport_read_buffer ( tpt, b, tpt->lnum_bytes );
@@ -244,25 +316,25 @@ static void transport_write_number( Transport *tpt, lua_Number x )
     {
       case 1: {
         int8_t y = ( int8_t )x;
-        transport_write_buffer( tpt, ( uint8_t * )&y, 1 );
+        codec_write( tpt, ( uint8_t * )&y, 1 );
       } break;
       case 2: {
         int16_t y = ( int16_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 2 );
-        transport_write_buffer( tpt, ( uint8_t * )&y, 2 );
+        codec_write( tpt, ( uint8_t * )&y, 2 );
       } break;
       case 4: {
         int32_t y = ( int32_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 4 );
-        transport_write_buffer( tpt,( uint8_t * )&y, 4 );
+        codec_write( tpt,( uint8_t * )&y, 4 );
       } break;
       case 8: {
         int64_t y = ( int64_t )x;
         if( tpt->net_little != tpt->loc_little )
           swap_bytes( ( uint8_t * )&y, 8 );
-        transport_write_buffer( tpt, ( uint8_t * )&y, 8 );
+        codec_write( tpt, ( uint8_t * )&y, 8 );
       } break;
       default: lua_assert(0);
     }
@@ -271,7 +343,7 @@ static void transport_write_number( Transport *tpt, lua_Number x )
   {
     if( tpt->net_little != tpt->loc_little )
        swap_bytes( ( uint8_t * )&x, 8 );
-    transport_write_buffer( tpt, ( uint8_t * )&x, 8 );
+    codec_write( tpt, ( uint8_t * )&x, 8 );
   }
 }
 
@@ -315,26 +387,31 @@ int ismetatable_type( lua_State *L, int ud, const char *tname )
 static void write_variable( Transport *tpt, lua_State *L, int var_index );
 static int read_variable( Transport *tpt, lua_State *L );
 
-// write a table at the given index in the stack. the index must be absolute
-// (i.e. positive).
-// @@@ circular table references will cause stack overflow!
-static void write_table( Transport *tpt, lua_State *L, int table_index )
+static void new_weak_table( lua_State *L, const char *mode )
+{
+  lua_newtable( L );
+  lua_newtable( L );
+  lua_pushstring( L, mode );
+  lua_setfield( L, -2, "__mode" );
+  lua_setmetatable( L, -2 );
+}
+
+// push the registry table called name, made weak in mode the first time
+static void weak_table( lua_State *L, const char *name, const char *mode )
 {
-  lua_pushnil( L );  // push first key
-  while ( lua_next( L, table_index ) ) 
+  lua_getfield( L, LUA_REGISTRYINDEX, name );
+  if( lua_isnil( L, -1 ) )
   {
-    // next key and value were pushed on the stack 
-    write_variable( tpt, L, lua_gettop( L ) - 1 );
-    write_variable( tpt, L, lua_gettop( L ) );
-    
-    // remove value, keep key for next iteration 
     lua_pop( L, 1 );
+    new_weak_table( L, mode );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, name );
   }
 }
 
 static int writer( lua_State *L, const void* b, size_t size, void* B ) {
   (void)L;
-  luaL_addlstring((luaL_Buffer*) B, (const char *)b, size);
+  luaL_addlstring( ( luaL_Buffer * )B, ( const char * )b, size );
   return 0;
 }
 
@@ -342,13 +419,17 @@ static int writer( lua_State *L, const void* b, size_t size, void* B ) {
 #include "lundump.h"
 #include "ldo.h"
 
-// Dump bytecode representation of function onto stack and send. This
+// dumps depend on the format negotiated with the peer
+#define DUMP_FORMAT( tpt ) \
+  ( ( tpt )->net_little << 16 | ( tpt )->lnum_bytes << 8 | ( tpt )->net_intnum )
+
+// Dump bytecode representation of function, pushing it as a string. This
 // implementation uses eLua's crosscompile dump to match match the
 // bytecode representation to the client/server negotiated format.
-static void write_function( Transport *tpt, lua_State *L, int var_index )
+static void dump_function( Transport *tpt, lua_State *L, int var_index )
 {
   TValue *o;
-  luaL_Buffer b;
+  luaL_Buffer B;
   DumpTargetInfo target;
   
   target.little_endian=tpt->net_little;
@@ -358,73 +439,816 @@ static void write_function( Transport *tpt, lua_State *L, int var_index )
   target.lua_Number_integral=tpt->net_intnum;
   target.is_arm_fpa=0;
   
-  // push function onto stack, serialize to string 
+  // push function onto stack, serialize
   lua_pushvalue( L, var_index );
-  luaL_buffinit( L, &b );
+  luaL_buffinit( L, &B );
   lua_lock(L);
   o = L->top - 1;
-  luaU_dump_crosscompile(L,clvalue(o)->l.p,writer,&b,0,target);
+  luaU_dump_crosscompile(L,clvalue(o)->l.p,writer,&B,0,target);
   lua_unlock(L);
+  luaL_pushresult( &B );
   
-  // put string representation on stack and send it
-  luaL_pushresult( &b );
-  write_variable( tpt, L, lua_gettop( L ) );
-  
-  // Remove function & dumped string from stack
-  lua_pop( L, 2 );
+  // Remove function from stack
+  lua_remove( L, -2 );
 }
 #else
+#define DUMP_FORMAT( tpt ) 0
+
+static void dump_function( Transport *tpt, lua_State *L, int var_index )
+{
+  luaL_Buffer B;
+
+  ( void )tpt;
+  // push function onto stack, serialize
+  lua_pushvalue( L, var_index );
+  luaL_buffinit( L, &B );
+  lua_dump( L, writer, &B );
+  luaL_pushresult( &B );
+
+  // Remove function from stack
+  lua_remove( L, -2 );
+}
+#endif
+
+// send a function as the string of its bytecode. dumps are remembered per
+// function (and format) in the weak keyed registry table "rpc.dumps", so
+// one that is passed on every call is only dumped once
 static void write_function( Transport *tpt, lua_State *L, int var_index )
 {
-  luaL_Buffer b;
-  
-  // push function onto stack, serialize to string 
+  const char *b;
+  size_t len;
+
+  luaL_checkstack( L, 6, "too many nested values" );
+  weak_table( L, "rpc.dumps", "k" );
+  lua_pushnumber( L, DUMP_FORMAT( tpt ) );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    new_weak_table( L, "k" );
+    lua_pushnumber( L, DUMP_FORMAT( tpt ) );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  lua_remove( L, -2 );
   lua_pushvalue( L, var_index );
-  luaL_buffinit( L, &b );
-  lua_dump(L, writer, &b);
-  
-  // put string representation on stack and send it
-  luaL_pushresult( &b );
-  write_variable( tpt, L, lua_gettop( L ) );
-  
-  // Remove function & dumped string from stack
+  lua_rawget( L, -2 );
+  if( !lua_isstring( L, -1 ) )
+  {
+    lua_pop( L, 1 );
+    dump_function( tpt, L, var_index );
+    lua_pushvalue( L, var_index );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  b = lua_tolstring( L, -1, &len );
+  transport_write_uint8_t( tpt, RPC_STRING );
+  transport_write_uint32_t( tpt, ( uint32_t )len );
+  transport_write_string( tpt, b, ( int )len );
   lua_pop( L, 2 );
 }
-#endif
+
+// replace the placeholder below the chunk on top of the stack with the
+// function it loads. each one is loaded afresh, so every call gets a
+// closure of its own with the globals as its environment (its _ENV under
+// 5.2 and later), and one a served function keeps or changes is never seen
+// by another call. only the sender's dump is remembered: the C API has no
+// way to make a new closure from a prototype loaded earlier.
+static void load_function( lua_State *L )
+{
+  const char *b;
+  size_t len;
+
+  b = lua_tolstring( L, -1, &len );
+  luaL_loadbuffer( L, b, len, b );
+  lua_replace( L, -3 );
+  lua_pop( L, 1 );
+}
 
 static void helper_remote_index( Helper *helper );
 
-// write a variable at the given index in the stack. the index must be absolute
-// (i.e. positive).
+// nesting
+//   tables are written and read with an explicit stack instead of by
+//   recursion: each open level costs a few Lua stack slots (checked) and a
+//   byte of arena rather than a C stack frame, and nesting deeper than
+//   value_max_depth (rpc.max_depth) fails with ERR_DEPTH. the byte says
+//   what the level is doing: walking its pairs, writing a key or value
+//   that is itself a table, or collecting a function's chunks.
+int value_max_depth = MAX_DEPTH;
+
+enum { FRAME_NEXT, FRAME_KEY, FRAME_VALUE, FRAME_FUNCTION };
+
+// back-references
+//   with ENCODING_REFS a table that was already sent in the same message
+//   is sent as RPC_REF and its number instead, so shared subtables arrive
+//   shared and cycles terminate. tables are numbered from 1 in the order
+//   their RPC_TABLE markers appear. with ENCODING_STRINGS the first
+//   MESSAGE_MAX_STRINGS strings sent as RPC_STRING are numbered from 0 the
+//   same way, and a repeat is sent as RPC_STRING_REF with a u8 number, or
+//   RPC_STRING_REF16 with a u16. only one message is ever being written or
+//   read at a time, so each numbering (value -> number when writing,
+//   number -> value when reading) is kept in a single registry table.
+uint8_t encoding_features = 0;
+
+typedef struct {
+  int ref;                               // registry ref of the numbering, LUA_NOREF if empty
+  uint32_t n;                            // values numbered so far
+} Numbering;
+
+static struct {
+  Numbering tables, strings;
+  Numbering outer[ 2 ];                  // the message's own, while isolated
+  Transport *isolated;                   // coding a cached value, or NULL
+} message = { { LUA_NOREF, 0 }, { LUA_NOREF, 0 },
+              { { LUA_NOREF, 0 }, { LUA_NOREF, 0 } }, NULL };
+
+static void numbering_reset( lua_State *L, Numbering *nb )
+{
+  if( nb->ref != LUA_NOREF )
+  {
+    luaL_unref( L, LUA_REGISTRYINDEX, nb->ref );
+    nb->ref = LUA_NOREF;
+  }
+  nb->n = 0;
+}
 
-static void write_variable( Transport *tpt, lua_State *L, int var_index )
+// a value for the content cache is coded on its own: with numberings of
+// its own and without the connection dictionary
+static void isolate_begin( Transport *tpt )
+{
+  message.outer[ 0 ] = message.tables;
+  message.outer[ 1 ] = message.strings;
+  message.tables.ref = message.strings.ref = LUA_NOREF;
+  message.tables.n = message.strings.n = 0;
+  message.isolated = tpt;
+}
+
+static void isolate_end( lua_State *L )
+{
+  numbering_reset( L, &message.tables );
+  numbering_reset( L, &message.strings );
+  message.tables = message.outer[ 0 ];
+  message.strings = message.outer[ 1 ];
+  message.isolated = NULL;
+}
+
+// forget the numberings of the last message (and anything an error left
+// behind)
+static void message_reset( lua_State *L )
+{
+  if( message.isolated != NULL )
+    isolate_end( L );
+  if( capture.tpt != NULL )
+    capture_end();
+  numbering_reset( L, &message.tables );
+  numbering_reset( L, &message.strings );
+}
+
+static void numbering_push( lua_State *L, Numbering *nb )
+{
+  if( nb->ref == LUA_NOREF )
+  {
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    nb->ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  }
+  else
+    lua_rawgeti( L, LUA_REGISTRYINDEX, nb->ref );
+}
+
+// number of the value at the given (absolute) index if it was already
+// numbered, otherwise 0 after numbering it (while fewer than limit are)
+static uint32_t numbering_find( lua_State *L, Numbering *nb, int idx, uint32_t limit )
+{
+  uint32_t id = 0;
+
+  numbering_push( L, nb );
+  lua_pushvalue( L, idx );
+  lua_rawget( L, -2 );
+  if( lua_isnumber( L, -1 ) )
+    id = ( uint32_t )lua_tonumber( L, -1 );
+  else if( nb->n < limit )
+  {
+    lua_pushvalue( L, idx );
+    lua_pushnumber( L, ++ nb->n );
+    lua_rawset( L, -4 );
+  }
+  lua_pop( L, 2 );
+  return id;
+}
+
+// number the value on top of the stack as a decoder, leaving it there
+static void numbering_add( lua_State *L, Numbering *nb, uint32_t limit )
+{
+  if( nb->n < limit )
+  {
+    numbering_push( L, nb );
+    lua_pushvalue( L, -2 );
+    lua_rawseti( L, -2, ++ nb->n );
+    lua_pop( L, 1 );
+  }
+}
+
+static void protocol_error( void )
+{
+  struct exception e;
+
+  e.errnum = ERR_PROTOCOL;
+  e.type = fatal;
+  Throw( e );
+}
+
+static void check_depth( lua_State *L, int depth )
+{
+  struct exception e;
+
+  if( depth > value_max_depth || !lua_checkstack( L, 4 ) )
+  {
+    e.errnum = ERR_DEPTH;
+    e.type = fatal;
+    Throw( e );
+  }
+}
+
+// connection dictionaries
+//   with ENCODING_DICT a string of up to DICT_MAX_LEN bytes that is sent in
+//   full as a table key is put in the sender's out table, and the receiver
+//   puts it in its in table, so from then on either end can send it as
+//   RPC_DICT and its slot. slots are reused round-robin; as both ends see
+//   the same strings in the same order they stay in step.
+static uint32_t dict_hash( const char *s, size_t len )
+{
+  uint32_t h = 2166136261u;
+
+  while( len -- > 0 )
+    h = ( h ^ ( uint8_t )*s ++ ) * 16777619u;
+  return h;
+}
+
+static int dict_find( DictTable *t, const char *s, size_t len, uint32_t h )
+{
+  int i;
+
+  for( i = 0; i < t->filled; i ++ )
+    if( t->hash[ i ] == h && t->len[ i ] == len && memcmp( t->str[ i ], s, len ) == 0 )
+      return i;
+  return -1;
+}
+
+static void dict_add( DictTable *t, const char *s, size_t len, uint32_t h )
+{
+  int i = t->next;
+
+  t->hash[ i ] = h;
+  t->len[ i ] = ( uint8_t )len;
+  memcpy( t->str[ i ], s, len );
+  t->next = ( uint16_t )( ( i + 1 ) % DICT_ENTRIES );
+  if( t->filled < DICT_ENTRIES )
+    t->filled ++;
+}
+
+// give tpt what the features in features need (empty dictionaries, a
+// content cache), or drop what they do not. returns features, less those
+// there is no memory for.
+static uint8_t encoding_setup( Transport *tpt, uint8_t features, int sender )
+{
+  if( features & ENCODING_DICT )
+  {
+    if( tpt->dict == NULL )
+      tpt->dict = ( Dict * )malloc( sizeof( Dict ) );
+    if( tpt->dict != NULL )
+      memset( tpt->dict, 0, sizeof( Dict ) );
+    else
+      features &= ( uint8_t )~ENCODING_DICT;
+  }
+  else
+  {
+    free( tpt->dict );
+    tpt->dict = NULL;
+  }
+  if( features & ENCODING_CACHE )
+  {
+    if( tpt->cache == NULL )
+      tpt->cache = ( Cache * )malloc( sizeof( Cache ) );
+    if( tpt->cache != NULL )
+    {
+      memset( tpt->cache, 0, sizeof( Cache ) );
+      tpt->cache->sender = ( uint8_t )sender;
+    }
+    else
+      features &= ( uint8_t )~ENCODING_CACHE;
+  }
+  else
+  {
+    free( tpt->cache );
+    tpt->cache = NULL;
+  }
+  return features;
+}
+
+// single precision
+//   with ENCODING_FLOAT32 a number that is not an integer is rounded to the
+//   nearest float and sent as RPC_FLOAT32 in 4 bytes, and integers are sent
+//   as with ENCODING_INTEGERS. a rounded number is within 2^-24 of its value
+//   relative to it, or 2^-150 absolutely below FLT_MIN; infinities and NaN
+//   are kept. table keys, and numbers beyond FLT_MAX, are still sent exact.
+static int float_fits( lua_Number x )
+{
+  return ( x >= -FLT_MAX && x <= FLT_MAX ) || x != x || x == HUGE_VAL || x == -HUGE_VAL;
+}
+
+static void transport_write_float( Transport *tpt, float x )
+{
+  union {
+    float f;
+    uint8_t b[ 4 ];
+  } u;
+
+  u.f = x;
+  if( tpt->net_little != tpt->loc_little )
+    swap_bytes( u.b, 4 );
+  codec_write( tpt, u.b, 4 );
+}
+
+static float transport_read_float( Transport *tpt )
+{
+  union {
+    float f;
+    uint8_t b[ 4 ];
+  } u;
+
+  transport_read_buffer( tpt, u.b, 4 );
+  if( tpt->net_little != tpt->loc_little )
+    swap_bytes( u.b, 4 );
+  return u.f;
+}
+
+// integers
+//   with ENCODING_INTEGERS an integer is sent as RPC_INTEGER and a zigzag
+//   varint of 1 to 10 bytes rather than as an 8 byte number: under Lua 5.3
+//   and later every integer, and under 5.1 and 5.2 every number that is a
+//   whole value within int64_t (but not -0). it arrives as an integer where
+//   Lua has them, so integers above 2^53 keep their value.
+static int number_integer( lua_State *L, int idx, int64_t *v )
+{
+#ifdef RPC_LUA_INTEGERS
+  if( !lua_isinteger( L, idx ) )
+    return 0;
+  *v = ( int64_t )lua_tointeger( L, idx );
+  return 1;
+#else
+  lua_Number x = lua_tonumber( L, idx );
+
+  if( !( x >= -9223372036854775808.0 && x < 9223372036854775808.0 ) ||
+      x != ( lua_Number )( int64_t )x || ( x == 0 && signbit( ( double )x ) ) )
+    return 0;
+  *v = ( int64_t )x;
+  return 1;
+#endif
+}
+
+static void transport_write_varint( Transport *tpt, int64_t v )
+{
+  uint64_t u = v < 0 ? ~( ( uint64_t )v << 1 ) : ( uint64_t )v << 1;
+  uint8_t b[ 10 ];
+  int n = 0;
+
+  while( u >= 0x80 )
+  {
+    b[ n ++ ] = ( uint8_t )( u | 0x80 );
+    u >>= 7;
+  }
+  b[ n ++ ] = ( uint8_t )u;
+  codec_write( tpt, b, n );
+}
+
+static int64_t transport_read_varint( Transport *tpt )
+{
+  uint64_t u = 0;
+  int shift = 0;
+  uint8_t b;
+
+  do
+  {
+    if( shift > 63 )
+      protocol_error();
+    b = transport_read_uint8_t( tpt );
+    u |= ( uint64_t )( b & 0x7f ) << shift;
+    shift += 7;
+  } while( b & 0x80 );
+  return ( u & 1 ) ? ( int64_t )~( u >> 1 ) : ( int64_t )( u >> 1 );
+}
+
+// number arrays
+//   with ENCODING_ARRAYS a table whose 1..n (n >= ARRAY_MIN_COUNT) are all
+//   numbers starts with RPC_ARRAY instead of RPC_TABLE: n, an element type
+//   and the n numbers as one block, in the narrowest type that holds every
+//   one of them exactly and in the negotiated byte order. its other pairs
+//   follow as usual. a peer that only has integers is sent integer blocks;
+//   where Lua has integers, integer blocks arrive as integers. with
+//   ENCODING_FLOAT32, doubles go as floats.
+//   the numbers pass through a buffer of doubles, which the kernels in
+//   luarpc_swap.c pack, unpack and swap.
+static const uint8_t array_size[] = { 0, 1, 2, 4, 4, 8 };
+
+// numbers are converted and swapped this many at a time
+#define ARRAY_CHUNK ( IOBUF_SIZE / 16 )
+
+// narrowest element type for the number at idx, or 0 for an integer (of
+// Lua 5.3 and later) that does not fit an i32
+static int number_type( lua_State *L, int idx )
+{
+  lua_Number x;
+
+#ifdef RPC_LUA_INTEGERS
+  if( lua_isinteger( L, idx ) )
+  {
+    lua_Integer v = lua_tointeger( L, idx );
+    return v >= -128 && v <= 127 ? ARRAY_I8 :
+           v >= -32768 && v <= 32767 ? ARRAY_I16 :
+           v >= -2147483647 - 1 && v <= 2147483647 ? ARRAY_I32 : 0;
+  }
+  x = lua_tonumber( L, idx );
+#else
+  x = lua_tonumber( L, idx );
+  if( x >= -2147483648.0 && x <= 2147483647.0 && x == ( lua_Number )( int32_t )x &&
+      !( x == 0 && signbit( ( double )x ) ) )
+    return x >= -128 && x <= 127 ? ARRAY_I8 :
+           x >= -32768 && x <= 32767 ? ARRAY_I16 : ARRAY_I32;
+#endif
+  if( ( lua_Number )( float )x == x || x != x )
+    return ARRAY_F32;
+  return ARRAY_F64;
+}
+
+// element type for the n numbers at 1..n of the table at idx, or 0 if they
+// are not all numbers or cannot be sent exactly. where Lua has integers,
+// integers and floats are not mixed in a block. a block mixing fractions
+// with integers a float cannot hold (beyond 2^24) is sent as doubles. with
+// ENCODING_FLOAT32, doubles are sent as floats when they are all within
+// FLT_MAX and no integer among them would be rounded.
+static int array_type( Transport *tpt, lua_State *L, int idx, uint32_t n )
+{
+  int type = ARRAY_I8, wide = 0, big = 0;
+  uint32_t i;
+
+  for( i = 1; i <= n; i ++ )
+  {
+    int64_t v;
+    int t;
+
+    lua_rawgeti( L, idx, ( int )i );
+    t = lua_type( L, -1 ) == LUA_TNUMBER ? number_type( L, -1 ) : 0;
+    if( t == ARRAY_F64 && !float_fits( lua_tonumber( L, -1 ) ) )
+      wide = 1;
+    if( t != 0 && number_integer( L, -1, &v ) &&
+        ( lua_Number )( float )lua_tonumber( L, -1 ) != lua_tonumber( L, -1 ) )
+      big = 1;
+    lua_pop( L, 1 );
+    if( t == 0 )
+      return 0;
+#ifdef RPC_LUA_INTEGERS
+    if( i > 1 && ( t >= ARRAY_F32 ) != ( type >= ARRAY_F32 ) )
+      return 0;
+#endif
+    if( t > type )
+      type = t;
+  }
+  if( type == ARRAY_F32 && big )
+    type = ARRAY_F64;
+  if( type >= ARRAY_F32 && ( tpt->net_intnum || tpt->loc_intnum ) )
+    return 0;
+  if( type == ARRAY_F64 && ( tpt->features & ENCODING_FLOAT32 ) && !wide && !big )
+    type = ARRAY_F32;
+  return type;
+}
+
+static void write_array( Transport *tpt, lua_State *L, int idx, uint32_t n, int type )
+{
+  size_t size = array_size[ type ];
+  uint32_t i = 1;
+  double *nums;
+  uint8_t *buf;
+  ArenaMark m;
+
+  transport_write_uint8_t( tpt, RPC_ARRAY );
+  transport_write_uint32_t( tpt, n );
+  transport_write_uint8_t( tpt, ( uint8_t )type );
+  arena_mark( &tpt->arena, &m );
+  nums = ( double * )arena_alloc( &tpt->arena, ARRAY_CHUNK * sizeof( double ) );
+  buf = ( uint8_t * )arena_alloc( &tpt->arena, ARRAY_CHUNK * size );
+  while( i <= n )
+  {
+    size_t k, count = n - i + 1;
+
+    if( count > ARRAY_CHUNK )
+      count = ARRAY_CHUNK;
+    for( k = 0; k < count; k ++, i ++ )
+    {
+      lua_rawgeti( L, idx, ( int )i );
+      nums[ k ] = ( double )lua_tonumber( L, -1 );
+      lua_pop( L, 1 );
+    }
+    array_pack( buf, nums, count, type );
+    if( tpt->net_little != tpt->loc_little )
+      swap_block( buf, count, size );
+    transport_write_string( tpt, ( const char * )buf, ( int )( count * size ) );
+  }
+  arena_release( &tpt->arena, &m );
+}
+
+// series
+//   with ENCODING_SERIES as well, an array of at most SERIES_MAX_COUNT
+//   integers may instead be sent as ARRAY_DELTA (delta-of-delta varints,
+//   for counters and timestamps) and one of doubles as ARRAY_XOR (each XORed
+//   with the one before, for slowly changing readings), followed by its
+//   length in bytes and the series. write_series only sends one that comes
+//   out smaller than plain, the size of what it replaces. where Lua has
+//   integers, an array mixing them with floats is not a series.
+static int write_series( Transport *tpt, lua_State *L, int idx, uint32_t n, size_t plain )
+{
+  int64_t *v;
+  uint8_t *out;
+  uint32_t i, ints = 0;
+  size_t len;
+  int type;
+  ArenaMark m;
+
+  arena_mark( &tpt->arena, &m );
+  v = ( int64_t * )arena_alloc( &tpt->arena, ( size_t )n * sizeof( int64_t ) );
+  for( i = 0; i < n; i ++ )
+  {
+    lua_rawgeti( L, idx, ( int )i + 1 );
+    if( lua_type( L, -1 ) != LUA_TNUMBER )
+    {
+      lua_pop( L, 1 );
+      arena_release( &tpt->arena, &m );
+      return 0;
+    }
+    if( number_integer( L, -1, &v[ i ] ) )
+      ints ++;
+    else
+    {
+      double x = ( double )lua_tonumber( L, -1 );
+      memcpy( &v[ i ], &x, sizeof( x ) );
+    }
+    lua_pop( L, 1 );
+  }
+  if( ints != n && ints != 0 )
+  {
+#ifdef RPC_LUA_INTEGERS
+    arena_release( &tpt->arena, &m );
+    return 0;
+#else
+    // whole numbers among fractions: all go as doubles
+    for( i = 0; i < n; i ++ )
+    {
+      double x;
+      lua_rawgeti( L, idx, ( int )i + 1 );
+      x = ( double )lua_tonumber( L, -1 );
+      lua_pop( L, 1 );
+      memcpy( &v[ i ], &x, sizeof( x ) );
+    }
+    ints = 0;
+#endif
+  }
+  if( ints == 0 && ( tpt->net_intnum || tpt->loc_intnum ) )
+  {
+    arena_release( &tpt->arena, &m );
+    return 0;
+  }
+
+  out = ( uint8_t * )arena_alloc( &tpt->arena, ( size_t )n * 10 );
+  if( ints != 0 )
+  {
+    type = ARRAY_DELTA;
+    len = series_pack_ints( out, v, n );
+  }
+  else
+  {
+    type = ARRAY_XOR;
+    memset( out, 0, ( size_t )n * 10 );
+    len = series_pack_doubles( out, ( const uint64_t * )v, n );
+  }
+  if( len >= plain )
+  {
+    arena_release( &tpt->arena, &m );
+    return 0;
+  }
+  transport_write_uint8_t( tpt, RPC_ARRAY );
+  transport_write_uint32_t( tpt, n );
+  transport_write_uint8_t( tpt, ( uint8_t )type );
+  transport_write_uint32_t( tpt, ( uint32_t )len );
+  transport_write_string( tpt, ( const char * )out, ( int )len );
+  arena_release( &tpt->arena, &m );
+  return 1;
+}
+
+// push a table holding the series of n values of the given type that
+// follows (its length first)
+static void read_series( Transport *tpt, lua_State *L, uint32_t n, uint8_t type )
+{
+  uint32_t len, i;
+  uint8_t *buf;
+  int64_t *v;
+  ArenaMark m;
+
+  if( !( tpt->features & ENCODING_SERIES ) || n > SERIES_MAX_COUNT )
+    protocol_error();
+  len = transport_read_uint32_t( tpt );
+  if( len > n * 10 )
+    protocol_error();
+  lua_createtable( L, ( int )n, 0 );
+  arena_mark( &tpt->arena, &m );
+  buf = ( uint8_t * )arena_alloc( &tpt->arena, len );
+  v = ( int64_t * )arena_alloc( &tpt->arena, ( size_t )n * sizeof( int64_t ) );
+  transport_read_buffer( tpt, buf, ( int )len );
+  if( type == ARRAY_DELTA ? !series_unpack_ints( v, n, buf, len ) :
+      !series_unpack_doubles( ( uint64_t * )v, n, buf, len ) )
+    protocol_error();
+  for( i = 0; i < n; i ++ )
+  {
+    if( type == ARRAY_DELTA )
+#ifdef RPC_LUA_INTEGERS
+      lua_pushinteger( L, ( lua_Integer )v[ i ] );
+#else
+      lua_pushnumber( L, ( lua_Number )v[ i ] );
+#endif
+    else
+    {
+      double x;
+      memcpy( &x, &v[ i ], sizeof( x ) );
+      lua_pushnumber( L, ( lua_Number )x );
+    }
+    lua_rawseti( L, -2, ( int )i + 1 );
+  }
+  arena_release( &tpt->arena, &m );
+}
+
+// read the block after an RPC_ARRAY marker and push a table holding it
+static void read_array( Transport *tpt, lua_State *L )
+{
+  uint32_t n = transport_read_uint32_t( tpt );
+  uint8_t type = transport_read_uint8_t( tpt );
+  size_t size;
+  uint32_t i = 1;
+  double *nums;
+  uint8_t *buf;
+  ArenaMark m;
+
+  if( type == ARRAY_DELTA || type == ARRAY_XOR )
+  {
+    read_series( tpt, L, n, type );
+    return;
+  }
+  if( type < ARRAY_I8 || type > ARRAY_F64 )
+    protocol_error();
+  size = array_size[ type ];
+  // n is only a claim until the numbers arrive: do not trust it with memory
+  lua_createtable( L, n < 65536 ? ( int )n : 65536, 0 );
+  arena_mark( &tpt->arena, &m );
+  nums = ( double * )arena_alloc( &tpt->arena, ARRAY_CHUNK * sizeof( double ) );
+  buf = ( uint8_t * )arena_alloc( &tpt->arena, ARRAY_CHUNK * size );
+  while( i <= n )
+  {
+    size_t k, count = n - i + 1;
+
+    if( count > ARRAY_CHUNK )
+      count = ARRAY_CHUNK;
+    transport_read_buffer( tpt, buf, ( int )( count * size ) );
+    if( tpt->net_little != tpt->loc_little )
+      swap_block( buf, count, size );
+    array_unpack( nums, buf, count, type );
+    for( k = 0; k < count; k ++, i ++ )
+    {
+#ifdef RPC_LUA_INTEGERS
+      if( type < ARRAY_F32 )
+        lua_pushinteger( L, ( lua_Integer )nums[ k ] );
+      else
+#endif
+        lua_pushnumber( L, ( lua_Number )nums[ k ] );
+      lua_rawseti( L, -2, ( int )i );
+    }
+  }
+  arena_release( &tpt->arena, &m );
+}
+
+// write the value at the given (absolute) index. a table is only opened:
+// its marker is written and it is pushed with a nil key for write_variable
+// to walk, as level depth. returns 1 if a table was opened, setting *array
+// to how many of its numbers went in a block (which its walk then skips).
+// key says that the value is a table key.
+static int write_value( Transport *tpt, lua_State *L, int var_index, int depth, int key,
+                        uint32_t *array )
 {
-  int stack_at_start = lua_gettop( L );
-  
   switch( lua_type( L, var_index ) )
   {
     case LUA_TNUMBER:
+    {
+      int64_t v;
+
+      if( ( tpt->features & ( ENCODING_INTEGERS | ENCODING_FLOAT32 ) ) &&
+          number_integer( L, var_index, &v ) )
+      {
+        transport_write_uint8_t( tpt, RPC_INTEGER );
+        transport_write_varint( tpt, v );
+        break;
+      }
+      if( ( tpt->features & ENCODING_FLOAT32 ) && !key && !tpt->net_intnum &&
+          float_fits( lua_tonumber( L, var_index ) ) )
+      {
+        transport_write_uint8_t( tpt, RPC_FLOAT32 );
+        transport_write_float( tpt, ( float )lua_tonumber( L, var_index ) );
+        break;
+      }
       transport_write_uint8_t( tpt, RPC_NUMBER );
       transport_write_number( tpt, lua_tonumber( L, var_index ) );
       break;
+    }
 
     case LUA_TSTRING:
     {
-      const char *s;
-      uint32_t len;
+      size_t len;
+      const char *s = lua_tolstring( L, var_index, &len );
+      int in_dict = tpt->dict != NULL && message.isolated != tpt && len <= DICT_MAX_LEN;
+      uint32_t h = 0;
+
+      if( in_dict )
+      {
+        int slot;
+        h = dict_hash( s, len );
+        slot = dict_find( &tpt->dict->out, s, len, h );
+        if( slot >= 0 )
+        {
+          transport_write_uint8_t( tpt, RPC_DICT );
+          transport_write_uint8_t( tpt, ( uint8_t )slot );
+          break;
+        }
+      }
+      if( tpt->features & ENCODING_STRINGS )
+      {
+        uint32_t id;
+        if( !lua_checkstack( L, 3 ) )
+          protocol_error();
+        id = numbering_find( L, &message.strings, var_index, MESSAGE_MAX_STRINGS );
+        if( id > 256 )
+        {
+          transport_write_uint8_t( tpt, RPC_STRING_REF16 );
+          transport_write_uint8_t( tpt, ( uint8_t )( ( id - 1 ) >> 8 ) );
+          transport_write_uint8_t( tpt, ( uint8_t )( id - 1 ) );
+          break;
+        }
+        if( id != 0 )
+        {
+          transport_write_uint8_t( tpt, RPC_STRING_REF );
+          transport_write_uint8_t( tpt, ( uint8_t )( id - 1 ) );
+          break;
+        }
+      }
       transport_write_uint8_t( tpt, RPC_STRING );
-      s = lua_tostring( L, var_index );
-      len = lua_strlen( L, var_index );
-      transport_write_uint32_t( tpt, len );
-      transport_write_string( tpt, s, len );
+      transport_write_uint32_t( tpt, ( uint32_t )len );
+      transport_write_string( tpt, s, ( int )len );
+      if( in_dict && key )
+        dict_add( &tpt->dict->out, s, len, h );
       break;
     }
 
     case LUA_TTABLE:
-      transport_write_uint8_t( tpt, RPC_TABLE );
-      write_table( tpt, L, var_index );
-      transport_write_uint8_t( tpt, RPC_TABLE_END );
-      break;
+      check_depth( L, depth );
+      if( tpt->features & ENCODING_REFS )
+      {
+        uint32_t id = numbering_find( L, &message.tables, var_index, 0xffffffffu );
+        if( id != 0 )
+        {
+          transport_write_uint8_t( tpt, RPC_REF );
+          transport_write_uint32_t( tpt, id );
+          break;
+        }
+      }
+      *array = 0;
+      if( tpt->features & ENCODING_ARRAYS )
+      {
+        uint32_t n = ( uint32_t )lua_objlen( L, var_index );
+        int type = n >= ARRAY_MIN_COUNT ? array_type( tpt, L, var_index, n ) : 0;
+
+        // a series is measured against the block, or else pairs of about
+        // 18 bytes
+        if( n >= ARRAY_MIN_COUNT && n <= SERIES_MAX_COUNT &&
+            ( tpt->features & ENCODING_SERIES ) &&
+            write_series( tpt, L, var_index, n,
+                          ( size_t )n * ( type != 0 ? array_size[ type ] : 18 ) ) )
+          *array = n;
+        else if( type != 0 )
+        {
+          write_array( tpt, L, var_index, n, type );
+          *array = n;
+        }
+      }
+      if( *array == 0 )
+        transport_write_uint8_t( tpt, RPC_TABLE );
+      lua_pushvalue( L, var_index );
+      lua_pushnil( L );
+      return 1;
 
     case LUA_TNIL:
       transport_write_uint8_t( tpt, RPC_NIL );
@@ -436,6 +1260,8 @@ static void write_variable( Transport *tpt, lua_State *L, int var_index )
       break;
 
     case LUA_TFUNCTION:
+      if( tpt == capture.tpt )
+        capture.functions = 1;
       transport_write_uint8_t( tpt, RPC_FUNCTION );
       write_function( tpt, L, var_index );
       transport_write_uint8_t( tpt, RPC_FUNCTION_END );
@@ -458,51 +1284,88 @@ static void write_variable( Transport *tpt, lua_State *L, int var_index )
       luaL_error( L, "light userdata transmission unsupported" );
       break;
   }
-  MYASSERT( lua_gettop( L ) == stack_at_start );
+  return 0;
 }
 
-
-// read a table and push in onto the stack 
-static void read_table( Transport *tpt, lua_State *L )
+// write a variable at the given index in the stack. the index must be absolute
+// (i.e. positive). an open table has itself and its current key on the
+// stack, and while a pair is being written, the value too.
+static void write_variable( Transport *tpt, lua_State *L, int var_index )
 {
-  int table_index;
-  lua_newtable( L );
-  table_index = lua_gettop( L );
-  for ( ;; ) 
-  {
-    if( !read_variable( tpt, L ) )
-      return;
-    read_variable( tpt, L );
-    lua_rawset( L, table_index );
-  }
-}
+  int stack_at_start = lua_gettop( L );
+  int depth = 1;
+  uint8_t *frames;
+  uint32_t *arrays, array;
+  ArenaMark m;
 
-// read function and load
-static void read_function( Transport *tpt, lua_State *L )
-{
-  const char *b;
-  size_t len;
-  
-  for( ;; )
+  if( !write_value( tpt, L, var_index, depth, 0, &array ) )
+    return;
+  arena_mark( &tpt->arena, &m );
+  frames = ( uint8_t * )arena_alloc( &tpt->arena, ( size_t )value_max_depth + 1 );
+  arrays = ( uint32_t * )arena_alloc( &tpt->arena, ( ( size_t )value_max_depth + 1 ) * sizeof( uint32_t ) );
+  frames[ depth ] = FRAME_NEXT;
+  arrays[ depth ] = array;
+  while( depth > 0 )
   {
-    if( !read_variable( tpt, L ) )
-      return;
+    int top = lua_gettop( L );
 
-    b = luaL_checklstring( L, -1, &len );
-    luaL_loadbuffer( L, b, len, b );
-    lua_insert( L, -2 );
+    if( frames[ depth ] == FRAME_NEXT )
+    {
+      if( !lua_next( L, top - 1 ) )
+      {
+        // table done: back to what its parent was writing
+        lua_pop( L, 1 );
+        transport_write_uint8_t( tpt, RPC_TABLE_END );
+        depth --;
+        continue;
+      }
+      if( arrays[ depth ] != 0 && lua_type( L, top ) == LUA_TNUMBER )
+      {
+        lua_Number k = lua_tonumber( L, top );
+        if( k >= 1 && k <= arrays[ depth ] && k == ( lua_Number )( uint32_t )k )
+        {
+          // already in the block
+          lua_pop( L, 1 );
+          continue;
+        }
+      }
+      frames[ depth ] = FRAME_KEY;
+      if( write_value( tpt, L, top, depth + 1, 1, &array ) )
+      {
+        frames[ ++ depth ] = FRAME_NEXT;
+        arrays[ depth ] = array;
+        continue;
+      }
+    }
+    if( frames[ depth ] == FRAME_KEY )
+    {
+      frames[ depth ] = FRAME_VALUE;
+      if( write_value( tpt, L, lua_gettop( L ), depth + 1, 0, &array ) )
+      {
+        frames[ ++ depth ] = FRAME_NEXT;
+        arrays[ depth ] = array;
+        continue;
+      }
+    }
+    // pair written: remove value, keep key for next iteration
     lua_pop( L, 1 );
+    frames[ depth ] = FRAME_NEXT;
   }
+  arena_release( &tpt->arena, &m );
+  MYASSERT( lua_gettop( L ) == stack_at_start );
 }
 
+
 static void read_index( Transport *tpt, lua_State *L )
 {
   uint32_t len;
   char *funcname;
   char *token = NULL;
+  ArenaMark m;
   
+  arena_mark( &tpt->arena, &m );
   len = transport_read_uint32_t( tpt ); // variable name length
-  funcname = ( char * )alloca( len + 1 );
+  funcname = ( char * )arena_alloc( &tpt->arena, ( size_t )len + 1 );
   transport_read_string( tpt, funcname, len );
   funcname[ len ] = 0;
   
@@ -515,16 +1378,17 @@ static void read_index( Transport *tpt, lua_State *L )
     lua_remove( L, -2 );
     token = strtok( NULL, "." );
   }
+  arena_release( &tpt->arena, &m );
 }
 
 
-// read a variable and push in onto the stack. this returns 1 if a "normal"
-// variable was read, or 0 if an end-table or end-function marker was read (in which case
-// nothing is pushed onto the stack).
-static int read_variable( Transport *tpt, lua_State *L )
+// read a value that is not a table or function and push it onto the stack.
+// frame is the state of the table or function it is read into (FRAME_NEXT
+// for a key), or FRAME_VALUE at the top level. the chunks of a function are
+// plain strings: they are not numbered.
+static void read_scalar( Transport *tpt, lua_State *L, uint8_t type, int frame )
 {
   struct exception e;
-  uint8_t type = transport_read_uint8_t( tpt );
 
   switch( type )
   {
@@ -540,40 +1404,335 @@ static int read_variable( Transport *tpt, lua_State *L )
       lua_pushnumber( L, transport_read_number( tpt ) );
       break;
 
+    case RPC_INTEGER:
+      if( !( tpt->features & ( ENCODING_INTEGERS | ENCODING_FLOAT32 ) ) )
+        protocol_error();
+#ifdef RPC_LUA_INTEGERS
+      lua_pushinteger( L, ( lua_Integer )transport_read_varint( tpt ) );
+#else
+      lua_pushnumber( L, ( lua_Number )transport_read_varint( tpt ) );
+#endif
+      break;
+
+    case RPC_FLOAT32:
+      if( !( tpt->features & ENCODING_FLOAT32 ) || frame == FRAME_NEXT )
+        protocol_error();
+      lua_pushnumber( L, ( lua_Number )transport_read_float( tpt ) );
+      break;
+
     case RPC_STRING:
     {
       uint32_t len = transport_read_uint32_t( tpt );
-      char *s = ( char * )alloca( len + 1 );
+      ArenaMark m;
+      char *s;
+
+      arena_mark( &tpt->arena, &m );
+      s = ( char * )arena_alloc( &tpt->arena, len );
       transport_read_string( tpt, s, len );
-      s[ len ] = 0;
       lua_pushlstring( L, s, len );
+      if( frame == FRAME_NEXT && tpt->dict != NULL && message.isolated != tpt &&
+          len <= DICT_MAX_LEN )
+        dict_add( &tpt->dict->in, s, len, 0 );
+      arena_release( &tpt->arena, &m );
+      if( ( tpt->features & ENCODING_STRINGS ) && frame != FRAME_FUNCTION )
+      {
+        if( !lua_checkstack( L, 2 ) )
+          protocol_error();
+        numbering_add( L, &message.strings, MESSAGE_MAX_STRINGS );
+      }
       break;
     }
 
-    case RPC_TABLE:
-      read_table( tpt, L );
+    case RPC_DICT:
+    {
+      uint8_t slot;
+
+      if( tpt->dict == NULL || message.isolated == tpt )
+        protocol_error();
+      slot = transport_read_uint8_t( tpt );
+      if( slot >= tpt->dict->in.filled )
+        protocol_error();
+      lua_pushlstring( L, tpt->dict->in.str[ slot ], tpt->dict->in.len[ slot ] );
       break;
+    }
 
-    case RPC_TABLE_END:
-      return 0;
-
-    case RPC_FUNCTION:
-      read_function( tpt, L );
+    case RPC_STRING_REF:
+    case RPC_STRING_REF16:
+    {
+      uint32_t id;
+
+      if( !( tpt->features & ENCODING_STRINGS ) )
+        protocol_error();
+      id = transport_read_uint8_t( tpt );
+      if( type == RPC_STRING_REF16 )
+        id = ( id << 8 ) | transport_read_uint8_t( tpt );
+      if( !lua_checkstack( L, 2 ) )
+        protocol_error();
+      numbering_push( L, &message.strings );
+      lua_rawgeti( L, -1, id + 1 );
+      lua_remove( L, -2 );
+      if( !lua_isstring( L, -1 ) )
+        protocol_error();
       break;
-    
-    case RPC_FUNCTION_END:
-      return 0;
+    }
 
     case RPC_REMOTE:
       read_index( tpt, L );
       break;
 
-    default:
-      e.errnum = type;
-      e.type = fatal;
-      Throw( e );
-  }
-  return 1;
+    case RPC_REF:
+      if( tpt->features & ENCODING_REFS )
+      {
+        uint32_t id = transport_read_uint32_t( tpt );
+        if( !lua_checkstack( L, 2 ) )
+          protocol_error();
+        numbering_push( L, &message.tables );
+        lua_rawgeti( L, -1, id );
+        lua_remove( L, -2 );
+        if( !lua_istable( L, -1 ) )
+          protocol_error();
+        break;
+      }
+      // not negotiated: fall through
+    default:
+      e.errnum = type;
+      e.type = fatal;
+      Throw( e );
+  }
+}
+
+// read an argument sent for (or from) the content cache
+static void read_cached( Transport *tpt, lua_State *L, uint8_t type )
+{
+  uint64_t h = ( uint64_t )transport_read_uint32_t( tpt ) << 32;
+  int slot;
+
+  h |= transport_read_uint32_t( tpt );
+  if( !lua_checkstack( L, 6 ) )
+    protocol_error();
+  if( type == RPC_CACHED )
+  {
+    if( ( slot = cache_find( tpt->cache, h ) ) < 0 )
+      protocol_error();
+    cache_push( L, tpt, slot );
+    if( lua_isnil( L, -1 ) )
+      protocol_error();
+    return;
+  }
+  isolate_begin( tpt );
+  if( !read_variable( tpt, L ) )
+    protocol_error();
+  isolate_end( L );
+  cache_store( L, tpt, cache_insert( tpt->cache, h ) );
+}
+
+// read a variable and push in onto the stack. this returns 1 if a "normal"
+// variable was read, or 0 if an end-table or end-function marker was read (in which case
+// nothing is pushed onto the stack). an open table is on the stack with,
+// once it has been read, the key waiting for its value; an open function
+// has a placeholder that each chunk loaded replaces.
+static int read_variable( Transport *tpt, lua_State *L )
+{
+  uint8_t *frames = NULL;
+  int depth = 0;
+  ArenaMark m;
+
+  for( ;; )
+  {
+    uint8_t type = transport_read_uint8_t( tpt );
+
+    switch( type )
+    {
+      case RPC_TABLE_END:
+      case RPC_FUNCTION_END:
+        if( depth == 0 )
+          return 0;
+        if( frames[ depth ] != ( type == RPC_TABLE_END ? FRAME_NEXT : FRAME_FUNCTION ) )
+          protocol_error();
+        depth --;
+        break;
+
+      case RPC_TABLE:
+      case RPC_ARRAY:
+      case RPC_FUNCTION:
+        if( type == RPC_ARRAY && !( tpt->features & ENCODING_ARRAYS ) )
+          protocol_error();
+        if( frames == NULL )
+        {
+          arena_mark( &tpt->arena, &m );
+          frames = ( uint8_t * )arena_alloc( &tpt->arena, ( size_t )value_max_depth + 1 );
+        }
+        check_depth( L, ++ depth );
+        if( type != RPC_FUNCTION )
+        {
+          if( type == RPC_ARRAY )
+            read_array( tpt, L );
+          else
+            lua_newtable( L );
+          frames[ depth ] = FRAME_NEXT;
+          if( tpt->features & ENCODING_REFS )
+            numbering_add( L, &message.tables, 0xffffffffu );
+        }
+        else
+        {
+          lua_pushnil( L );
+          frames[ depth ] = FRAME_FUNCTION;
+        }
+        continue;
+
+      case RPC_CACHE_STORE:
+      case RPC_CACHED:
+        if( depth != 0 || tpt->cache == NULL || tpt->cache->sender ||
+            message.isolated == tpt )
+          protocol_error();
+        read_cached( tpt, L, type );
+        break;
+
+      default:
+        read_scalar( tpt, L, type, depth > 0 ? frames[ depth ] : FRAME_VALUE );
+    }
+
+    // a value is complete on top of the stack
+    if( depth == 0 )
+      break;
+    switch( frames[ depth ] )
+    {
+      case FRAME_NEXT: // it is a key
+        if( lua_isnil( L, -1 ) ||
+            ( lua_type( L, -1 ) == LUA_TNUMBER && lua_tonumber( L, -1 ) != lua_tonumber( L, -1 ) ) )
+          protocol_error();
+        frames[ depth ] = FRAME_VALUE;
+        break;
+
+      case FRAME_VALUE:
+        lua_rawset( L, -3 );
+        frames[ depth ] = FRAME_NEXT;
+        break;
+
+      case FRAME_FUNCTION:
+        if( lua_type( L, -1 ) != LUA_TSTRING || !lua_checkstack( L, 4 ) )
+          protocol_error();
+        load_function( L );
+        break;
+    }
+  }
+  if( frames != NULL )
+    arena_release( &tpt->arena, &m );
+  return 1;
+}
+
+// how deep coded_size looks into tables
+#define SIZE_DEPTH 4
+
+// a bound on the bytes the value at (absolute) idx takes coded on its own,
+// added to size: no more than that, or CACHE_MIN_SIZE or over as soon as it
+// may be as large. this is much cheaper than coding the value, so a table
+// that is clearly too small to cache is written once rather than captured
+// first. functions, and tables more than SIZE_DEPTH deep, count as large.
+static size_t coded_size( lua_State *L, int idx, int depth, size_t size )
+{
+  switch( lua_type( L, idx ) )
+  {
+    case LUA_TNIL:
+    case LUA_TBOOLEAN:
+      return size + 2;
+    case LUA_TNUMBER:
+      return size + 11;                  // an RPC_INTEGER varint at most
+    case LUA_TSTRING:
+      return size + 5 + lua_objlen( L, idx );
+    case LUA_TTABLE:
+      if( depth == SIZE_DEPTH || !lua_checkstack( L, 3 ) )
+        return CACHE_MIN_SIZE;
+      size += 16;                        // the ends, and an array block header
+      lua_pushnil( L );
+      while( size < CACHE_MIN_SIZE && lua_next( L, idx ) )
+      {
+        size = coded_size( L, lua_gettop( L ) - 1, depth + 1, size );
+        size = coded_size( L, lua_gettop( L ), depth + 1, size );
+        lua_pop( L, 1 );
+      }
+      if( size >= CACHE_MIN_SIZE )
+        lua_pop( L, 1 );                 // the key lua_next stopped at
+      return size;
+    default:
+      return CACHE_MIN_SIZE;
+  }
+}
+
+// write a value of a request from a client with ENCODING_CACHE. a long
+// string or table that may code to CACHE_MIN_SIZE bytes is first coded on
+// its own into the capture buffer. from CACHE_MIN_SIZE bytes it is sent as
+// its hash if the server holds it already, or else with its hash for the
+// server to keep; otherwise it is written again as usual, as it could not
+// share the message's numberings and dictionary while it was captured.
+// functions, and tables holding one, are never cached: every call must get
+// closures of its own, as with functions sent plainly.
+static void write_cacheable( Transport *tpt, lua_State *L, int idx )
+{
+  int t = lua_type( L, idx );
+  uint64_t h;
+
+  if( ( t != LUA_TTABLE &&
+        !( t == LUA_TSTRING && lua_objlen( L, idx ) >= CACHE_MIN_SIZE ) ) ||
+      ( t == LUA_TTABLE && coded_size( L, idx, 0, 0 ) < CACHE_MIN_SIZE ) )
+  {
+    write_variable( tpt, L, idx );
+    return;
+  }
+  isolate_begin( tpt );
+  capture.tpt = tpt;
+  capture.overflow = 0;
+  capture.functions = 0;
+  write_variable( tpt, L, idx );
+  capture.tpt = NULL;
+  isolate_end( L );
+  if( capture.overflow || capture.functions || capture.len < CACHE_MIN_SIZE )
+  {
+    capture_end();
+    write_variable( tpt, L, idx );
+    return;
+  }
+  h = cache_hash( capture.buf, capture.len );
+  if( cache_find( tpt->cache, h ) >= 0 )
+  {
+    transport_write_uint8_t( tpt, RPC_CACHED );
+    transport_write_uint32_t( tpt, ( uint32_t )( h >> 32 ) );
+    transport_write_uint32_t( tpt, ( uint32_t )h );
+  }
+  else
+  {
+    cache_insert( tpt->cache, h );
+    transport_write_uint8_t( tpt, RPC_CACHE_STORE );
+    transport_write_uint32_t( tpt, ( uint32_t )( h >> 32 ) );
+    transport_write_uint32_t( tpt, ( uint32_t )h );
+    transport_write_buffer( tpt, capture.buf, ( int )capture.len );
+  }
+  capture_end();
+}
+
+// the values of one request or reply form a message: write or read n of
+// them, from first on the stack or onto it
+static void write_values( Transport *tpt, lua_State *L, int first, int n )
+{
+  int i;
+
+  message_reset( L );
+  for( i = 0; i < n; i ++ )
+    if( tpt->cache != NULL && tpt->cache->sender )
+      write_cacheable( tpt, L, first + i );
+    else
+      write_variable( tpt, L, first + i );
+  message_reset( L );
+}
+
+static void read_values( Transport *tpt, lua_State *L, int n )
+{
+  int i;
+
+  message_reset( L );
+  for( i = 0; i < n; i ++ )
+    read_variable( tpt, L );
+  message_reset( L );
 }
 
 
@@ -585,7 +1744,9 @@ static int read_variable( Transport *tpt, lua_State *L )
 void client_negotiate( Transport *tpt )
 {
   struct exception e;
-  char header[ 8 ];
+  char header[ 9 ];
+  uint8_t offer = encoding_setup( tpt, encoding_features, 1 );
+  int len = offer ? 9 : 8;
   int x = 1;
 
   // default client configuration
@@ -599,23 +1760,24 @@ void client_negotiate( Transport *tpt )
   header[1] = 'R';
   header[2] = 'P';
   header[3] = 'C';
-  header[4] = RPC_PROTOCOL_VERSION;
+  header[4] = len > 8 ? RPC_PROTOCOL_VERSION : RPC_PROTOCOL_VERSION_PLAIN;
   header[5] = tpt->loc_little;
   header[6] = tpt->lnum_bytes;
   header[7] = tpt->loc_intnum;
+  header[8] = offer;                    // the server answers what it accepts
   //  printf("write version\n");
-  transport_write_string( tpt, header, sizeof( header ) );
+  transport_write_string( tpt, header, len );
   transport_flush(tpt);
   //  printf("write version ok\n");
   
   // read server's response
   //  printf("read version\n");
-  transport_read_string( tpt, header, sizeof( header ) );
+  transport_read_string( tpt, header, len );
   if( header[0] != 'L' ||
       header[1] != 'R' ||
       header[2] != 'P' ||
       header[3] != 'C' ||
-      header[4] != RPC_PROTOCOL_VERSION )
+      header[4] != ( len > 8 ? RPC_PROTOCOL_VERSION : RPC_PROTOCOL_VERSION_PLAIN ) )
   {
     e.errnum = ERR_HEADER;
     e.type = nonfatal;
@@ -625,39 +1787,42 @@ void client_negotiate( Transport *tpt )
   tpt->net_little = header[5];
   tpt->lnum_bytes = header[6];
   tpt->net_intnum = header[7];
+  tpt->features = encoding_setup( tpt, len > 8 ? ( uint8_t )header[8] & offer : 0, 1 );
 }
 
-void server_negotiate( Transport *tpt )
+// check a client's header (8 bytes, or 9 from a version 4 client) and
+// answer it
+static void server_answer( Transport *tpt, char *header )
 {
   struct exception e;
-  char header[ 8 ];
+  int len = 8;
   int x = 1;
 
-  if( transport_read_uint8_t( tpt ) != RPC_CMD_CON ){
-    e.errnum = ERR_HEADER;
-    e.type = nonfatal;
-    Throw( e );
-  }
-  
   // default sever configuration
   tpt->net_little = tpt->loc_little = ( char )*( char * )&x;
   tpt->lnum_bytes = ( char )sizeof( lua_Number );
   tpt->net_intnum = tpt->loc_intnum = ( char )( ( ( lua_Number )0.5 ) == 0 );
   
-  // read and check header from client
-  //  printf("read version\n");
-  transport_read_string( tpt, header, sizeof( header ) );
   if( header[0] != 'L' ||
       header[1] != 'R' ||
       header[2] != 'P' ||
       header[3] != 'C' ||
-      header[4] != RPC_PROTOCOL_VERSION )
+      ( header[4] != RPC_PROTOCOL_VERSION && header[4] != RPC_PROTOCOL_VERSION_PLAIN ) )
   {
     e.errnum = ERR_HEADER;
     e.type = nonfatal;
     Throw( e );
   }
   //printf("read version ok\n");
+  // a version 4 client follows with the encoding features it offers;
+  // those both sides have are used
+  tpt->features = 0;
+  if( header[4] == RPC_PROTOCOL_VERSION )
+  {
+    header[ 8 ] = tpt->features = encoding_setup( tpt, ( uint8_t )header[ 8 ] & encoding_features, 0 );
+    len = 9;
+  }
+
   // check if endianness differs, if so use big endian order  
   if( header[ 5 ] != tpt->loc_little )
     header[ 5 ] = tpt->net_little = 0;
@@ -674,14 +1839,68 @@ void server_negotiate( Transport *tpt )
   
   //printf("write version\n");
   // send reconciled configuration to client
-  transport_write_string( tpt, header, sizeof( header ) );
+  transport_write_string( tpt, header, len );
   transport_flush(tpt);
+  tpt->negotiated = 1;
   //printf("write version ok\n");
 }
 
+// read up to length bytes that have already arrived, without waiting.
+// returns how many were read
+static int read_arrived( Transport *tpt, char *buffer, int length )
+{
+  int n = 0;
+
+  while( n < length && ( transport_buffered( tpt ) || transport_readable( tpt ) ) )
+    transport_read_string( tpt, buffer + n++, 1 );
+  return n;
+}
+
+// answer a client's header. the dispatcher runs this like any other
+// command so a slow client never holds up the event loop: on a new
+// connection the RPC_CMD_CON byte and the header are collected in
+// tpt->hdr as they arrive, over as many wakeups as they take, and answered
+// once they are all in. a connected client renegotiating has had its
+// RPC_CMD_CON read already, and the header is read straight after it.
+void server_negotiate( Transport *tpt )
+{
+  struct exception e;
+  char header[ 9 ];
+  int need = 9;
+
+  if( tpt->negotiated )
+  {
+    transport_read_string( tpt, header, 8 );
+    if( header[4] == RPC_PROTOCOL_VERSION )
+      transport_read_string( tpt, header + 8, 1 );
+    server_answer( tpt, header );
+    return;
+  }
+
+  // the command, the header, and with version 4 the features byte
+  while( tpt->hdr_len < need )
+  {
+    int n = read_arrived( tpt, tpt->hdr + tpt->hdr_len, need - tpt->hdr_len );
+    if( n == 0 )
+      return;
+    tpt->hdr_len += n;
+    if( tpt->hdr[ 0 ] != RPC_CMD_CON )
+    {
+      e.errnum = ERR_HEADER;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    if( tpt->hdr_len > 5 && tpt->hdr[ 5 ] == RPC_PROTOCOL_VERSION )
+      need = 10;
+  }
+  tpt->hdr_len = 0;
+  server_answer( tpt, tpt->hdr + 1 );
+}
+
 
 static int generic_catch_handler(lua_State *L, Transport* trans, struct exception e )
 {
+  arena_reset( &trans->arena );
   deal_with_error( L, error_string( e.errnum ) );
   switch( e.type )
   {
@@ -692,7 +1911,8 @@ static int generic_catch_handler(lua_State *L, Transport* trans, struct exceptio
       break;
     case fatal:
       printf("GEN FATAL");
-      transport_delete( trans );
+      // client handles belong to lua, so only close the link here
+      transport_close( trans );
       break;
     default: lua_assert( 0 );
   }
@@ -730,6 +1950,8 @@ void deal_with_error(lua_State *L, const char *error_string)
 Transport *client_create( lua_State *L )
 {
   Transport *client = ( Transport * )lua_newuserdata( L, sizeof( Transport ) );
+  memset( client, 0, sizeof( Transport ) );
+  client->batch_ref = LUA_NOREF;
   luaL_getmetatable( L, "rpc.client" );
   lua_setmetatable( L, -2 );
   return client;
@@ -799,12 +2021,14 @@ static void helper_remote_index( Helper *helper )
   int i, len;
   Helper **hstack;
   Transport *tpt = helper->handle;
+  ArenaMark m;
   
   // get length of name & make stack of helpers
   len = strlen( helper->funcname );
   if( helper->nparents > 0 ) // If helper has parents, build string to remote index
   {
-    hstack = ( Helper ** )alloca( sizeof( Helper * ) * helper->nparents );
+    arena_mark( &tpt->arena, &m );
+    hstack = ( Helper ** )arena_alloc( &tpt->arena, sizeof( Helper * ) * helper->nparents );
     hstack[ helper->nparents - 1 ] = helper->parent;
     len += strlen( hstack[ helper->nparents - 1 ]->funcname ) + 1;
   
@@ -822,6 +2046,7 @@ static void helper_remote_index( Helper *helper )
      transport_write_string( tpt, hstack[ i ]->funcname, strlen( hstack[ i ]->funcname ) );
      transport_write_string( tpt, ".", 1 ); 
     }
+    arena_release( &tpt->arena, &m );
   }
   else // If helper has no parents, just use length of global
 	  transport_write_uint32_t( tpt, len );
@@ -851,12 +2076,15 @@ static int helper_get( lua_State *L, Helper *helper )
   int freturn = 0;
   Transport *tpt = helper->handle;
   
+  if( tpt->batch_count > 0 )
+    batch_flush( L, tpt );
+
   Try
   {
     helper_wait_ready( tpt, RPC_CMD_GET );
     helper_remote_index( helper );
     
-    read_variable( tpt, L );
+    read_values( tpt, L, 1 );
 
     freturn = 1;
   }
@@ -868,6 +2096,218 @@ static int helper_get( lua_State *L, Helper *helper )
 }
 
 
+// write a call request for the helper with the arguments at stack
+// positions first..last. nothing is read back, so several requests may be
+// written before the first reply is collected.
+static void helper_send_call( lua_State *L, Helper *h, int first, int last )
+{
+  Transport *tpt = h->handle;
+
+  transport_write_uint8_t( tpt, RPC_CMD_CALL );
+  helper_remote_index( h );
+  transport_write_uint32_t( tpt, last - first + 1 );
+  write_values( tpt, L, first, last - first + 1 );
+}
+
+// read the reply to one call onto L's stack. returns the number of values
+// pushed, or -1 if the remote function failed (its message is pushed).
+static int helper_read_reply( Transport *tpt, lua_State *L )
+{
+  struct exception e;
+  uint32_t nret, len;
+  char *err_string;
+  ArenaMark m;
+
+  if( transport_read_uint8_t( tpt ) != RPC_READY )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = nonfatal;
+    Throw( e );
+  }
+
+  // read return code
+  if( transport_read_uint8_t( tpt ) == 0 )
+  {
+    // read return arguments
+    nret = transport_read_uint32_t( tpt );
+    if( !lua_checkstack( L, nret ) )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    read_values( tpt, L, nret );
+    return ( int )nret;
+  }
+
+  // read error and hand it back
+  transport_read_uint32_t( tpt ); // read code (not being used here)
+  len = transport_read_uint32_t( tpt );
+  arena_mark( &tpt->arena, &m );
+  err_string = ( char * )arena_alloc( &tpt->arena, len );
+  transport_read_string( tpt, err_string, len );
+  lua_pushlstring( L, err_string, len );
+  arena_release( &tpt->arena, &m );
+  return -1;
+}
+
+// lua_resume took the resuming state in 5.2, and the count of results in 5.4
+static int resume( lua_State *L, lua_State *co, int nargs )
+{
+#if LUA_VERSION_NUM >= 504
+  int nres;
+  return lua_resume( co, L, nargs, &nres );
+#elif LUA_VERSION_NUM >= 502
+  return lua_resume( co, L, nargs );
+#else
+  ( void )L;
+  return lua_resume( co, nargs );
+#endif
+}
+
+// collect the replies to all batched calls on a client. each waiting
+// coroutine is resumed with its results (or nil and a message if the call
+// failed). if the calling thread has a call in the batch its results are
+// left on its stack and their count returned.
+int batch_flush( lua_State *L, Transport *tpt )
+{
+  struct exception e;
+  int i, tbl, count = tpt->batch_count;
+  int own = 0, own_error = 0, err_ref = LUA_NOREF;
+  volatile int failed = 0;
+
+  if( count == 0 || tpt->batch_busy )
+    return 0;
+
+  // calls made by the coroutines we resume go into the next batch
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->batch_ref );
+  tbl = lua_gettop( L );
+  luaL_unref( L, LUA_REGISTRYINDEX, tpt->batch_ref );
+  lua_newtable( L );
+  tpt->batch_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+  tpt->batch_count = 0;
+  tpt->batch_busy = 1;
+
+  Try
+  {
+    transport_set_timeout( tpt, tpt->com_timeout );
+    transport_flush( tpt );
+  }
+  Catch( e )
+  {
+    failed = e.errnum;
+  }
+
+  for( i = 1; i <= count; i ++ )
+  {
+    lua_State *co;
+    int nret = 0;
+
+    lua_rawgeti( L, tbl, i );
+    co = lua_tothread( L, -1 );
+    lua_pop( L, 1 );
+
+    if( !failed )
+    {
+      Try
+      {
+        transport_set_timeout( tpt, tpt->wait_timeout );
+        nret = helper_read_reply( tpt, co );
+        transport_set_timeout( tpt, tpt->com_timeout );
+      }
+      Catch( e )
+      {
+        failed = e.errnum;
+      }
+    }
+    if( failed )
+    {
+      lua_pushnil( co );
+      lua_pushstring( co, error_string( failed ) );
+      nret = 2;
+    }
+
+    if( co == L )
+    {
+      own = nret;
+      own_error = ( nret < 0 );
+      continue;
+    }
+    if( nret < 0 )
+    {
+      if( global_error_handler != LUA_NOREF )
+      {
+        lua_xmove( co, L, 1 );
+        deal_with_error( L, lua_tostring( L, -1 ) );
+        lua_pop( L, 1 );
+        nret = 0;
+      }
+      else
+      {
+        lua_pushnil( co );
+        lua_insert( co, -2 );
+        nret = 2;
+      }
+    }
+    if( resume( L, co, nret ) > LUA_YIELD && err_ref == LUA_NOREF )
+    {
+      lua_xmove( co, L, 1 );
+      err_ref = luaL_ref( L, LUA_REGISTRYINDEX );
+    }
+  }
+  tpt->batch_busy = 0;
+  if( failed )
+    transport_close( tpt );
+
+  lua_remove( L, tbl );
+  if( err_ref != LUA_NOREF )
+  {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, err_ref );
+    luaL_unref( L, LUA_REGISTRYINDEX, err_ref );
+    lua_error( L );
+  }
+  if( own_error )
+  {
+    deal_with_error( L, lua_tostring( L, -1 ) );
+    return 0;
+  }
+  return own;
+}
+
+// batched call: queue the request and park the calling coroutine until the
+// batch is flushed. the main thread can't be parked, so a call from it
+// flushes straight away, as does one that closes the batching window.
+static int helper_call_batched( lua_State *L, Helper *h )
+{
+  struct exception e;
+  Transport *tpt = h->handle;
+  int ismain;
+
+  Try
+  {
+    transport_set_timeout( tpt, tpt->com_timeout );
+    helper_send_call( L, h, 2, lua_gettop( L ) );
+  }
+  Catch( e )
+  {
+    return generic_catch_handler( L, tpt, e );
+  }
+
+  lua_rawgeti( L, LUA_REGISTRYINDEX, tpt->batch_ref );
+  ismain = lua_pushthread( L );
+  lua_rawseti( L, -2, ++tpt->batch_count );
+  lua_pop( L, 1 );
+  if( tpt->batch_count == 1 )
+    tpt->batch_start = timer_now();
+
+  if( ismain || ( !tpt->batch_busy &&
+      ( tpt->batch_count >= BATCH_MAX_CALLS ||
+        ( tpt->batch_window > 0 &&
+          timer_now() - tpt->batch_start >= tpt->batch_window ) ) ) )
+    return batch_flush( L, tpt );
+
+  return lua_yield( L, 0 );
+}
 
 
 int helper_call (lua_State *L)
@@ -888,28 +2328,16 @@ int helper_call (lua_State *L)
     helper_get( L, h->parent );
     freturn = 1;
   }
+  else if( tpt->batch_ref != LUA_NOREF )
+    freturn = helper_call_batched( L, h );
   else
   {
     Try
     {
-      int i,n;
-      uint32_t nret,ret_code;
-
-      // write function name
-      tpt->timeout = tpt->com_timeout;     
-      helper_wait_ready( tpt, RPC_CMD_CALL );
-      helper_remote_index( h );
-
-      // write number of arguments
-      n = lua_gettop( L );
-      transport_write_uint32_t( tpt, n - 1 );
-    
-      // write each argument
-      for( i = 2; i <= n; i ++ )
-        write_variable( tpt, L, i );
-
+      // write function name and arguments
+      transport_set_timeout( tpt, tpt->com_timeout );     
+      helper_send_call( L, h, 2, lua_gettop( L ) );
       transport_flush(tpt);
-      tpt->timeout = tpt->wait_timeout;
 
       /* if we're in async mode, we're done */
       /*if ( h->handle->async )
@@ -918,39 +2346,19 @@ int helper_call (lua_State *L)
         freturn = 0;
       }*/
 
-      // read return code
-      ret_code = transport_read_uint8_t( tpt );
-      tpt->timeout = tpt->com_timeout;
-
-      if ( ret_code == 0 )
-      {
-        // read return arguments
-        nret = transport_read_uint32_t( tpt );
-      
-        for ( i = 0; i < ( ( int ) nret ); i ++ )
-          read_variable( tpt, L );
-      
-        freturn = ( int )nret;
-      }
-      else
-      {
-        uint32_t len;
-        char* err_string;
-        // read error and handle it
-        transport_read_uint32_t( tpt ); // read code (not being used here)
-        len = transport_read_uint32_t( tpt );
-        err_string = ( char * )alloca( len + 1 );
-        transport_read_string( tpt, err_string, len );
-        err_string[ len ] = 0;
-
-        deal_with_error( L, err_string );
-        freturn = 0;
-      }
+      transport_set_timeout( tpt, tpt->wait_timeout );
+      freturn = helper_read_reply( tpt, L );
+      transport_set_timeout( tpt, tpt->com_timeout );
     }
     Catch( e )
     {
       freturn = generic_catch_handler( L, h->handle, e );
     }
+    if( freturn < 0 )
+    {
+      deal_with_error( L, lua_tostring( L, -1 ) );
+      freturn = 0;
+    }
   }
   return freturn;
 }
@@ -971,29 +2379,35 @@ int helper_newindex( lua_State *L )
   
   tpt = h->handle;
   
+  if( tpt->batch_count > 0 )
+    batch_flush( L, tpt );
+
   Try
   {  
     // index destination on remote side
     helper_wait_ready( tpt, RPC_CMD_NEWINDEX );
     helper_remote_index( h );
 
-    write_variable( tpt, L, lua_gettop( L ) - 1 );
-    write_variable( tpt, L, lua_gettop( L ) );
+    write_values( tpt, L, lua_gettop( L ) - 1, 2 );
 
     ret_code = transport_read_uint8_t( tpt );
     if( ret_code != 0 )
     {
       uint32_t len;
       char *err_string;
+      ArenaMark m;
 
-      // read error and handle it
+      // read error and handle it (the message is copied to the stack first,
+      // as deal_with_error may not return)
       transport_read_uint32_t( tpt ); // Read code (not using here)
       len = transport_read_uint32_t( tpt );
-      err_string = ( char * )alloca( len + 1 );
+      arena_mark( &tpt->arena, &m );
+      err_string = ( char * )arena_alloc( &tpt->arena, len );
       transport_read_string( tpt, err_string, len );
-      err_string[ len ] = 0;
+      lua_pushlstring( L, err_string, len );
+      arena_release( &tpt->arena, &m );
 
-      deal_with_error( L, err_string );
+      deal_with_error( L, lua_tostring( L, -1 ) );
     }
 
     freturn = 0;
@@ -1059,14 +2473,14 @@ int helper_close (lua_State *L)
 //   around the function call.
 static void read_cmd_call( Transport *tpt, lua_State *L )
 {
-  int i, stackpos, good_function, nargs;
+  int stackpos, good_function, nargs;
   uint32_t len;
   char *funcname;
   char *token = NULL;
   // read function name
 
   len = transport_read_uint32_t( tpt ); /* function name string length */ 
-  funcname = ( char * )alloca( len + 1 );
+  funcname = ( char * )arena_alloc( &tpt->arena, ( size_t )len + 1 );
   transport_read_string( tpt, funcname, len );
   funcname[ len ] = 0;
     
@@ -1089,14 +2503,17 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
   nargs = transport_read_uint32_t( tpt );
 
   // read in each argument, leave it on the stack
-  for ( i = 0; i < nargs; i ++ ) 
-    read_variable( tpt, L );
+  read_values( tpt, L, nargs );
 
   // call the function
   if( good_function )
   {
     int nret, error_code;
+    memory_limit( 1 );
     error_code = lua_pcall( L, nargs, LUA_MULTRET, 0 );
+    memory_limit( 0 );
+    // the time the handler took does not count against the reply
+    transport_set_timeout( tpt, tpt->com_timeout );
     
     // handle errors
     if ( error_code )
@@ -1115,8 +2532,7 @@ static void read_cmd_call( Transport *tpt, lua_State *L )
       transport_write_uint8_t( tpt, 0 );
       nret = lua_gettop( L ) - stackpos;
       transport_write_uint32_t( tpt, nret );
-      for ( i = 0; i < nret; i ++ )
-        write_variable( tpt, L, stackpos + 1 + i );
+      write_values( tpt, L, stackpos + 1, nret );
     }
   }
   else
@@ -1144,7 +2560,7 @@ static void read_cmd_get( Transport *tpt, lua_State *L )
 
   // read function name
   len = transport_read_uint32_t( tpt ); // function name string length 
-  funcname = ( char * )alloca( len + 1 );
+  funcname = ( char * )arena_alloc( &tpt->arena, ( size_t )len + 1 );
   transport_read_string( tpt, funcname, len );
   funcname[ len ] = 0;
 
@@ -1161,8 +2577,10 @@ static void read_cmd_get( Transport *tpt, lua_State *L )
     token = strtok( NULL, "." );
   }
 
-  // return top value on stack
-  write_variable( tpt, L, lua_gettop( L ) );
+  // return top value on stack (an __index on the way may have taken a
+  // while, which does not count against the reply)
+  transport_set_timeout( tpt, tpt->com_timeout );
+  write_values( tpt, L, lua_gettop( L ), 1 );
 
   // empty the stack
   lua_settop ( L, 0 );
@@ -1177,7 +2595,7 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
 
   // read function name
   len = transport_read_uint32_t( tpt ); // function name string length
-  funcname = ( char * )alloca( len + 1 );
+  funcname = ( char * )arena_alloc( &tpt->arena, ( size_t )len + 1 );
   transport_read_string( tpt, funcname, len );
   funcname[ len ] = 0;
 
@@ -1195,17 +2613,17 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
       lua_remove( L, -2 );
       token = strtok( NULL, "." );
     }
-    read_variable( tpt, L ); // key
-    read_variable( tpt, L ); // value
+    read_values( tpt, L, 2 ); // key, value
     lua_settable( L, -3 ); // set key to value on indexed table
   }
   else
   {
-    read_variable( tpt, L ); // key
-    read_variable( tpt, L ); // value
+    read_values( tpt, L, 2 ); // key, value
     lua_setglobal( L, lua_tostring( L, -2 ) );
   }
-  // Write out 0 to indicate no error and that we're done
+  // Write out 0 to indicate no error and that we're done (with the time
+  // any __newindex took not counting against it)
+  transport_set_timeout( tpt, tpt->com_timeout );
   transport_write_uint8_t( tpt, 0 );
   
   // if ( error_code ) // Add some error handling later
@@ -1223,13 +2641,25 @@ static void read_cmd_newindex( Transport *tpt, lua_State *L )
   lua_settop ( L, 0 );
 }
 
+// start a request: it has com_timeout to arrive and be answered. anything
+// but a header is refused from a client that has not sent one yet
+static uint8_t read_command( Transport *tpt )
+{
+  transport_set_timeout( tpt, tpt->com_timeout );
+  // a new connection's first command is its header, which server_negotiate
+  // reads as it arrives
+  if( !tpt->negotiated )
+    return RPC_CMD_CON;
+  return transport_read_uint8_t( tpt );
+}
+
 void rpc_dispatch_worker( lua_State *L, Transport* worker )
 {  
   struct exception e;
   Try
     {
 
-      switch ( transport_read_uint8_t( worker ) )
+      switch ( read_command( worker ) )
         {
         case RPC_CMD_CALL:  // call function
           transport_write_uint8_t( worker, RPC_READY );
@@ -1253,10 +2683,12 @@ void rpc_dispatch_worker( lua_State *L, Transport* worker )
           Throw( e );
         }
       transport_flush(worker);
+      arena_reset( &worker->arena );
       //      handle->link_errs = 0;
     }
   Catch( e )
   {
+    arena_reset( &worker->arena );
     worker->must_die = 1;
     switch( e.type )
       {
@@ -1288,6 +2720,307 @@ void rpc_dispatch_worker( lua_State *L, Transport* worker )
 }
 
 
+// **************************************************************************
+// gateway: fan many socket clients in onto a single device link.
+//   requests are decoded onto the Lua stack as they arrive and written to
+//   the link back to back. their clients wait in a queue, and the replies
+//   (which the device sends in order) are handed back as the link turns
+//   readable, so more requests can go out while earlier ones are answered. values are re-encoded on each side, so
+//   clients and the device may negotiate different number formats.
+
+static void read_name( Transport *tpt, lua_State *L )
+{
+  uint32_t len;
+  char *name;
+  ArenaMark m;
+
+  len = transport_read_uint32_t( tpt );
+  arena_mark( &tpt->arena, &m );
+  name = ( char * )arena_alloc( &tpt->arena, len );
+  transport_read_string( tpt, name, len );
+  lua_pushlstring( L, name, len );
+  arena_release( &tpt->arena, &m );
+}
+
+static void write_name( Transport *tpt, lua_State *L, int idx )
+{
+  size_t len;
+  const char *name = lua_tolstring( L, idx, &len );
+  transport_write_uint32_t( tpt, len );
+  transport_write_string( tpt, name, len );
+}
+
+static void check_stack( lua_State *L, int n )
+{
+  struct exception e;
+  if( !lua_checkstack( L, n ) )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = nonfatal;
+    Throw( e );
+  }
+}
+
+// read one command from a client and queue it. returns 1 if a request was
+// added to reqs, 0 if it was handled here or the client failed (in which
+// case it is marked to die).
+int gateway_read_request( lua_State *L, Transport *client, GatewayRequest *reqs, int nreq )
+{
+  struct exception e;
+  GatewayRequest *r = &reqs[ nreq ];
+  int top = lua_gettop( L );
+  int queued = 0;
+
+  Try
+  {
+    uint8_t cmd = read_command( client );
+    int i;
+
+    r->client = client;
+    r->cmd = cmd;
+    r->base = top + 1;
+    r->same_as = -1;
+    r->nres = 0;
+    check_stack( L, 3 );
+    switch( cmd )
+    {
+      case RPC_CMD_CALL:
+      {
+        uint32_t nargs;
+        transport_write_uint8_t( client, RPC_READY );
+        read_name( client, L );
+        nargs = transport_read_uint32_t( client );
+        check_stack( L, ( int )nargs );
+        read_values( client, L, ( int )nargs );
+        queued = 1;
+        break;
+      }
+      case RPC_CMD_GET:
+        transport_write_uint8_t( client, RPC_READY );
+        read_name( client, L );
+        // concurrent reads of the same value share one trip to the device
+        for( i = 0; i < nreq; i ++ )
+          if( reqs[ i ].cmd == RPC_CMD_GET && reqs[ i ].same_as < 0 &&
+              lua_rawequal( L, reqs[ i ].base, r->base ) )
+            r->same_as = i;
+        queued = 1;
+        break;
+      case RPC_CMD_NEWINDEX:
+        transport_write_uint8_t( client, RPC_READY );
+        read_name( client, L );
+        read_values( client, L, 2 ); // key, value
+        queued = 1;
+        break;
+      case RPC_CMD_CON:
+        server_negotiate( client );
+        break;
+      default:
+        transport_write_uint8_t( client, RPC_UNSUPPORTED_CMD );
+        e.type = nonfatal;
+        e.errnum = ERR_COMMAND;
+        Throw( e );
+    }
+    transport_flush( client );
+    r->nvals = lua_gettop( L ) - top;
+  }
+  Catch( e )
+  {
+    client->must_die = 1;
+    queued = 0;
+  }
+  if( !queued )
+    lua_settop( L, top );
+  return queued;
+}
+
+static void gateway_write_request( Transport *link, lua_State *L, GatewayRequest *r )
+{
+  transport_write_uint8_t( link, r->cmd );
+  write_name( link, L, r->base );
+  if( r->cmd == RPC_CMD_CALL )
+    transport_write_uint32_t( link, r->nvals - 1 );
+  write_values( link, L, r->base + 1, r->nvals - 1 );
+}
+
+// push a remote error (code, message) onto the stack
+static void gateway_read_error( Transport *link, lua_State *L )
+{
+  lua_pushnumber( L, transport_read_uint32_t( link ) );
+  read_name( link, L );
+}
+
+static void gateway_read_reply( Transport *link, lua_State *L, GatewayRequest *r )
+{
+  struct exception e;
+  int top = lua_gettop( L );
+  uint8_t status;
+  uint32_t nret;
+
+  if( transport_read_uint8_t( link ) != RPC_READY )
+  {
+    e.errnum = ERR_PROTOCOL;
+    e.type = nonfatal;
+    Throw( e );
+  }
+  check_stack( L, 3 );
+  switch( r->cmd )
+  {
+    case RPC_CMD_CALL:
+      status = transport_read_uint8_t( link );
+      lua_pushnumber( L, status );
+      if( status == 0 )
+      {
+        nret = transport_read_uint32_t( link );
+        check_stack( L, ( int )nret );
+        read_values( link, L, ( int )nret );
+      }
+      else
+        gateway_read_error( link, L );
+      break;
+    case RPC_CMD_GET:
+      read_values( link, L, 1 );
+      break;
+    case RPC_CMD_NEWINDEX:
+      status = transport_read_uint8_t( link );
+      lua_pushnumber( L, status );
+      if( status != 0 )
+        gateway_read_error( link, L );
+      break;
+  }
+  r->res = top + 1;
+  r->nres = lua_gettop( L ) - top;
+}
+
+static void gateway_answer( Transport *client, lua_State *L, GatewayRequest *r )
+{
+  uint8_t status;
+
+  if( r->cmd == RPC_CMD_GET )
+  {
+    write_values( client, L, r->res, 1 );
+    return;
+  }
+  status = ( uint8_t )lua_tonumber( L, r->res );
+  transport_write_uint8_t( client, status );
+  if( status != 0 )
+  {
+    transport_write_uint32_t( client, ( uint32_t )lua_tonumber( L, r->res + 1 ) );
+    write_name( client, L, r->res + 2 );
+  }
+  else if( r->cmd == RPC_CMD_CALL )
+  {
+    transport_write_uint32_t( client, r->nres - 1 );
+    write_values( client, L, r->res + 1, r->nres - 1 );
+  }
+}
+
+// add a client to the back of the queue. its gateway_waiting keeps it from
+// being evicted while it waits
+static void gateway_queue( GatewayQueue *q, GatewayRequest *r, int rider )
+{
+  int i = ( q->head + q->count ) % GATEWAY_MAX_PIPELINE;
+
+  q->wait[ i ].client = r->client->id;
+  q->wait[ i ].cmd = r->cmd;
+  q->wait[ i ].rider = ( uint8_t )rider;
+  q->count ++;
+  r->client->gateway_waiting ++;
+}
+
+// take the oldest client off the queue. returns NULL if it has gone away
+// since its request was sent
+static Transport *gateway_dequeue( GatewayQueue *q )
+{
+  Transport *client = transport_from_id( q->wait[ q->head ].client );
+
+  q->head = ( q->head + 1 ) % GATEWAY_MAX_PIPELINE;
+  q->count --;
+  if( client != NULL )
+    client->gateway_waiting --;
+  return client;
+}
+
+// write the requests read in this wakeup down the link and queue their
+// clients for the replies. an identical GET rides on the first one: it is
+// queued straight after it and gets the same reply. there must be room in
+// the queue for all nreq.
+void gateway_send( lua_State *L, Transport *link, GatewayRequest *reqs, int nreq, GatewayQueue *q )
+{
+  int i, j;
+
+  if( nreq == 0 )
+    return;
+  if( q->count == 0 )
+    q->due = timer_now() + link->wait_timeout;
+  for( i = 0; i < nreq; i ++ )
+    if( reqs[ i ].same_as < 0 )
+    {
+      gateway_queue( q, &reqs[ i ], 0 );
+      for( j = i + 1; j < nreq; j ++ )
+        if( reqs[ j ].same_as == i )
+          gateway_queue( q, &reqs[ j ], 1 );
+    }
+
+  transport_set_timeout( link, link->com_timeout );
+  for( i = 0; i < nreq; i ++ )
+    if( reqs[ i ].same_as < 0 )
+      gateway_write_request( link, L, &reqs[ i ] );
+  transport_flush( link );
+}
+
+// the link is readable: read the replies that have come in and answer the
+// clients waiting on them. the rest of a reply that has started to arrive
+// is waited for (com_timeout), but no more than that. throws if the link
+// fails or sends a reply nobody is waiting for.
+void gateway_receive( lua_State *L, Transport *link, GatewayQueue *q )
+{
+  struct exception e;
+  int top = lua_gettop( L );
+  GatewayRequest r;
+
+  do
+  {
+    if( q->count == 0 )
+    {
+      e.errnum = ERR_PROTOCOL;
+      e.type = nonfatal;
+      Throw( e );
+    }
+    r.cmd = q->wait[ q->head ].cmd;
+    transport_set_timeout( link, link->com_timeout );
+    gateway_read_reply( link, L, &r );
+    do
+    {
+      Transport *client = gateway_dequeue( q );
+      if( client == NULL || client->must_die )
+        continue;
+      Try
+      {
+        gateway_answer( client, L, &r );
+        transport_flush( client );
+      }
+      Catch( e )
+      {
+        client->must_die = 1;
+      }
+    } while( q->count > 0 && q->wait[ q->head ].rider );
+    lua_settop( L, top );
+    q->due = timer_now() + link->wait_timeout;
+  } while( transport_buffered( link ) );
+}
+
+// the link has failed: nobody waiting will get a reply, so drop them all
+void gateway_fail( GatewayQueue *q )
+{
+  while( q->count > 0 )
+  {
+    Transport *client = gateway_dequeue( q );
+    if( client != NULL )
+      client->must_die = 1;
+  }
+}
+
+
 /*void rpc_dispatch_accept(Transport* listener)
 {
   
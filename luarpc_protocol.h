@@ -19,6 +19,22 @@ void rpc_dispatch_worker( lua_State *L, Transport* worker );
 //void rpc_dispatch_accept(Transport* listener);
 int ismetatable_type( lua_State *L, int ud, const char *tname );
 extern int global_error_handler;
+extern int value_max_depth;
+
+// Encoding features (a mask), offered and accepted by rpc.encoding and
+// negotiated per connection into Transport.features
+enum {
+  ENCODING_REFS = 1,                     // tables repeated in a message are back-references
+  ENCODING_STRINGS = 2,                  // so are strings
+  ENCODING_DICT = 4,                     // table keys are remembered across messages
+  ENCODING_CACHE = 8,                    // large arguments are sent once per connection
+  ENCODING_ARRAYS = 16,                  // arrays of numbers are sent as typed blocks
+  ENCODING_INTEGERS = 32,                // integers are sent as varints
+  ENCODING_FLOAT32 = 64,                 // other numbers are rounded to floats
+  ENCODING_SERIES = 128                  // number arrays may be delta or XOR coded
+};
+extern uint8_t encoding_features;
+
 // Support for Compiling with & without rotables 
 #ifdef LUA_OPTIMIZE_MEMORY
 #define LUA_ISCALLABLE( state, idx ) ( lua_isfunction( state, idx ) || lua_islightfunction( state, idx ) )
@@ -26,6 +42,37 @@ extern int global_error_handler;
 #define LUA_ISCALLABLE( state, idx ) lua_isfunction( state, idx )
 #endif
 
+// Gateway relaying: requests read from socket clients are held on the Lua
+// stack until they have been written to the device link, then their clients
+// wait in a GatewayQueue for the replies, which the device sends in order
+typedef struct _GatewayRequest GatewayRequest;
+struct _GatewayRequest {
+  Transport *client;   // client waiting on the reply
+  uint8_t cmd;         // RPC_CMD_*
+  int base, nvals;     // stack slots holding name and arguments
+  int res, nres;       // stack slots holding the reply
+  int same_as;         // earlier identical GET this one rides on, or -1
+};
+
+typedef struct _GatewayQueue GatewayQueue;
+struct _GatewayQueue {
+  struct {
+    uint32_t client;   // Transport.id of the client, see transport_from_id
+    uint8_t cmd;       // RPC_CMD_*
+    uint8_t rider;     // answered with the reply of the entry before it
+  } wait[ GATEWAY_MAX_PIPELINE ];
+  int head, count;
+  uint32_t due;        // timer_now() by which the oldest must be answered
+};
+
+int gateway_read_request( lua_State *L, Transport *client, GatewayRequest *reqs, int nreq );
+void gateway_send( lua_State *L, Transport *link, GatewayRequest *reqs, int nreq, GatewayQueue *q );
+void gateway_receive( lua_State *L, Transport *link, GatewayQueue *q );
+void gateway_fail( GatewayQueue *q );
+
+int batch_flush( lua_State *L, Transport *tpt );
+double ms_from_timeval( struct timeval t );
+
 int client_index (lua_State *L);
 int client_newindex (lua_State *L);
 int helper_newindex (lua_State *L);
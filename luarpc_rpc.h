@@ -3,6 +3,7 @@
 #define LUARPC_H
 
 #include <stdio.h>
+#include <stddef.h>
 
 #ifdef WIN32
 #include <WinSock2.h>
@@ -21,6 +22,45 @@
 
 #define MAX_LINK_ERRS ( 2 ) // Maximum number of framing errors before connection reset
 
+#define IOBUF_SIZE ( 4096 ) // Transport I/O buffer, filled by one read per wakeup
+
+#define IOBUF_POOL_MAX ( 64 ) // Released I/O buffers kept for reuse
+
+#define MAX_DEPTH ( 200 ) // Default nesting limit of values sent or received, see rpc.max_depth
+#define MAX_DEPTH_LIMIT ( 10000 ) // Highest rpc.max_depth, so a value's frames stay well inside ARENA_MAX
+#define MESSAGE_MAX_STRINGS ( 65536 ) // Strings numbered per message for back-references (u16)
+#define DICT_ENTRIES ( 64 ) // Strings each end of a connection remembers per direction (<= 256)
+#define DICT_MAX_LEN ( 32 ) // Longest string kept in a connection dictionary
+#define CACHE_ENTRIES ( 8 ) // Large arguments the server keeps per connection (ENCODING_CACHE)
+#define CACHE_MIN_SIZE ( 16384 ) // Smallest encoded argument that is cached
+#define CACHE_MAX_SIZE ( 1 << 24 ) // Largest encoded argument that is cached
+#define ARRAY_MIN_COUNT ( 8 ) // Shortest array of numbers sent as a block (ENCODING_ARRAYS)
+#define SERIES_MAX_COUNT ( 65536 ) // Longest array tried as a series (ENCODING_SERIES)
+
+#define ARENA_MAX ( 1 << 24 ) // Most a single request may hold in temporaries (bytes)
+
+#define MEMPOOL_CHUNK_SIZE ( 65536 ) // Pooled Lua allocator takes memory in chunks of this (a power of 2)
+#define MEMPOOL_MAX_BLOCK ( 512 ) // Larger Lua blocks go to the state's own allocator
+
+#define GATEWAY_MAX_PIPELINE ( 16 ) // Requests waiting on the device link at once
+#define GATEWAY_RETRY ( 1000 ) // ms between attempts to renegotiate a failed device link
+#define POOL_CHECK_INTERVAL ( 1000 ) // ms between checks that a pool's idle connections are alive and at least min
+
+#define BATCH_MAX_CALLS ( 32 ) // Batched client calls held before a forced flush
+
+#define MAXCON ( 128 ) // Default listen backlog, see rpc.server options
+
+#define TRANSPORT_SLAB_SIZE ( 256 ) // Connection table grows by this many slots
+
+#define TIMER_LEVELS ( 4 ) // Timer wheel levels; with 6 bits a level, they span ~4.6 hours
+#define TIMER_SLOT_BITS ( 6 )
+#define TIMER_SLOTS ( 1 << TIMER_SLOT_BITS )
+
+#define HANDSHAKE_TIMEOUT ( 5000 ) // Default ms a new connection has to send its header
+#define ACCEPT_RETRY ( 100 ) // ms a listener is left out of the loop after accept fails
+#define DRAIN_TIMEOUT ( 5000 ) // Default ms rpc.drain has to answer requests already received
+#define WORKER_RESPAWN_DELAY ( 1000 ) // ms before replacing a worker that died within as long of starting
+
 #if defined( LUARPC_ENABLE_SERIAL )
   #define LUARPC_MODE "serial"
   #define tpt_handler ser_handler
@@ -31,11 +71,50 @@
   #else
     #define tpt_handler int 
   #endif
-  #define MAXCON ( 1 )
+  #define RESOLVE_CACHE_SIZE ( 16 )      // Hosts kept in the name resolution cache
+  #define RESOLVE_TTL_MS ( 60000 )       // How long a resolved host is trusted
+  #define MAX_CONNECT_ADDRS ( 8 )        // Addresses of a host tried when connecting
+  #define CONNECT_ATTEMPT_DELAY ( 250 )  // ms before racing the next address
 #else
   #error "No RPC mode Selected.."
 #endif
 
+/****************************************************************************/
+// Lua version compatibility
+//   the code is written against the Lua 5.1 API. these map the parts of it
+//   that later versions dropped onto 5.2 to 5.4 (lua.h and lauxlib.h come
+//   first). RPC_LUA_INTEGERS is set where integers are a subtype of number.
+
+#if LUA_VERSION_NUM >= 502
+#ifndef luaL_reg
+#define luaL_reg luaL_Reg
+#endif
+#ifndef lua_objlen
+#define lua_objlen( L, i ) lua_rawlen( L, ( i ) )
+#endif
+#ifndef lua_ref
+#define lua_ref( L, lock ) luaL_ref( L, LUA_REGISTRYINDEX )
+#endif
+#ifndef lua_unref
+#define lua_unref( L, ref ) luaL_unref( L, LUA_REGISTRYINDEX, ( ref ) )
+#endif
+#ifndef lua_getref
+#define lua_getref( L, ref ) lua_rawgeti( L, LUA_REGISTRYINDEX, ( ref ) )
+#endif
+#ifndef luaL_checkint
+#define luaL_checkint( L, n ) ( ( int )luaL_checkinteger( L, ( n ) ) )
+#endif
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define lua_dump( L, writer, data ) lua_dump( L, writer, data, 0 )
+#define RPC_LUA_INTEGERS
+#endif
+
+#ifndef lua_assert
+#define lua_assert( x ) ( ( void )0 )
+#endif
+
 // a kind of silly way to get the maximum int, but oh well ...
 #define MAXINT ((int)((((unsigned int)(-1)) << 1) >> 1))
 
@@ -86,7 +165,8 @@ enum {
   ERR_COMMAND   = MAXINT - 106,
   ERR_HEADER    = MAXINT - 107,
   ERR_LONGFNAME = MAXINT - 108,
-  ERR_TIMEOUT   = MAXINT - 109
+  ERR_TIMEOUT   = MAXINT - 109,
+  ERR_DEPTH     = MAXINT - 110   // tables nested deeper than rpc.max_depth
 };
 
 enum exception_type { done, nonfatal, fatal };
@@ -105,25 +185,183 @@ extern struct exception_context the_exception_context[ 1 ];
 
 // Transport Connection Structure
 typedef struct _Transport Transport;
+
+struct transport_node {
+  Transport* t;
+  struct transport_node *prev;
+  struct transport_node *next;
+};
+
+// Timers
+//   a timer wheel ticks in milliseconds of timer_now(). timers are embedded
+//   in the objects they belong to; arm and cancel are O(1). timer_advance
+//   calls fire for every timer due up to now, and timer_next gives how long
+//   the caller may sleep before that is needed (-1 = no timers).
+typedef struct _Timer Timer;
+struct _Timer {
+  Timer *prev, *next;                    // slot list, NULL when not armed
+  uint32_t expires;
+};
+
+typedef struct _TimerWheel TimerWheel;
+struct _TimerWheel {
+  uint32_t now;                          // next tick to run
+  uint64_t occupied[ TIMER_LEVELS ];     // bit per slot that may hold timers
+  Timer slots[ TIMER_LEVELS ][ TIMER_SLOTS ];
+};
+
+uint32_t timer_now( void );
+void timer_init( TimerWheel *w, uint32_t now );
+void timer_arm( TimerWheel *w, Timer *t, uint32_t expires );
+void timer_cancel( Timer *t );
+int timer_armed( Timer *t );
+void timer_advance( TimerWheel *w, uint32_t now, void ( *fire )( Timer *t ) );
+int timer_next( TimerWheel *w, uint32_t now );
+
+// Shared I/O buffers
+//   a transport only holds a buffer while it has unread input or unsent
+//   output, so idle connections cost no buffer memory. released buffers
+//   are kept for reuse, up to IOBUF_POOL_MAX of them.
+typedef struct _IOBuf IOBuf;
+struct _IOBuf {
+  IOBuf *next;                           // free list link
+  uint16_t pos, len;                     // pending window of data
+  uint8_t data[ IOBUF_SIZE ];
+};
+
+IOBuf *iobuf_get (void);
+void iobuf_put (IOBuf *b);
+
+// Request arenas
+//   temporaries of a request (names, strings on their way into Lua) are bump
+//   allocated from its transport's arena rather than the C stack, which one
+//   bogus length from a peer could overflow. small allocations are carved
+//   from pooled I/O buffers, larger ones get a block of their own, and a
+//   request may not hold more than ARENA_MAX bytes. arena_release frees
+//   everything allocated since arena_mark; arena_reset frees the lot once
+//   the request is over.
+typedef struct _ArenaLarge ArenaLarge;
+
+typedef struct _Arena Arena;
+struct _Arena {
+  IOBuf *blocks;                         // newest first, len = bytes used
+  ArenaLarge *large;                     // oversized allocations, newest first
+  uint32_t used;                         // bytes allocated
+};
+
+typedef struct _ArenaMark ArenaMark;
+struct _ArenaMark {
+  IOBuf *block;
+  uint16_t len;
+  ArenaLarge *large;
+  uint32_t used;
+};
+
+void *arena_alloc (Arena *a, size_t n);
+void arena_mark (Arena *a, ArenaMark *m);
+void arena_release (Arena *a, const ArenaMark *m);
+void arena_reset (Arena *a);
+
+// Pooled Lua allocator (luarpc_alloc.c)
+//   memory_install puts it on a state; request_cap (0 = none) limits what
+//   a request may allocate while memory_limit is on, i.e. while its handler
+//   runs. memory_request_begin/end bracket each request that is served.
+void memory_install (lua_State *L, size_t request_cap);
+void memory_request_begin (Transport *tpt);
+void memory_request_end (void);
+void memory_limit (int on);
+void memory_push_stats (lua_State *L);
+
+// Connection dictionaries
+//   table keys both ends of a connection remember (ENCODING_DICT), in the
+//   order they were added; next is the slot the following one replaces
+typedef struct _DictTable DictTable;
+struct _DictTable {
+  uint32_t hash[ DICT_ENTRIES ];
+  uint8_t len[ DICT_ENTRIES ];
+  char str[ DICT_ENTRIES ][ DICT_MAX_LEN ];
+  uint16_t next, filled;
+};
+
+typedef struct _Dict Dict;
+struct _Dict {
+  DictTable out;                         // keys this end sent
+  DictTable in;                          // keys the peer sent
+};
+
+// Content cache (luarpc_cache.c)
+//   the hashes of the large arguments a client has sent and the server
+//   holds, with the clock of their last use (0 = empty slot). both ends keep
+//   one; cache_find and cache_insert count as uses. the server's values are
+//   stored with cache_store (the value on top of the stack, which is left
+//   there) and pushed with cache_push.
+typedef struct _Cache Cache;
+struct _Cache {
+  uint64_t hash[ CACHE_ENTRIES ];
+  uint32_t used[ CACHE_ENTRIES ];
+  uint32_t clock;
+  uint8_t sender;                        // this end is the client
+};
+
+uint64_t cache_hash (const void *data, size_t len);
+int cache_find (Cache *c, uint64_t h);
+int cache_insert (Cache *c, uint64_t h);
+void cache_store (lua_State *L, Transport *tpt, int slot);
+void cache_push (lua_State *L, Transport *tpt, int slot);
+
+// Number blocks (luarpc_swap.c)
+//   element types of the blocks of ENCODING_ARRAYS, and the kernels that
+//   convert n numbers between doubles and an element type and swap the byte
+//   order of n elements of size bytes in place. the series types
+//   (ENCODING_SERIES) pack n values into at most n * 10 bytes, returning the
+//   length; unpacking returns 0 unless it used exactly len bytes.
+enum { ARRAY_I8 = 1, ARRAY_I16, ARRAY_I32, ARRAY_F32, ARRAY_F64, ARRAY_DELTA, ARRAY_XOR };
+
+void swap_block (uint8_t *p, size_t n, size_t size);
+void array_pack (uint8_t *d, const double *s, size_t n, int type);
+void array_unpack (double *d, const uint8_t *s, size_t n, int type);
+size_t series_pack_ints (uint8_t *d, const int64_t *v, size_t n);
+int series_unpack_ints (int64_t *v, size_t n, const uint8_t *s, size_t len);
+size_t series_pack_doubles (uint8_t *d, const uint64_t *v, size_t n);
+int series_unpack_doubles (uint64_t *v, size_t n, const uint8_t *s, size_t len);
+
 struct _Transport 
 {
   tpt_handler fd;
-  unsigned tmr_id;
   uint32_t    loc_little: 1,               // Local is little endian?
     loc_intnum: 1,               // Local is integer only?
     net_little: 1,               // Network is little endian?
     net_intnum: 1;               // Network is integer only?
   uint8_t     lnum_bytes;
-#ifndef WIN32
-  FILE* file;
-#endif
-  int is_set;
-  int must_die;
-  struct timeval wait_timeout;
-  struct timeval com_timeout;
-  struct timeval timeout;
+  uint8_t is_set;
+  uint8_t must_die;
+  uint8_t negotiated;                    // server side: client header received
+  uint8_t hdr_len;                       // server side: bytes of it in hdr so far
+  char hdr[ 10 ];                        // server side: RPC_CMD_CON and the header
+  uint8_t features;                      // ENCODING_* agreed with the peer
+  Dict *dict;                            // with ENCODING_DICT, else NULL
+  Cache *cache;                          // with ENCODING_CACHE, else NULL
+  uint8_t batch_busy;                    // replies are being collected
+  uint16_t batch_count;                  // calls written but not yet answered
+  uint8_t gateway_waiting;               // gateway: requests queued on the device link
+  uint32_t wait_timeout;                 // ms
+  uint32_t com_timeout;                  // ms
+  uint32_t deadline;                     // timer_now() by which the current operation must finish
+  uint32_t batch_start;                  // when the oldest parked call was written
+  uint32_t batch_window;                 // how long calls may be held (ms)
+  int batch_ref;                         // registry ref of parked callers, LUA_NOREF if not batching
+  uint32_t id;                           // connection table slot and generation
+  struct transport_node link;            // place in transport_list (or the free slots)
+  IOBuf *rbuf;                           // unread input, NULL when there is none
+  IOBuf *wbuf;                           // unsent output, NULL when there is none
+  Arena arena;                           // temporaries of the current request
+  uint32_t mem_allocated;                // bytes the Lua state took serving it
+  Timer timer;                           // server side: handshake deadline
 };
 
+#define transport_of_timer( t ) \
+  ( ( Transport * )( ( char * )( t ) - offsetof( Transport, timer ) ) )
+
 
 typedef struct _Helper Helper;
 struct _Helper {
@@ -161,18 +399,32 @@ void deal_with_error (lua_State *L, const char *error_string);
 void transport_init (Transport *tpt);
 
 // Open Listener / Server 
-void transport_open_listener(lua_State *L, Transport *handle);
+//   backlog is the number of pending connections the OS may queue, flags
+//   are LISTEN_* bits
+#define LISTEN_REUSEPORT 1               // share the port with other processes
+void transport_open_listener(lua_State *L, Transport *handle, int backlog,
+                             int flags);
 
 // Open Connection / Client 
 int transport_open_connection(lua_State *L, Transport *tpt);
 
 // Accept Connection 
-void transport_accept (Transport *tpt, Transport *atpt);
+//   never blocks: 1 = atpt accepted, 0 = nothing pending
+int transport_accept (Transport *tpt, Transport *atpt);
+
+// Give the operation that follows ms to complete: reads and writes that
+// have to wait throw ERR_TIMEOUT once it has passed
+void transport_set_timeout (Transport *tpt, uint32_t ms);
+uint32_t transport_remaining (Transport *tpt);
 
 // Read & Write to Transport 
 void transport_read_buffer (Transport *tpt, uint8_t *buffer, int length);
 void transport_write_buffer (Transport *tpt, const uint8_t *buffer, int length);
 
+// Check if a complete read is already buffered on the transport, e.g. when a
+// client wrote several requests at once: 1 = buffered, 0 = need to wait
+int transport_buffered (Transport *tpt);
+
 // Check if data is available on connection without reading:
 // 		- 1 = data available, 0 = no data available
 int transport_readable (Transport *tpt);
@@ -184,17 +436,28 @@ int transport_is_open (Transport *tpt);
 
 // Shut down connection
 void transport_delete (Transport *tpt);
+
+// Connection table
+//   transport_create takes a slot, transport_free (called by
+//   transport_delete) gives it back. transport_from_id finds a live
+//   connection by its id, or returns NULL once that connection is gone.
 Transport * transport_create (void);
+void transport_free (Transport *tpt);
+Transport * transport_from_id (uint32_t id);
 
 
 void transport_flush(Transport *tpt);
 
-struct transport_node {
-  Transport* t;
-  struct transport_node *prev;
-  struct transport_node *next;
-};
-int transport_select(struct transport_node* transports);
+#if defined( LUARPC_ENABLE_SOCKET ) && !defined( WIN32 )
+// Open a serial device as a buffered transport (used by the gateway)
+void transport_open_serial (Transport *tpt, const char *path);
+// Drop buffered and unread input and unsent output of a serial transport
+void transport_discard_serial (Transport *tpt);
+#endif
+
+// Wait up to timeout_ms (-1 = no limit) for any of the transports to be
+// readable, setting is_set on each that is
+int transport_select(struct transport_node* transports, int timeout_ms);
 
 
 
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #ifdef WIN32_BUILD
@@ -21,10 +22,17 @@ void transport_open( Transport *tpt, const char *path );
 
 #ifdef LUARPC_ENABLE_SERIAL
 
+// A serial port carries a single link: the worker accepted on the listening
+// port shares its handle, and the listener stays out of the readiness loop
+// until that worker goes away.
+static Transport *serial_link = NULL;
+
 // Setup Transport 
 void transport_init (Transport *tpt)
 {
   tpt->fd = INVALID_TRANSPORT;
+  tpt->must_die = 0;
+  tpt->rbuf = NULL;
 }
 
 void transport_open( Transport *tpt, const char *path )
@@ -41,48 +49,57 @@ void transport_open( Transport *tpt, const char *path )
   }
   
   ser_setup( tpt->fd, 115200, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 );
-  ser_set_timeout_ms( tpt->fd, 1000 );
+  // reads never block: we wait for readiness ourselves, then drain the
+  // driver queue into a pooled buffer with a single read
+  ser_set_timeout_ms( tpt->fd, SER_NO_TIMEOUT );
 }
 
 // Open Listener / Server 
-void transport_open_listener(lua_State *L, Transport *handle)
+//   a serial port has no connection queue or port sharing, so backlog and
+//   flags are ignored
+void transport_open_listener(lua_State *L, Transport *handle, int backlog,
+                             int flags)
 {
+  ( void )backlog;
+  ( void )flags;
   check_num_args (L,2); // 1st arg is path, 2nd is handle
   if (!lua_isstring (L,1))
     luaL_error(L,"first argument must be serial serial port");
 
-  transport_open( &handle->ltpt, lua_tostring (L,1) );
-    
-  while( transport_readable( &handle->ltpt ) == 0 ); // wait for incoming data
+  transport_open( handle, lua_tostring (L,1) );
 }
 
 // Open Connection / Client
-int transport_open_connection(lua_State *L, Handle *handle)
+int transport_open_connection(lua_State *L, Transport *tpt)
 { 
-  check_num_args (L,2); // 1st arg is path, 2nd is handle
   if (!lua_isstring (L,1))
     luaL_error(L,"first argument must be serial serial port");
 
-  transport_open( &handle->tpt, lua_tostring (L,1) );
+  transport_open( tpt, lua_tostring (L,1) );
   
   return 1;
 }
 
 // Accept Connection
-void transport_accept (Transport *tpt, Transport *atpt)
+//   only called once the listening port is readable, so there is no need to
+//   wait for incoming data here. the port carries a single link, so there is
+//   nothing more to accept while it is attached
+int transport_accept (Transport *tpt, Transport *atpt)
 {
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
-  while( transport_readable( tpt ) == 0 ); // wait for incoming data
   
+  if( serial_link != NULL )
+    return 0;
   atpt->fd = tpt->fd;
+  serial_link = atpt;
+  return 1;
 }
 
-
 // Read & Write to Transport
 void transport_read_buffer (Transport *tpt, uint8_t *buffer, int length)
 {
-  uint32_t n;
+  int n;
   struct exception e;
   TRANSPORT_VERIFY_OPEN;
   
@@ -90,21 +107,57 @@ void transport_read_buffer (Transport *tpt, uint8_t *buffer, int length)
   {
     TRANSPORT_VERIFY_OPEN;
 
-    n = ser_read( tpt->fd, buffer, length );
-    
-    // error handling
-    if( n == 0 )
+    if( tpt->rbuf == NULL )
     {
-      e.errnum = ERR_NODATA;
-      e.type = nonfatal;
-      Throw( e );
-    }
+      n = ser_readable( tpt->fd, transport_remaining( tpt ) );
+      if( n < 0 )
+      {
+        e.errnum = transport_errno;
+        e.type = fatal;
+        Throw( e );
+      }
+      if( n == 0 )
+      {
+        e.errnum = ERR_TIMEOUT;
+        e.type = nonfatal;
+        Throw( e );
+      }
+
+      tpt->rbuf = iobuf_get();
+      n = ( int )ser_read( tpt->fd, tpt->rbuf->data, IOBUF_SIZE );
+      if( n <= 0 )
+      {
+        iobuf_put( tpt->rbuf );
+        tpt->rbuf = NULL;
+      }
     
-    if( n < 0 )
+      // error handling
+      if( n == 0 )
+      {
+        e.errnum = ERR_NODATA;
+        e.type = nonfatal;
+        Throw( e );
+      }
+    
+      if( n < 0 )
+      {
+        e.errnum = transport_errno;
+        e.type = fatal;
+        Throw( e );
+      }
+
+      tpt->rbuf->len = ( uint16_t )n;
+    }
+
+    n = tpt->rbuf->len - tpt->rbuf->pos;
+    if( n > length )
+      n = length;
+    memcpy( buffer, tpt->rbuf->data + tpt->rbuf->pos, n );
+    tpt->rbuf->pos += n;
+    if( tpt->rbuf->pos == tpt->rbuf->len )
     {
-      e.errnum = transport_errno;
-      e.type = fatal;
-      Throw( e );
+      iobuf_put( tpt->rbuf );
+      tpt->rbuf = NULL;
     }
    
     buffer += n;
@@ -128,6 +181,13 @@ void transport_write_buffer( Transport *tpt, const uint8_t *buffer, int length )
   }
 }
 
+// writes go straight to the port, nothing is held back
+void transport_flush (Transport *tpt)
+{
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+}
+
 // Check if data is available on connection without reading:
 //    - 1 = data available, 0 = no data available
 int transport_readable (Transport *tpt)
@@ -137,8 +197,11 @@ int transport_readable (Transport *tpt)
 
   if (tpt->fd == INVALID_TRANSPORT)
     return 0;
+
+  if( tpt->rbuf != NULL )
+    return 1;
   
-  ret = ser_readable( tpt->fd );
+  ret = ser_readable( tpt->fd, SER_NO_TIMEOUT );
   
   if ( ret < 0 )
   {
@@ -150,6 +213,41 @@ int transport_readable (Transport *tpt)
   return ( ret > 0 );
 }
 
+// Check if received data is already buffered
+int transport_buffered (Transport *tpt)
+{
+  return ( tpt->rbuf != NULL );
+}
+
+// Wait until the link has data, or timeout_ms. Only one transport is live on a serial
+// server at a time: the accepted worker if there is one, the listening port
+// otherwise.
+int transport_select(struct transport_node* head, int timeout_ms)
+{
+  struct transport_node* node = head;
+  Transport* active = NULL;
+  int ret = 1;
+
+  while( (node = node->next) != head ){
+    Transport* t = node->t;
+    t->is_set = 0;
+    if( !transport_is_open( t ) )
+      continue;
+    if( serial_link != NULL && t != serial_link && t->fd == serial_link->fd )
+      continue;
+    if( active == NULL || t == serial_link )
+      active = t;
+  }
+  if( active == NULL )
+    return -1;
+
+  if( active->rbuf == NULL )
+    ret = ser_readable( active->fd, timeout_ms < 0 ? SER_INF_TIMEOUT : ( uint32_t )timeout_ms );
+  if( ret > 0 )
+    active->is_set = 1;
+  return ret;
+}
+
 // Check if transport is open:
 //    1 = connection open, 0 = connection closed
 int transport_is_open (Transport *tpt)
@@ -158,13 +256,35 @@ int transport_is_open (Transport *tpt)
 }
 
 // Shut down connection
+//   the accepted worker only borrows the port from the listener, so closing
+//   it just detaches the link
 void transport_close (Transport *tpt)
 {
-  if (tpt->fd != INVALID_TRANSPORT)
+  if( tpt == serial_link )
+  {
+    serial_link = NULL;
+    tpt->fd = INVALID_TRANSPORT;
+  }
+  else if (tpt->fd != INVALID_TRANSPORT)
   {
     ser_close( tpt->fd );
     tpt->fd = INVALID_TRANSPORT;
   }
+  if( tpt->rbuf != NULL )
+  {
+    iobuf_put( tpt->rbuf );
+    tpt->rbuf = NULL;
+  }
+  free( tpt->dict );
+  tpt->dict = NULL;
+  free( tpt->cache );
+  tpt->cache = NULL;
+}
+
+void transport_delete (Transport *tpt)
+{
+  transport_close( tpt );
+  transport_free( tpt );
 }
 
 #endif // LUARPC_ENABLE_SERIAL
@@ -5,6 +5,10 @@
 * see the file LICENSE that comes with this distribution.                    *
 *****************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4 */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -19,6 +23,8 @@
 
 
 #define sock_errno WSAGetLastError()
+#define sock_close closesocket
+#define poll WSAPoll
 
 #define EINPROGRESS WSAEWOULDBLOCK
 #define EAGAIN WSAEWOULDBLOCK
@@ -39,8 +45,15 @@
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
 
 #define sock_errno errno
+#define sock_close close
+
+#ifdef LUARPC_RESOLVER_THREAD
+#include <pthread.h>
+#endif
 
 #endif /* END NEEDED INCLUDES W/ SOCKETS */
 
@@ -180,12 +193,21 @@ int transport_is_open (Transport *tpt)
   return (tpt->fd != INVALID_TRANSPORT);
 }
 
+/* set socket options on a freshly opened socket. buffering is our own:
+ * see transport_read_buffer.
+ */
+
+static void transport_attach (Transport *tpt)
+{
+  int flag = 1;
+  setsockopt( tpt->fd, IPPROTO_TCP, TCP_NODELAY, ( char * )&flag, sizeof( int ) );
+}
+
 /* open a socket */
 
 void transport_open (Transport *tpt)
 {
   struct exception e;
-  int flag = 1;
 #ifdef WIN32
   tpt->fd = WSASocket( PF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, 0 );
 #else
@@ -197,17 +219,46 @@ void transport_open (Transport *tpt)
     e.type = fatal;
     Throw( e );
   }
-  setsockopt( tpt->fd, IPPROTO_TCP, TCP_NODELAY, ( char * )&flag, sizeof( int ) );
+  transport_attach (tpt);
+}
+
 #ifndef WIN32
-  tpt->file = fdopen(tpt->fd,"r+");
-  if( tpt->file == NULL ){
+/* open a serial device and drive it through the same buffered, non-blocking
+ * code paths as a socket. this is what lets the gateway talk to a device
+ * while serving sockets.
+ */
+
+void transport_open_serial (Transport *tpt, const char *path)
+{
+  struct exception e;
+  tpt->fd = ser_open( path );
+  if (tpt->fd == INVALID_TRANSPORT) 
+  {
     e.errnum = sock_errno;
     e.type = fatal;
     Throw( e );
   }
-#endif
-  //  setvbuf(tpt->file,b150,_IOFBF,sizeof(b150));
+  ser_setup( tpt->fd, 115200, SER_DATABITS_8, SER_PARITY_NONE, SER_STOPBITS_1 );
+  ser_set_timeout_ms( tpt->fd, SER_NO_TIMEOUT );
+}
+
+/* throw away what is buffered in either direction, and whatever the device
+ * has sent that was not read yet, so a fresh header exchange starts clean.
+ */
+
+void transport_discard_serial (Transport *tpt)
+{
+  if( tpt->rbuf ){
+    iobuf_put (tpt->rbuf);
+    tpt->rbuf = NULL;
+  }
+  if( tpt->wbuf ){
+    iobuf_put (tpt->wbuf);
+    tpt->wbuf = NULL;
+  }
+  ser_flush_input (tpt->fd);
 }
+#endif
 
 void transport_close (Transport *tpt)
 {
@@ -217,34 +268,47 @@ void transport_close (Transport *tpt)
   tpt->fd = NULL;
   }
 #else
-  if( tpt->file ){
-    fclose (tpt->file);
-    tpt->file = NULL;
-  }
+  if( tpt->fd != INVALID_TRANSPORT )
+    close (tpt->fd);
+  tpt->fd = INVALID_TRANSPORT;
 #endif
+  if( tpt->rbuf ){
+    iobuf_put (tpt->rbuf);
+    tpt->rbuf = NULL;
+  }
+  if( tpt->wbuf ){
+    iobuf_put (tpt->wbuf);
+    tpt->wbuf = NULL;
+  }
+  free (tpt->dict);
+  tpt->dict = NULL;
+  free (tpt->cache);
+  tpt->cache = NULL;
 }
 
 void transport_delete (Transport *tpt){
   transport_close( tpt );
-  free(tpt);
+  transport_free( tpt );
 }
 
 
-static void transport_setnonblock (Transport *tpt)
+static int socket_setnonblock (tpt_handler fd)
 {
-  struct exception e;
-  int RetVal;
-
 #ifdef WIN32
   u_long arg = 1;
 
-  RetVal = ioctlsocket( tpt->fd, FIONBIO, &arg);
+  return ioctlsocket( fd, FIONBIO, &arg);
 #else
-  int flags = fcntl(tpt->fd,F_GETFL,NULL);
-  RetVal = fcntl(tpt->fd,F_SETFL,flags|O_NONBLOCK);
+  int flags = fcntl(fd,F_GETFL,NULL);
+  return fcntl(fd,F_SETFL,flags|O_NONBLOCK);
 #endif
+}
+
+static void transport_setnonblock (Transport *tpt)
+{
+  struct exception e;
 
-  if(RetVal!=0)
+  if(socket_setnonblock(tpt->fd)!=0)
   {
     e.errnum = sock_errno;
     e.type = fatal;
@@ -252,46 +316,326 @@ static void transport_setnonblock (Transport *tpt)
   }
 }
 
-/* connect the socket to a host */
+/****************************************************************************/
+/* name resolution.
+ * lookups go through getaddrinfo (so IPv6 works) and are cached per host for
+ * RESOLVE_TTL_MS, so reconnecting to a known server doesn't wait on DNS.
+ * with LUARPC_RESOLVER_THREAD the lookup runs on a helper thread and the
+ * caller waits at most its com_timeout; a late answer still fills the cache.
+ */
+
+struct resolve_entry {
+  char host[ 256 ];
+  struct addrinfo *addrs;
+  double expires;
+};
+
+static struct resolve_entry resolve_cache[ RESOLVE_CACHE_SIZE ];
 
-static void transport_connect (Transport *tpt, uint32_t ip_address, uint16_t ip_port)
+static double monotonic_ms (void)
 {
-  struct exception e;
-  struct sockaddr_in name;
+#ifdef WIN32
+  return (double) GetTickCount ();
+#else
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+#ifdef WIN32
+static struct timeval *timeval_of (struct timeval *tv, uint32_t ms)
+{
+  tv->tv_sec = ms / 1000;
+  tv->tv_usec = (ms % 1000) * 1000;
+  return tv;
+}
+#endif
+
+/* sockets are waited on with poll rather than select: an fd_set only holds
+ * descriptors below FD_SETSIZE, and a busy server soon has more than that.
+ * poll_grow keeps one array for the event loop, grown to fit the list.
+ */
+
+static struct pollfd *poll_set = NULL;
+static size_t poll_cap = 0;
+
+static struct pollfd *poll_grow (size_t n)
+{
+  if (n > poll_cap) {
+    size_t cap = poll_cap ? poll_cap : 64;
+    struct pollfd *set;
+    while (cap < n)
+      cap *= 2;
+    if ((set = (struct pollfd *) realloc (poll_set, cap * sizeof (*set))) == NULL)
+      return NULL;
+    poll_set = set;
+    poll_cap = cap;
+  }
+  return poll_set;
+}
+
+/* put a lookup result in the cache, taking ownership of addrs. replaces the
+ * entry for the same host, else an expired one, else the oldest. */
+
+static void resolve_store (const char *host, struct addrinfo *addrs)
+{
+  struct resolve_entry *slot = &resolve_cache[ 0 ];
+  int i;
+
+  for (i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+    struct resolve_entry *r = &resolve_cache[ i ];
+    if (r->addrs != NULL && strcmp (r->host, host) == 0) {
+      slot = r;
+      break;
+    }
+    if (r->expires < slot->expires)
+      slot = r;
+  }
+  if (slot->addrs != NULL)
+    freeaddrinfo (slot->addrs);
+  strncpy (slot->host, host, sizeof (slot->host) - 1);
+  slot->host[ sizeof (slot->host) - 1 ] = 0;
+  slot->addrs = addrs;
+  slot->expires = monotonic_ms () + RESOLVE_TTL_MS;
+}
+
+static struct addrinfo *resolve_lookup_cache (const char *host)
+{
+  double now = monotonic_ms ();
+  int i;
+  for (i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+    struct resolve_entry *r = &resolve_cache[ i ];
+    if (r->addrs != NULL && r->expires > now && strcmp (r->host, host) == 0)
+      return r->addrs;
+  }
+  return NULL;
+}
+
+static int resolve_query (const char *host, struct addrinfo **addrs)
+{
+  struct addrinfo hints;
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  return getaddrinfo (host, NULL, &hints, addrs);
+}
+
+#ifdef LUARPC_RESOLVER_THREAD
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+
+struct resolve_job {
+  char host[ 256 ];
+  int done, refs, err;
+};
+
+static void *resolve_thread (void *arg)
+{
+  struct resolve_job *job = (struct resolve_job *) arg;
+  struct addrinfo *addrs = NULL;
+  int err = resolve_query (job->host, &addrs);
+
+  pthread_mutex_lock (&resolve_lock);
+  if (err == 0)
+    resolve_store (job->host, addrs);
+  job->err = err;
+  job->done = 1;
+  pthread_cond_broadcast (&resolve_done);
+  if (--job->refs == 0)
+    free (job);
+  pthread_mutex_unlock (&resolve_lock);
+  return NULL;
+}
+
+/* look host up on a helper thread, waiting no more than timeout_ms. called
+ * with resolve_lock held. */
+
+static int resolve_wait (const char *host, double timeout_ms)
+{
+  struct resolve_job *job;
+  struct timespec until;
+  struct timeval now;
+  pthread_t thread;
   int err;
-  TRANSPORT_VERIFY_OPEN;
-  name.sin_family = AF_INET;
-  name.sin_port = htons (ip_port);
-  name.sin_addr.s_addr = htonl (ip_address);
-
-  transport_setnonblock(tpt);
-
-  err = connect (tpt->fd, (struct sockaddr *) &name, sizeof (name));
-  if( err != 0 ){
-    if( sock_errno == EINPROGRESS ){
-      fd_set set;        
-      unsigned int len = sizeof(name); 
-      FD_ZERO (&set);
-      FD_SET (tpt->fd,&set);
-      if( select(tpt->fd+1,NULL,&set,NULL,&tpt->timeout) > 0 ){
-        if( getpeername(tpt->fd, (struct sockaddr *) &name, &len) != 0 ){
-          e.errnum = sock_errno;
-          e.type = fatal;
-          Throw( e );
-        }
+
+  job = (struct resolve_job *) malloc (sizeof (struct resolve_job));
+  if (job == NULL)
+    return EAI_MEMORY;
+  memset (job, 0, sizeof (struct resolve_job));
+  strncpy (job->host, host, sizeof (job->host) - 1);
+  job->refs = 2;
+  if (pthread_create (&thread, NULL, resolve_thread, job) != 0) {
+    free (job);
+    return EAI_AGAIN;
+  }
+  pthread_detach (thread);
+
+  gettimeofday (&now, NULL);
+  until.tv_sec = now.tv_sec + (time_t) (timeout_ms / 1000);
+  until.tv_nsec = now.tv_usec * 1000 + (long) ((timeout_ms - (long) (timeout_ms / 1000) * 1000) * 1000000);
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+  while (!job->done)
+    if (pthread_cond_timedwait (&resolve_done, &resolve_lock, &until) != 0)
+      break;
+
+  err = job->done ? job->err : EAI_AGAIN;
+  if (--job->refs == 0)
+    free (job);
+  return err;
+}
+
+#endif
+
+/* socket address of a lookup result with the port filled in */
+
+static socklen_t resolve_copy (struct addrinfo *ai, uint16_t port, struct sockaddr_storage *addr)
+{
+  memcpy (addr, ai->ai_addr, ai->ai_addrlen);
+  if (ai->ai_family == AF_INET6)
+    ((struct sockaddr_in6 *) addr)->sin6_port = htons (port);
+  else
+    ((struct sockaddr_in *) addr)->sin_port = htons (port);
+  return (socklen_t) ai->ai_addrlen;
+}
+
+/* resolve host into at most max socket addresses, alternating address
+ * families in the order the resolver preferred them (RFC 8305). returns
+ * the number of addresses, 0 if the host could not be resolved.
+ */
+
+static int resolve (const char *host, uint16_t port, struct sockaddr_storage *addrs,
+                    socklen_t *lens, int max, double timeout_ms)
+{
+  struct addrinfo *list, *ai;
+  struct addrinfo *family[ 2 ][ MAX_CONNECT_ADDRS ];
+  int count[ 2 ] = { 0, 0 };
+  int i, k, n = 0;
+
+#ifdef LUARPC_RESOLVER_THREAD
+  pthread_mutex_lock (&resolve_lock);
+  list = resolve_lookup_cache (host);
+  if (list == NULL && resolve_wait (host, timeout_ms) == 0)
+    list = resolve_lookup_cache (host);
+#else
+  (void) timeout_ms;
+  list = resolve_lookup_cache (host);
+  if (list == NULL && resolve_query (host, &list) == 0)
+    resolve_store (host, list);
+#endif
+
+  /* split by family, keeping the resolver's order within each */
+  for (ai = list; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      continue;
+    k = (ai->ai_family != list->ai_family);
+    if (count[ k ] < MAX_CONNECT_ADDRS)
+      family[ k ][ count[ k ]++ ] = ai;
+  }
+  for (i = 0; n < max && (i < count[ 0 ] || i < count[ 1 ]); i++)
+    for (k = 0; k < 2; k++)
+      if (i < count[ k ] && n < max) {
+        lens[ n ] = resolve_copy (family[ k ][ i ], port, &addrs[ n ]);
+        n++;
+      }
+
+#ifdef LUARPC_RESOLVER_THREAD
+  pthread_mutex_unlock (&resolve_lock);
+#endif
+  return n;
+}
+
+/* connect the transport to the first of the given addresses that answers.
+ * attempts are staggered CONNECT_ATTEMPT_DELAY ms apart and raced against
+ * each other (Happy Eyeballs), so a dead address or broken IPv6 route costs
+ * a fraction of a second instead of the whole timeout.
+ */
+
+static void transport_connect (Transport *tpt, struct sockaddr_storage *addrs, socklen_t *lens, int n)
+{
+  struct exception e;
+  tpt_handler fds[ MAX_CONNECT_ADDRS ];
+  int i, next = 0, pending = 0, winner = -1;
+  int lasterr = ERR_TIMEOUT;
+  double deadline = monotonic_ms () + transport_remaining (tpt);
+  double next_start = 0;
+
+  for (i = 0; i < n; i++)
+    fds[ i ] = INVALID_TRANSPORT;
+
+  while (winner < 0) {
+    double now = monotonic_ms ();
+    double wait;
+    struct pollfd set[ MAX_CONNECT_ADDRS ];
+
+    /* start the next attempt when the last one has had its head start */
+    if (next < n && (pending == 0 || now >= next_start)) {
+      tpt_handler fd = socket (addrs[ next ].ss_family, SOCK_STREAM, IPPROTO_TCP);
+      if (fd == INVALID_TRANSPORT || socket_setnonblock (fd) != 0) {
+        lasterr = sock_errno;
+        if (fd != INVALID_TRANSPORT)
+          sock_close (fd);
+      }
+      else if (connect (fd, (struct sockaddr *) &addrs[ next ], lens[ next ]) == 0) {
+        fds[ next ] = fd;
+        winner = next;
+      }
+      else if (sock_errno == EINPROGRESS) {
+        fds[ next ] = fd;
+        pending++;
       }
       else {
-        e.errnum = ERR_TIMEOUT;
-        e.type = fatal;
-        Throw( e );
+        lasterr = sock_errno;
+        sock_close (fd);
       }
+      next++;
+      next_start = now + CONNECT_ATTEMPT_DELAY;
+      continue;
     }
-    else {
-      e.errnum = sock_errno;
-      e.type = fatal;
-      Throw( e );
+    if (pending == 0 || now >= deadline)
+      break;
+
+    wait = (next < n && next_start < deadline ? next_start : deadline) - now;
+    for (i = 0; i < next; i++) {
+      set[ i ].fd = fds[ i ];   /* closed attempts are negative, and skipped */
+      set[ i ].events = POLLOUT;
+      set[ i ].revents = 0;
+    }
+    if (poll (set, next, (int) wait + 1) <= 0)
+      continue;
+
+    for (i = 0; i < next && winner < 0; i++) {
+      int err = 0;
+      socklen_t len = sizeof (err);
+      if (fds[ i ] == INVALID_TRANSPORT || set[ i ].revents == 0)
+        continue;
+      if (getsockopt (fds[ i ], SOL_SOCKET, SO_ERROR, (char *) &err, &len) == 0 && err == 0) {
+        winner = i;
+        break;
+      }
+      lasterr = err ? err : sock_errno;
+      sock_close (fds[ i ]);
+      fds[ i ] = INVALID_TRANSPORT;
+      pending--;
     }
   }
+
+  for (i = 0; i < next; i++)
+    if (i != winner && fds[ i ] != INVALID_TRANSPORT)
+      sock_close (fds[ i ]);
+
+  if (winner < 0) {
+    e.errnum = lasterr;
+    e.type = fatal;
+    Throw( e );
+  }
+  tpt->fd = fds[ winner ];
+  transport_attach (tpt);
 }
 
 
@@ -314,6 +658,32 @@ static void transport_bind (Transport *tpt, uint32_t ip_address, uint16_t ip_por
 }
 
 
+/* let several processes bind the same port, each with its own accept
+ * queue. the kernel spreads incoming connections over them.
+ */
+
+static void transport_reuseport (Transport *tpt)
+{
+  struct exception e;
+  TRANSPORT_VERIFY_OPEN;
+#ifdef SO_REUSEPORT
+  {
+    int one = 1;
+    if (setsockopt (tpt->fd,SOL_SOCKET,SO_REUSEPORT,(void*)&one,
+                    sizeof(one)) == 0)
+      return;
+  }
+  e.errnum = sock_errno;
+#elif defined( WIN32 )
+  e.errnum = WSAENOPROTOOPT;
+#else
+  e.errnum = ENOPROTOOPT;
+#endif
+  e.type = fatal;
+  Throw( e );
+}
+
+
 /* listen for incoming connections, with up to `maxcon' connections
  * queued up.
  */
@@ -331,34 +701,54 @@ static void transport_listen (Transport *tpt, int maxcon)
 }
 
 
+/* true if a failed accept just means there is nothing (left) to accept:
+ * the queue is drained, or the client gave up while queued.
+ */
+
+static int accept_drained (int err)
+{
+#ifdef WIN32
+  return err == WSAEWOULDBLOCK || err == WSAECONNRESET || err == WSAEINTR;
+#else
+  return err == EAGAIN || err == EWOULDBLOCK || err == ECONNABORTED ||
+         err == EINTR;
+#endif
+}
+
+
 /* accept an incoming connection, initializing `asock' with the new connection.
+ * the listener is non-blocking, so this returns 0 once the queue is empty.
+ * where accept4 exists the new socket comes back non-blocking in the same
+ * call.
  */
 
-void transport_accept (Transport *tpt, Transport *atpt)
+int transport_accept (Transport *tpt, Transport *atpt)
 {
   struct exception e;
-  struct sockaddr_in clientname;
+  struct sockaddr_storage clientname;
   socklen_t namesize;
   TRANSPORT_VERIFY_OPEN;
   namesize = sizeof( clientname );
+#if defined( __linux__ ) && defined( SOCK_NONBLOCK )
+  atpt->fd = accept4( tpt->fd, ( struct sockaddr* ) &clientname, &namesize,
+                      SOCK_NONBLOCK );
+#else
   atpt->fd = accept( tpt->fd, ( struct sockaddr* ) &clientname, &namesize );
-  if (atpt->fd == -1 ) //INVALID_TRANSPORT) 
+#endif
+  if (atpt->fd == INVALID_TRANSPORT) 
   {
-    assert(0);
+    if( accept_drained( sock_errno ) )
+      return 0;
     e.errnum = sock_errno;
     e.type = fatal;
     Throw( e );
   }
 
-#ifndef WIN32
-  atpt->file = fdopen(atpt->fd,"r+");
-  if( atpt->file == NULL ){
-    e.errnum = sock_errno;
-    e.type = fatal;
-    Throw( e );
-  }
-#endif
+  transport_attach(atpt);
+#if !( defined( __linux__ ) && defined( SOCK_NONBLOCK ) )
   transport_setnonblock(atpt);
+#endif
+  return 1;
 }
 
 #ifdef WIN32
@@ -387,11 +777,12 @@ void transport_read_buffer (Transport *tpt, uint8_t *buffer, int length)
       length -= n;  
     } else if( last_err == ERROR_IO_PENDING ) {      
         fd_set set;       
+        struct timeval tv;
         int ret;
 
         FD_ZERO (&set);
         FD_SET (tpt->fd,&set);
-        ret = select( (int)tpt->fd+1,&set,NULL,NULL,&tpt->timeout);
+        ret = select( (int)tpt->fd+1,&set,NULL,NULL,timeval_of(&tv,transport_remaining(tpt)));
         if( ret == 0 ){
           e.errnum = ERR_TIMEOUT;
           e.type = nonfatal;
@@ -426,11 +817,12 @@ void transport_write_buffer (Transport *tpt, const uint8_t *buffer, int length)
     } 
     else if(last_error == ERROR_IO_PENDING ){            
         fd_set set;       
+        struct timeval tv;
         int ret;
 
         FD_ZERO (&set);
         FD_SET (tpt->fd,&set);
-        ret = select( (int)tpt->fd+1,&set,NULL,NULL,&tpt->timeout);
+        ret = select( (int)tpt->fd+1,&set,NULL,NULL,timeval_of(&tv,transport_remaining(tpt)));
         if( ret == 0 ){
           e.errnum = ERR_TIMEOUT;
           e.type = nonfatal;
@@ -447,102 +839,157 @@ void transport_write_buffer (Transport *tpt, const uint8_t *buffer, int length)
 
 #else
 
-/* read from the socket into a buffer */
+/* wait until the transport's deadline for the socket to become readable,
+ * or writable. returns 0 when it is, else the error to throw.
+ */
+
+static int socket_wait (Transport *tpt, int for_write)
+{
+  struct pollfd p;
+  int ret;
+
+  p.fd = tpt->fd;
+  p.events = for_write ? POLLOUT : POLLIN;
+  p.revents = 0;
+  ret = poll (&p, 1, (int) transport_remaining (tpt));
+  if (ret == 0)
+    return ERR_TIMEOUT;
+  if (ret < 0 && sock_errno != EINTR)
+    return sock_errno;
+  return 0;
+}
+
+/* write all of a buffer, waiting while the socket is full. returns 0, or
+ * the error to throw.
+ */
+
+static int socket_send (Transport *tpt, const uint8_t *buffer, int length)
+{
+  int err;
+
+  while (length > 0) {
+    ssize_t n = write (tpt->fd, buffer, length);
+    if (n > 0) {
+      buffer += n;
+      length -= (int) n;
+    }
+    else if (n < 0 && (sock_errno == EAGAIN || sock_errno == EWOULDBLOCK)) {
+      if ((err = socket_wait (tpt, 1)) != 0)
+        return err;
+    }
+    else if (n < 0 && sock_errno != EINTR)
+      return sock_errno;
+  }
+  return 0;
+}
+
+/* read from the socket into a buffer. input is read a whole IOBUF_SIZE at
+ * a time into a pooled buffer that the transport only keeps while some of
+ * it is unread. reads of at least that size go straight to the caller.
+ */
 
 void transport_read_buffer (Transport *tpt, uint8_t *buffer, int length)
 {
-   struct exception e;   
-   TRANSPORT_VERIFY_OPEN;
+  struct exception e;
+  IOBuf *b;
+  ssize_t n;
+  TRANSPORT_VERIFY_OPEN;
 
   while (length > 0) {
-    int n = fread ((void*) buffer,1,length,tpt->file);
-    //    printf("fread ret = %d %d %d\n",length,n,errno);
-    buffer += n;
-    length -= n;    
-    if( n == 0 && feof(tpt->file) ){
-      e.errnum = sock_errno;
+    if ((b = tpt->rbuf) != NULL) {
+      n = b->len - b->pos;
+      if (n > length)
+        n = length;
+      memcpy (buffer, b->data + b->pos, n);
+      b->pos += (uint16_t) n;
+      buffer += n;
+      length -= (int) n;
+      if (b->pos == b->len) {
+        iobuf_put (b);
+        tpt->rbuf = NULL;
+      }
+      continue;
+    }
+
+    if (length >= IOBUF_SIZE)
+      n = read (tpt->fd, buffer, length);
+    else {
+      b = tpt->rbuf = iobuf_get ();
+      n = read (tpt->fd, b->data, IOBUF_SIZE);
+      if (n > 0) {
+        b->len = (uint16_t) n;
+        continue;
+      }
+      iobuf_put (b);
+      tpt->rbuf = NULL;
+    }
+
+    if (n > 0) {
+      buffer += n;
+      length -= (int) n;
+    }
+    else if (n == 0) {
+      e.errnum = ERR_EOF;
       e.type = nonfatal;
       Throw( e );
-    } 
-    if (length && sock_errno == EAGAIN ) {
-        fd_set set;       
-        int ret;
-        
-        FD_ZERO (&set);
-        FD_SET (tpt->fd,&set);
-        //        printf("EAGAIN & SELECT\n");
-        ret = select(tpt->fd+1,&set,NULL,NULL,&tpt->timeout);
-        //   printf("select ret = %d\n",ret);
-        if( ret == 0 ){
-          e.errnum = ERR_TIMEOUT;
-          e.type = nonfatal;
-          Throw( e );
-        }        
-        //        printf("EAGAIN & SELECT returns\n");
-           
-    } 
-    else if( length != 0 ) {
+    }
+    else if (sock_errno == EAGAIN || sock_errno == EWOULDBLOCK) {
+      /* the peer may be waiting for output we are still holding */
+      transport_flush (tpt);
+      if ((e.errnum = socket_wait (tpt, 0)) != 0) {
+        e.type = nonfatal;
+        Throw( e );
+      }
+    }
+    else if (sock_errno != EINTR) {
       e.errnum = sock_errno;
       e.type = nonfatal;
       Throw( e );
-    }   
-  }
+    }
   }
-/* write a buffer to the socket */
+}
+
+/* write a buffer to the socket. output is gathered in a pooled buffer until
+ * it fills or transport_flush is called; writes of at least IOBUF_SIZE with
+ * nothing pending go straight out.
+ */
 
 void transport_write_buffer (Transport *tpt, const uint8_t *buffer, int length)
 {
   struct exception e;
+  IOBuf *b;
   int n;
   TRANSPORT_VERIFY_OPEN;
-  while (length > 0) {
-    n = fwrite (buffer,1,length,tpt->file);
 
-    buffer += n;
-    length -= n;    
-
-    if( n == 0 && feof(tpt->file) ){
-      e.errnum = sock_errno;
-      e.type = nonfatal;
-      Throw( e );
-    } 
-    if (length && sock_errno == EAGAIN ) {
-        fd_set set;    
-        int ret;
-        
-        FD_ZERO (&set);
-        FD_SET (tpt->fd,&set);
-        //        printf("EAGAIN & SELECT\n");
-        ret = select(tpt->fd+1,NULL,&set,NULL,&tpt->timeout);
-        //   printf("select ret = %d\n",ret);
-        if( ret == 0 ){
-          e.errnum = ERR_TIMEOUT;
+  while (length > 0) {
+    if ((b = tpt->wbuf) == NULL) {
+      if (length >= IOBUF_SIZE) {
+        if ((e.errnum = socket_send (tpt, buffer, length)) != 0) {
           e.type = nonfatal;
           Throw( e );
-        }        
-        //        printf("EAGAIN & SELECT returns\n");
-           
-    } 
-    else if( length != 0 ) {
-      e.errnum = sock_errno;
-      e.type = nonfatal;
-      Throw( e );
-    }   
+        }
+        return;
+      }
+      b = tpt->wbuf = iobuf_get ();
+    }
+    n = IOBUF_SIZE - b->len;
+    if (n > length)
+      n = length;
+    memcpy (b->data + b->len, buffer, n);
+    b->len += (uint16_t) n;
+    buffer += n;
+    length -= n;
+    if (b->len == IOBUF_SIZE)
+      transport_flush (tpt);
   }
-
-  /*
-
-  n = fwrite (buffer,1,length,tpt->file);
-  if (n != length) 
-  {
-    e.errnum = sock_errno;
-    e.type = fatal;
-    Throw( e );
-    }*/
 }
 
 #endif 
 
+/* send pending output. the buffer goes back to the pool whether or not the
+ * send succeeds: after a failed send the stream is out of step anyway.
+ */
+
 void transport_flush (Transport *tpt)
 {
   struct exception e;
@@ -550,46 +997,51 @@ void transport_flush (Transport *tpt)
 #ifdef WIN32
   FlushFileBuffers( (HANDLE)tpt->fd );
 #else
-  fflush(tpt->file);
+  {
+    IOBuf *b = tpt->wbuf;
+
+    if (b == NULL)
+      return;
+    tpt->wbuf = NULL;
+    e.errnum = socket_send (tpt, b->data, b->len);
+    iobuf_put (b);
+    if (e.errnum != 0) {
+      e.type = nonfatal;
+      Throw( e );
+    }
+  }
 #endif
 }
 
 int transport_open_connection(lua_State *L, Transport* tpt)
 {
-  int ip_port;
-  uint32_t ip_address;
-  struct hostent *host;
+  int ip_port, n;
+  struct sockaddr_storage addrs[ MAX_CONNECT_ADDRS ];
+  socklen_t lens[ MAX_CONNECT_ADDRS ];
 
   //  check_num_args (L,3); /* Last arg is handle.. */
   if (!lua_isstring (L,1))
     luaL_error (L,"first argument must be an ip address string");
   ip_port = get_port_number (L,2);
 
-  host = gethostbyname (lua_tostring (L,1));
-  if (!host) {
+  n = resolve (lua_tostring (L,1), (uint16_t) ip_port, addrs, lens,
+               MAX_CONNECT_ADDRS, tpt->com_timeout);
+  if (n == 0) {
     deal_with_error (L,"could not resolve internet address");
     lua_pushnil (L);
     return 1;
   }
 
-  if (host->h_addrtype != AF_INET || host->h_length != 4) {
-    deal_with_error (L,"not an internet IPv4 address");
-    lua_pushnil (L);
-    return 1;
-  }
-  ip_address = ntohl ( *((uint32_t*)host->h_addr_list[0]) );
-
-  transport_open (tpt);
-  
-  tpt->timeout = tpt->com_timeout;
+  transport_set_timeout (tpt, tpt->com_timeout);
   /* connect the transport to the target server */
-  transport_connect (tpt,ip_address,(uint16_t) ip_port);
+  transport_connect (tpt,addrs,lens,n);
 
   return 1;
 }
 
 
-void transport_open_listener(lua_State *L, Transport *server)
+void transport_open_listener(lua_State *L, Transport *server, int backlog,
+                             int flags)
 {
   int port;
 
@@ -597,8 +1049,12 @@ void transport_open_listener(lua_State *L, Transport *server)
   port = get_port_number (L,1);
 
   transport_open (server);
+  if (flags & LISTEN_REUSEPORT)
+    transport_reuseport (server);
   transport_bind (server,INADDR_ANY,(uint16_t) port);
-  transport_listen (server,MAXCON);
+  transport_listen (server,backlog);
+  /* accepts are drained until the queue is empty */
+  transport_setnonblock (server);
 }
 
 /* see if there is any data to read from a socket, without actually reading
@@ -608,53 +1064,73 @@ void transport_open_listener(lua_State *L, Transport *server)
 
 int transport_readable (Transport *tpt)
 {
-  fd_set set;
-  struct timeval tv;
-  int ret;
+  struct pollfd p;
 
   if (tpt->fd == INVALID_TRANSPORT)
     return 0;
 
-  FD_ZERO (&set);
-  FD_SET (tpt->fd,&set);
+  p.fd = tpt->fd;
+  p.events = POLLIN;
+  p.revents = 0;
 
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
+  return (poll (&p, 1, 0) > 0);
+}
 
-  ret = select ( tpt->fd + 1, &set, 0, 0, &tv );
+/* see if data is already sitting in the read buffer, so that select would
+ * not report it.
+ */
 
-  return (ret > 0);
+int transport_buffered (Transport *tpt)
+{
+  return (tpt->rbuf != NULL);
 }
 
-int transport_select(struct transport_node* head)
+/* wait until a transport can be read. input that is already buffered counts
+ * as readable and keeps poll from waiting. a hang up or error counts as
+ * readable too, so the read that follows finds out what happened.
+ */
+
+int transport_select(struct transport_node* head, int timeout_ms)
 {
-  int fdmax = 0;
-  fd_set socks;
-  int select_ret = -1;
+  int nbuffered = 0;
+  int poll_ret;
+  size_t n = 0;
+  struct pollfd* set;
   struct transport_node* node = head;
-  FD_ZERO(&socks);
   while( (node = node->next) != head ){
-    int fd = (int)node->t->fd;
-    FD_SET(fd,&socks);
-    if( fd > fdmax ){
-      fdmax = fd;
+    n++;
+  }
+  if( (set = poll_grow( n )) == NULL ){
+    return -1;
+  }
+  n = 0;
+  while( (node = node->next) != head ){
+    set[ n ].fd = node->t->fd;
+    set[ n ].events = POLLIN;
+    set[ n ].revents = 0;
+    n++;
+    if( transport_buffered( node->t ) ){
+      nbuffered++;
     }
   }
-  select_ret = select(fdmax+1,&socks,NULL,NULL,NULL);
-  if( select_ret < 0 ){
-    return select_ret;
+  if( nbuffered ){
+    timeout_ms = 0;
+  }
+  poll_ret = poll(set,n,timeout_ms < 0 ? -1 : timeout_ms);
+  if( poll_ret < 0 ){
+    return poll_ret;
   }
-  node = head;
+  n = 0;
   while( (node = node->next) != head ){
     Transport* trans = node->t;
-    if( FD_ISSET(trans->fd,&socks)){
+    if( set[ n++ ].revents != 0 || transport_buffered( trans ) ){
       trans->is_set = 1;
     }
     else{
       trans->is_set = 0;
     }
   }
-  return select_ret;
+  return poll_ret + nbuffered;
 }
 
 #endif /* LUARPC_ENABLE_SOCKET */
@@ -0,0 +1,644 @@
+/*****************************************************************************
+* Lua-RPC library, Copyright (C) 2001 Russell L. Smith. All rights reserved. *
+*   Email: russ@q12.org   Web: www.q12.org                                   *
+* For documentation, see http://www.q12.org/lua. For the license agreement,  *
+* see the file LICENSE that comes with this distribution.                    *
+*****************************************************************************/
+
+// Number block kernels
+//   the numbers of an array block (ENCODING_ARRAYS) are converted between
+//   double and the block's element type, and byte-swapped for a peer of the
+//   other byte order, a buffer at a time. on x86 with GCC or clang the
+//   widest of AVX2, SSSE3 or plain C that the CPU has is picked on first
+//   use; ARM uses NEON when the compiler targets it. the plain C loops are
+//   the fallback everywhere else, and finish the tail of every run.
+//
+//   series blocks (ENCODING_SERIES) are coded at the end: integers as
+//   delta-of-delta zigzag varints, doubles as Gorilla style XORs of each
+//   value with the one before. a series is bytes (and bits, most
+//   significant first), so it needs no swapping.
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "luarpc_rpc.h"
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define SWAP_X86
+#include <immintrin.h>
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#define SWAP_NEON
+#include <arm_neon.h>
+#endif
+
+// **************************************************************************
+// plain C
+
+static void swap16_c (uint8_t *p, size_t n)
+{
+  for( ; n > 0; n --, p += 2 )
+  {
+    uint8_t t = p[ 0 ];
+    p[ 0 ] = p[ 1 ];
+    p[ 1 ] = t;
+  }
+}
+
+static void swap32_c (uint8_t *p, size_t n)
+{
+  for( ; n > 0; n --, p += 4 )
+  {
+    uint32_t x;
+    memcpy( &x, p, 4 );
+    x = ( x >> 24 ) | ( ( x >> 8 ) & 0xff00u ) | ( ( x << 8 ) & 0xff0000u ) | ( x << 24 );
+    memcpy( p, &x, 4 );
+  }
+}
+
+static void swap64_c (uint8_t *p, size_t n)
+{
+  for( ; n > 0; n --, p += 8 )
+  {
+    uint32_t hi, lo;
+    memcpy( &hi, p, 4 );
+    memcpy( &lo, p + 4, 4 );
+    swap32_c( ( uint8_t * )&hi, 1 );
+    swap32_c( ( uint8_t * )&lo, 1 );
+    memcpy( p, &lo, 4 );
+    memcpy( p + 4, &hi, 4 );
+  }
+}
+
+static void i32_to_double_c (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i < n; i ++ )
+  {
+    int32_t x;
+    memcpy( &x, s + 4 * i, 4 );
+    d[ i ] = ( double )x;
+  }
+}
+
+static void double_to_i32_c (uint8_t *d, const double *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i < n; i ++ )
+  {
+    int32_t x = ( int32_t )s[ i ];
+    memcpy( d + 4 * i, &x, 4 );
+  }
+}
+
+static void f32_to_double_c (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i < n; i ++ )
+  {
+    float x;
+    memcpy( &x, s + 4 * i, 4 );
+    d[ i ] = ( double )x;
+  }
+}
+
+static void double_to_f32_c (uint8_t *d, const double *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i < n; i ++ )
+  {
+    float x = ( float )s[ i ];
+    memcpy( d + 4 * i, &x, 4 );
+  }
+}
+
+// **************************************************************************
+// x86: SSSE3 and AVX2, chosen at run time
+
+#if defined( SWAP_X86 )
+
+#define SWAP_MASK( w ) \
+  ( w == 2 ? _mm_set_epi8( 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1 ) : \
+    w == 4 ? _mm_set_epi8( 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3 ) : \
+             _mm_set_epi8( 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 ) )
+
+// each of these does what it can a vector at a time and returns how much it
+// did (bytes for a swap, elements for a conversion); the caller finishes
+__attribute__(( target( "ssse3" ) ))
+static size_t swap_ssse3 (uint8_t *p, size_t bytes, int w)
+{
+  __m128i mask = SWAP_MASK( w );
+  size_t i;
+
+  for( i = 0; i + 16 <= bytes; i += 16 )
+  {
+    __m128i v = _mm_loadu_si128( ( const __m128i * )( p + i ) );
+    _mm_storeu_si128( ( __m128i * )( p + i ), _mm_shuffle_epi8( v, mask ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t swap_avx2 (uint8_t *p, size_t bytes, int w)
+{
+  __m128i half = SWAP_MASK( w );
+  __m256i mask = _mm256_broadcastsi128_si256( half );
+  size_t i;
+
+  for( i = 0; i + 32 <= bytes; i += 32 )
+  {
+    __m256i v = _mm256_loadu_si256( ( const __m256i * )( p + i ) );
+    _mm256_storeu_si256( ( __m256i * )( p + i ), _mm256_shuffle_epi8( v, mask ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t i32_to_double_sse2 (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    __m128i v = _mm_loadu_si128( ( const __m128i * )( s + 4 * i ) );
+    _mm_storeu_pd( d + i, _mm_cvtepi32_pd( v ) );
+    _mm_storeu_pd( d + i + 2, _mm_cvtepi32_pd( _mm_srli_si128( v, 8 ) ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t i32_to_double_avx2 (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    __m128i v = _mm_loadu_si128( ( const __m128i * )( s + 4 * i ) );
+    _mm256_storeu_pd( d + i, _mm256_cvtepi32_pd( v ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t double_to_i32_sse2 (uint8_t *d, const double *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    __m128i lo = _mm_cvttpd_epi32( _mm_loadu_pd( s + i ) );
+    __m128i hi = _mm_cvttpd_epi32( _mm_loadu_pd( s + i + 2 ) );
+    _mm_storeu_si128( ( __m128i * )( d + 4 * i ), _mm_unpacklo_epi64( lo, hi ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t double_to_i32_avx2 (uint8_t *d, const double *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+    _mm_storeu_si128( ( __m128i * )( d + 4 * i ), _mm256_cvttpd_epi32( _mm256_loadu_pd( s + i ) ) );
+  return i;
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t f32_to_double_sse2 (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    __m128 v = _mm_loadu_ps( ( const float * )( s + 4 * i ) );
+    _mm_storeu_pd( d + i, _mm_cvtps_pd( v ) );
+    _mm_storeu_pd( d + i + 2, _mm_cvtps_pd( _mm_movehl_ps( v, v ) ) );
+  }
+  return i;
+}
+
+__attribute__(( target( "sse2" ) ))
+static size_t double_to_f32_sse2 (uint8_t *d, const double *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    __m128 lo = _mm_cvtpd_ps( _mm_loadu_pd( s + i ) );
+    __m128 hi = _mm_cvtpd_ps( _mm_loadu_pd( s + i + 2 ) );
+    _mm_storeu_ps( ( float * )( d + 4 * i ), _mm_movelh_ps( lo, hi ) );
+  }
+  return i;
+}
+
+enum { LEVEL_UNKNOWN, LEVEL_C, LEVEL_SSSE3, LEVEL_AVX2 };
+static int level = LEVEL_UNKNOWN;
+
+static int cpu_level (void)
+{
+  if( level == LEVEL_UNKNOWN )
+  {
+    __builtin_cpu_init();
+    level = __builtin_cpu_supports( "avx2" ) ? LEVEL_AVX2 :
+            __builtin_cpu_supports( "ssse3" ) ? LEVEL_SSSE3 : LEVEL_C;
+  }
+  return level;
+}
+
+static size_t swap_simd (uint8_t *p, size_t bytes, int w)
+{
+  switch( cpu_level() )
+  {
+    case LEVEL_AVX2: return swap_avx2( p, bytes, w );
+    case LEVEL_SSSE3: return swap_ssse3( p, bytes, w );
+    default: return 0;
+  }
+}
+
+#define I32_TO_DOUBLE( d, s, n ) \
+  ( cpu_level() == LEVEL_AVX2 ? i32_to_double_avx2( d, s, n ) : \
+    cpu_level() == LEVEL_SSSE3 ? i32_to_double_sse2( d, s, n ) : 0 )
+#define DOUBLE_TO_I32( d, s, n ) \
+  ( cpu_level() == LEVEL_AVX2 ? double_to_i32_avx2( d, s, n ) : \
+    cpu_level() == LEVEL_SSSE3 ? double_to_i32_sse2( d, s, n ) : 0 )
+#define F32_TO_DOUBLE( d, s, n ) \
+  ( cpu_level() != LEVEL_C ? f32_to_double_sse2( d, s, n ) : 0 )
+#define DOUBLE_TO_F32( d, s, n ) \
+  ( cpu_level() != LEVEL_C ? double_to_f32_sse2( d, s, n ) : 0 )
+
+// **************************************************************************
+// ARM: NEON
+
+#elif defined( SWAP_NEON )
+
+static size_t swap_simd (uint8_t *p, size_t bytes, int w)
+{
+  size_t i;
+
+  for( i = 0; i + 16 <= bytes; i += 16 )
+  {
+    uint8x16_t v = vld1q_u8( p + i );
+    v = w == 2 ? vrev16q_u8( v ) : w == 4 ? vrev32q_u8( v ) : vrev64q_u8( v );
+    vst1q_u8( p + i, v );
+  }
+  return i;
+}
+
+#if defined( __aarch64__ )
+static size_t i32_to_double_neon (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    int32x4_t v = vld1q_s32( ( const int32_t * )( s + 4 * i ) );
+    vst1q_f64( d + i, vcvtq_f64_s64( vmovl_s32( vget_low_s32( v ) ) ) );
+    vst1q_f64( d + i + 2, vcvtq_f64_s64( vmovl_s32( vget_high_s32( v ) ) ) );
+  }
+  return i;
+}
+
+static size_t f32_to_double_neon (double *d, const uint8_t *s, size_t n)
+{
+  size_t i;
+  for( i = 0; i + 4 <= n; i += 4 )
+  {
+    float32x4_t v = vld1q_f32( ( const float * )( s + 4 * i ) );
+    vst1q_f64( d + i, vcvt_f64_f32( vget_low_f32( v ) ) );
+    vst1q_f64( d + i + 2, vcvt_high_f64_f32( v ) );
+  }
+  return i;
+}
+
+#define I32_TO_DOUBLE( d, s, n ) i32_to_double_neon( d, s, n )
+#define F32_TO_DOUBLE( d, s, n ) f32_to_double_neon( d, s, n )
+#endif
+
+#else
+
+#define swap_simd( p, bytes, w ) 0
+
+#endif
+
+#ifndef I32_TO_DOUBLE
+#define I32_TO_DOUBLE( d, s, n ) 0
+#endif
+#ifndef DOUBLE_TO_I32
+#define DOUBLE_TO_I32( d, s, n ) 0
+#endif
+#ifndef F32_TO_DOUBLE
+#define F32_TO_DOUBLE( d, s, n ) 0
+#endif
+#ifndef DOUBLE_TO_F32
+#define DOUBLE_TO_F32( d, s, n ) 0
+#endif
+
+// **************************************************************************
+// entry points
+
+void swap_block (uint8_t *p, size_t n, size_t size)
+{
+  size_t done = swap_simd( p, n * size, ( int )size );
+
+  p += done;
+  n -= done / size;
+  switch( size )
+  {
+    case 2: swap16_c( p, n ); break;
+    case 4: swap32_c( p, n ); break;
+    case 8: swap64_c( p, n ); break;
+  }
+}
+
+void array_unpack (double *d, const uint8_t *s, size_t n, int type)
+{
+  size_t i = 0;
+
+  switch( type )
+  {
+    case ARRAY_I8:
+      for( ; i < n; i ++ )
+        d[ i ] = ( double )( int8_t )s[ i ];
+      break;
+    case ARRAY_I16:
+      for( ; i < n; i ++ )
+      {
+        int16_t x;
+        memcpy( &x, s + 2 * i, 2 );
+        d[ i ] = ( double )x;
+      }
+      break;
+    case ARRAY_I32:
+      i = I32_TO_DOUBLE( d, s, n );
+      i32_to_double_c( d + i, s + 4 * i, n - i );
+      break;
+    case ARRAY_F32:
+      i = F32_TO_DOUBLE( d, s, n );
+      f32_to_double_c( d + i, s + 4 * i, n - i );
+      break;
+    default:
+      memcpy( d, s, n * 8 );
+  }
+}
+
+void array_pack (uint8_t *d, const double *s, size_t n, int type)
+{
+  size_t i = 0;
+
+  switch( type )
+  {
+    case ARRAY_I8:
+      for( ; i < n; i ++ )
+        d[ i ] = ( uint8_t )( int8_t )s[ i ];
+      break;
+    case ARRAY_I16:
+      for( ; i < n; i ++ )
+      {
+        int16_t x = ( int16_t )s[ i ];
+        memcpy( d + 2 * i, &x, 2 );
+      }
+      break;
+    case ARRAY_I32:
+      i = DOUBLE_TO_I32( d, s, n );
+      double_to_i32_c( d + 4 * i, s + i, n - i );
+      break;
+    case ARRAY_F32:
+      i = DOUBLE_TO_F32( d, s, n );
+      double_to_f32_c( d + 4 * i, s + i, n - i );
+      break;
+    default:
+      memcpy( d, s, n * 8 );
+  }
+}
+
+// **************************************************************************
+// series
+
+static uint64_t zigzag (uint64_t v)
+{
+  return ( v << 1 ) ^ ( 0 - ( v >> 63 ) );
+}
+
+static uint64_t unzigzag (uint64_t u)
+{
+  return ( u >> 1 ) ^ ( 0 - ( u & 1 ) );
+}
+
+// integers: the first value, the first difference, then the change in the
+// difference from one value to the next; arithmetic wraps, so any int64
+// goes through
+size_t series_pack_ints (uint8_t *d, const int64_t *v, size_t n)
+{
+  uint64_t prev = 0, delta = 0;
+  size_t len = 0, i;
+
+  for( i = 0; i < n; i ++ )
+  {
+    uint64_t x = ( uint64_t )v[ i ];
+    uint64_t u = zigzag( i == 0 ? x : ( x - prev ) - delta );
+
+    if( i > 0 )
+      delta = x - prev;
+    prev = x;
+    while( u >= 0x80 )
+    {
+      d[ len ++ ] = ( uint8_t )( u | 0x80 );
+      u >>= 7;
+    }
+    d[ len ++ ] = ( uint8_t )u;
+  }
+  return len;
+}
+
+int series_unpack_ints (int64_t *v, size_t n, const uint8_t *s, size_t len)
+{
+  uint64_t prev = 0, delta = 0;
+  size_t at = 0, i;
+
+  for( i = 0; i < n; i ++ )
+  {
+    uint64_t u = 0, dd;
+    int shift = 0;
+    uint8_t b;
+
+    do
+    {
+      if( at == len || shift > 63 )
+        return 0;
+      b = s[ at ++ ];
+      u |= ( uint64_t )( b & 0x7f ) << shift;
+      shift += 7;
+    } while( b & 0x80 );
+    dd = unzigzag( u );
+    if( i == 0 )
+      prev = dd;
+    else
+    {
+      delta += dd;
+      prev += delta;
+    }
+    v[ i ] = ( int64_t )prev;
+  }
+  return at == len;
+}
+
+typedef struct {
+  uint8_t *d;
+  size_t bit;
+} Bits;
+
+// append the low n bits of x; d starts zeroed
+static void put_bits (Bits *w, uint64_t x, int n)
+{
+  while( n > 0 )
+  {
+    int room = 8 - ( int )( w->bit & 7 );
+    int k = n < room ? n : room;
+    uint8_t part = ( uint8_t )( ( x >> ( n - k ) ) & ( ( 1u << k ) - 1 ) );
+
+    w->d[ w->bit >> 3 ] |= ( uint8_t )( part << ( room - k ) );
+    w->bit += k;
+    n -= k;
+  }
+}
+
+static int get_bits (Bits *r, size_t bits, int n, uint64_t *x)
+{
+  *x = 0;
+  if( r->bit + ( size_t )n > bits )
+    return 0;
+  while( n > 0 )
+  {
+    int room = 8 - ( int )( r->bit & 7 );
+    int k = n < room ? n : room;
+    uint8_t part = ( uint8_t )( ( r->d[ r->bit >> 3 ] >> ( room - k ) ) & ( ( 1u << k ) - 1 ) );
+
+    *x = ( *x << k ) | part;
+    r->bit += k;
+    n -= k;
+  }
+  return 1;
+}
+
+static int leading_zeros (uint64_t x)
+{
+#ifdef __GNUC__
+  return __builtin_clzll( x );
+#else
+  int n = 0;
+  while( !( x & ( ( uint64_t )1 << 63 ) ) )
+  {
+    x <<= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+static int trailing_zeros (uint64_t x)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll( x );
+#else
+  int n = 0;
+  while( !( x & 1 ) )
+  {
+    x >>= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+// doubles (as their bits): the first value in full, then per value a 0 bit
+// if it repeats, or 1 and the bits of its XOR with the previous one: 0 and
+// the bits within the last window, or 1, 5 bits of leading zeros, 6 bits of
+// the window's length - 1 and the bits within the new window. d must hold
+// n * 10 zeroed bytes.
+size_t series_pack_doubles (uint8_t *d, const uint64_t *v, size_t n)
+{
+  Bits w;
+  uint64_t prev = 0;
+  int lead = -1, trail = 0;
+  size_t i;
+
+  w.d = d;
+  w.bit = 0;
+  for( i = 0; i < n; i ++ )
+  {
+    uint64_t x = v[ i ] ^ prev;
+    int l, t;
+
+    prev = v[ i ];
+    if( i == 0 )
+    {
+      put_bits( &w, x, 64 );
+      continue;
+    }
+    if( x == 0 )
+    {
+      put_bits( &w, 0, 1 );
+      continue;
+    }
+    l = leading_zeros( x );
+    t = trailing_zeros( x );
+    if( l > 31 )
+      l = 31;
+    if( lead >= 0 && l >= lead && t >= trail )
+    {
+      put_bits( &w, 2, 2 );
+      put_bits( &w, x >> trail, 64 - lead - trail );
+    }
+    else
+    {
+      put_bits( &w, 3, 2 );
+      put_bits( &w, ( uint64_t )l, 5 );
+      put_bits( &w, ( uint64_t )( 63 - l - t ), 6 );
+      put_bits( &w, x >> t, 64 - l - t );
+      lead = l;
+      trail = t;
+    }
+  }
+  return ( w.bit + 7 ) / 8;
+}
+
+int series_unpack_doubles (uint64_t *v, size_t n, const uint8_t *s, size_t len)
+{
+  Bits r;
+  size_t bits = len * 8, i;
+  uint64_t prev = 0, b;
+  int lead = -1, trail = 0;
+
+  r.d = ( uint8_t * )s;
+  r.bit = 0;
+  for( i = 0; i < n; i ++ )
+  {
+    if( i == 0 )
+    {
+      if( !get_bits( &r, bits, 64, &prev ) )
+        return 0;
+    }
+    else
+    {
+      if( !get_bits( &r, bits, 1, &b ) )
+        return 0;
+      if( b )
+      {
+        if( !get_bits( &r, bits, 1, &b ) )
+          return 0;
+        if( b )
+        {
+          uint64_t l, m;
+          if( !get_bits( &r, bits, 5, &l ) || !get_bits( &r, bits, 6, &m ) )
+            return 0;
+          m ++;
+          if( l + m > 64 )
+            return 0;
+          lead = ( int )l;
+          trail = ( int )( 64 - l - m );
+        }
+        else if( lead < 0 )
+          return 0;
+        if( !get_bits( &r, bits, 64 - lead - trail, &b ) )
+          return 0;
+        prev ^= b << trail;
+      }
+    }
+    v[ i ] = prev;
+  }
+  return ( r.bit + 7 ) / 8 == len;
+}
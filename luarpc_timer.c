@@ -0,0 +1,237 @@
+/*****************************************************************************
+* Lua-RPC library, Copyright (C) 2001 Russell L. Smith. All rights reserved. *
+*   Email: russ@q12.org   Web: www.q12.org                                   *
+* For documentation, see http://www.q12.org/lua. For the license agreement,  *
+* see the file LICENSE that comes with this distribution.                    *
+*****************************************************************************/
+
+// Hierarchical timer wheel
+//   TIMER_LEVELS levels of TIMER_SLOTS slots each. level 0 holds timers due
+//   within TIMER_SLOTS ticks (ms) one per slot; each level above covers
+//   TIMER_SLOTS times the span of the one below, and its slots are moved
+//   down a level ("cascaded") as the level below wraps around. timers are
+//   kept on intrusive lists, so arming and cancelling are O(1), and a bitmap
+//   of occupied slots per level lets quiet stretches be skipped instead of
+//   stepped through tick by tick.
+
+#include <string.h>
+
+#if defined( WIN32 )
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "lua.h"
+
+#include "luarpc_rpc.h"
+
+#define TIMER_MASK ( TIMER_SLOTS - 1 )
+#define TIMER_SPAN( level ) ( ( uint32_t )1 << ( TIMER_SLOT_BITS * ( level ) ) )
+#define TIMER_MAX_DELAY ( TIMER_SPAN( TIMER_LEVELS ) - 1 )
+
+// milliseconds since an arbitrary point, never stepped by clock changes.
+// wraps after ~49 days; only differences between readings mean anything.
+uint32_t timer_now( void )
+{
+#if defined( WIN32 )
+  return ( uint32_t )GetTickCount();
+#else
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint32_t )ts.tv_sec * 1000u + ( uint32_t )( ts.tv_nsec / 1000000 );
+#endif
+}
+
+static int lowest_bit( uint64_t bits )
+{
+#ifdef __GNUC__
+  return __builtin_ctzll( bits );
+#else
+  int n = 0;
+  while( !( bits & 1 ) )
+  {
+    bits >>= 1;
+    n ++;
+  }
+  return n;
+#endif
+}
+
+void timer_init( TimerWheel *w, uint32_t now )
+{
+  int l, s;
+
+  w->now = now;
+  for( l = 0; l < TIMER_LEVELS; l ++ )
+  {
+    w->occupied[ l ] = 0;
+    for( s = 0; s < TIMER_SLOTS; s ++ )
+      w->slots[ l ][ s ].prev = w->slots[ l ][ s ].next = &w->slots[ l ][ s ];
+  }
+}
+
+// link t into the slot for its expiry, relative to the next tick to run
+static void timer_insert( TimerWheel *w, Timer *t )
+{
+  uint32_t delta = t->expires - w->now;
+  Timer *head;
+  int level = 0, slot;
+
+  if( ( int32_t )delta < 0 )
+  {
+    t->expires = w->now;
+    delta = 0;
+  }
+  else if( delta > TIMER_MAX_DELAY )
+  {
+    t->expires = w->now + TIMER_MAX_DELAY;
+    delta = TIMER_MAX_DELAY;
+  }
+  while( delta >= TIMER_SPAN( level + 1 ) )
+    level ++;
+  slot = ( int )( ( t->expires >> ( TIMER_SLOT_BITS * level ) ) & TIMER_MASK );
+
+  head = &w->slots[ level ][ slot ];
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+  w->occupied[ level ] |= ( uint64_t )1 << slot;
+}
+
+void timer_arm( TimerWheel *w, Timer *t, uint32_t expires )
+{
+  timer_cancel( t );
+  t->expires = expires;
+  timer_insert( w, t );
+}
+
+// a slot's occupied bit is left set when its last timer is cancelled, and
+// cleared the next time the wheel looks at it
+void timer_cancel( Timer *t )
+{
+  if( t->next == NULL )
+    return;
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+int timer_armed( Timer *t )
+{
+  return t->next != NULL;
+}
+
+// take the list of a slot off the wheel, returning its first timer
+static Timer *timer_take( TimerWheel *w, int level, int slot )
+{
+  Timer *head = &w->slots[ level ][ slot ];
+  Timer *first = head->next;
+
+  w->occupied[ level ] &= ~( ( uint64_t )1 << slot );
+  if( first == head )
+    return NULL;
+  head->prev->next = NULL;
+  head->prev = head->next = head;
+  return first;
+}
+
+// move the timers of the current slot of each level that has come around
+// down to the levels below
+static void timer_cascade( TimerWheel *w )
+{
+  int level;
+
+  for( level = 1; level < TIMER_LEVELS; level ++ )
+  {
+    int slot = ( int )( ( w->now >> ( TIMER_SLOT_BITS * level ) ) & TIMER_MASK );
+    Timer *t = timer_take( w, level, slot );
+
+    while( t != NULL )
+    {
+      Timer *next = t->next;
+      timer_insert( w, t );
+      t = next;
+    }
+    if( slot != 0 )
+      break;
+  }
+}
+
+void timer_advance( TimerWheel *w, uint32_t now, void ( *fire )( Timer *t ) )
+{
+  while( ( int32_t )( now - w->now ) >= 0 )
+  {
+    int l, slot = ( int )( w->now & TIMER_MASK );
+    uint64_t later;
+    Timer *t;
+
+    for( l = 0; l < TIMER_LEVELS && w->occupied[ l ] == 0; l ++ )
+      ;
+    if( l == TIMER_LEVELS )
+    {
+      // nothing armed: just catch up
+      w->now = now + 1;
+      break;
+    }
+
+    if( slot == 0 )
+      timer_cascade( w );
+    t = timer_take( w, 0, slot );
+
+    // the tick is done before anything fires, so a timer re-armed from
+    // fire() lands in a slot still to come
+    w->now ++;
+    while( t != NULL )
+    {
+      Timer *tnext = t->next;
+      t->prev = t->next = NULL;
+      fire( t );
+      t = tnext;
+    }
+
+    // go straight to the next occupied slot on this turn of level 0, or to
+    // the next wrap if there is none
+    slot = ( int )( w->now & TIMER_MASK );
+    if( slot != 0 )
+    {
+      uint32_t next;
+
+      later = w->occupied[ 0 ] & ( ~( uint64_t )0 << slot );
+      if( later )
+        next = ( w->now & ~( uint32_t )TIMER_MASK ) + lowest_bit( later );
+      else
+        next = ( w->now | TIMER_MASK ) + 1;
+      if( ( int32_t )( next - ( now + 1 ) ) > 0 )
+        next = now + 1;
+      w->now = next;
+    }
+  }
+}
+
+int timer_next( TimerWheel *w, uint32_t now )
+{
+  int l, slot = ( int )( w->now & TIMER_MASK );
+  uint64_t later;
+  uint32_t next;
+
+  for( l = 0; l < TIMER_LEVELS && w->occupied[ l ] == 0; l ++ )
+    ;
+  if( l == TIMER_LEVELS )
+    return -1;
+
+  // this is a lower bound: past the current turn of level 0 the wheel only
+  // knows the next cascade, which is as early as anything could be due. at
+  // slot 0 that cascade is the very next tick.
+  later = w->occupied[ 0 ] & ( ~( uint64_t )0 << slot );
+  if( slot == 0 )
+    next = w->now;
+  else if( later )
+    next = ( w->now & ~( uint32_t )TIMER_MASK ) + lowest_bit( later );
+  else
+    next = ( w->now | TIMER_MASK ) + 1;
+  if( ( int32_t )( next - now ) <= 0 )
+    return 0;
+  return ( int )( next - now );
+}
@@ -45,6 +45,7 @@ int ser_read_byte( ser_handler id );
 uint32_t ser_write( ser_handler id, const uint8_t *src, uint32_t size );
 uint32_t ser_write_byte( ser_handler id, uint8_t data );
 void ser_set_timeout_ms( ser_handler id, uint32_t timeout );
-int ser_readable( ser_handler id );
+int ser_readable( ser_handler id, uint32_t timeout );
+void ser_flush_input( ser_handler id );
 
 #endif
@@ -184,6 +184,8 @@ void ser_set_timeout_ms( ser_handler id, uint32_t timeout )
   }
   else if( timeout == SER_NO_TIMEOUT)
   {
+    // return whatever is queued, so a single read drains the driver buffer
+    termdata.c_cc[ VMIN ] = 0;
     termdata.c_cc[ VTIME ] = 0; 
     fcntl( id, F_SETFL, O_NDELAY ); // no blocking, timeout
   }
@@ -195,8 +197,15 @@ void ser_set_timeout_ms( ser_handler id, uint32_t timeout )
   tcsetattr( id, TCSANOW, &termdata );
 }
 
-// Check if data is available for reading
-int ser_readable( ser_handler id )
+// Discard whatever has been received but not read yet
+void ser_flush_input( ser_handler id )
+{
+  tcflush( id, TCIFLUSH );
+}
+
+// Check if data is available for reading, waiting up to timeout ms
+// (SER_INF_TIMEOUT waits forever, SER_NO_TIMEOUT just polls)
+int ser_readable( ser_handler id, uint32_t timeout )
 {
   fd_set rdfs;
   int ret;
@@ -205,11 +214,10 @@ int ser_readable( ser_handler id )
   FD_ZERO (&rdfs);
   FD_SET (id, &rdfs);
  
-  /* Wait up to five seconds. */
-  tv.tv_sec = 5;
-  tv.tv_usec = 0;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = ( timeout % 1000 ) * 1000;
 
-  ret = select( id+1, &rdfs, NULL, NULL, &tv );
+  ret = select( id+1, &rdfs, NULL, NULL, timeout == SER_INF_TIMEOUT ? NULL : &tv );
   
   if (ret < 0)
   {
@@ -40,7 +40,8 @@ ser_handler ser_open( const char* sername )
 
   portname[ 0 ] = portname[ WIN_MAX_PORT_NAME ] = '\0';
   _snprintf( portname, WIN_MAX_PORT_NAME, "\\\\.\\%s", sername );
-  hComm = CreateFile( portname, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0 );
+  // overlapped, so that ser_readable can wait on a comm event with a timeout
+  hComm = CreateFile( portname, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0 );
   if( hComm == INVALID_HANDLE_VALUE )
     return WIN_ERROR;
   if( !SetupComm( hComm, 2048, 2048 ) )
@@ -97,15 +98,32 @@ int ser_setup( ser_handler id, uint32_t baud, int databits, int parity, int stop
   return SER_OK;
 }
 
+// Helper: read or write on the overlapped handle and wait for it to finish
+// (the comm timeouts still apply). returns the bytes transferred
+static DWORD ser_win32_transfer( HANDLE hComm, int write, void *buf, DWORD size )
+{
+  OVERLAPPED ov;
+  DWORD done = 0;
+  BOOL res;
+
+  memset( &ov, 0, sizeof( ov ) );
+  if( ( ov.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL ) ) == NULL )
+    return 0;
+  if( write )
+    res = WriteFile( hComm, buf, size, &done, &ov );
+  else
+    res = ReadFile( hComm, buf, size, &done, &ov );
+  if( res == FALSE &&
+      ( GetLastError() != ERROR_IO_PENDING || GetOverlappedResult( hComm, &ov, &done, TRUE ) == FALSE ) )
+    done = 0;
+  CloseHandle( ov.hEvent );
+  return done;
+}
+
 // Read up to the specified number of bytes, return bytes actually read
 uint32_t ser_read( ser_handler id, uint8_t* dest, uint32_t maxsize )
 {
-  HANDLE hComm = ( HANDLE )id;
-  DWORD readbytes;
-  
-  if( ReadFile( hComm, dest, maxsize, &readbytes, NULL ) == FALSE )
-    return 0;
-  return readbytes;
+  return ser_win32_transfer( ( HANDLE )id, 0, dest, maxsize );
 }
 
 // Read a single byte and return it (or -1 for error)
@@ -121,12 +139,7 @@ int ser_read_byte( ser_handler id )
 // Write up to the specified number of bytes, return bytes actually written
 uint32_t ser_write( ser_handler id, const uint8_t *src, uint32_t size )
 {
-  HANDLE hComm = ( HANDLE )id;
-  DWORD written;
-	
-  if( WriteFile( hComm, src, size, &written, NULL ) == FALSE )
-    return 0;
-  return written;
+  return ser_win32_transfer( ( HANDLE )id, 1, ( void * )src, size );
 }
 
 // Write a byte to the serial port
@@ -146,14 +159,43 @@ void ser_set_timeout_ms( ser_handler id, uint32_t timeout )
     ser_win32_set_timeouts( id, 0, 0, timeout, 0, 0 );
 }
 
-// Check if data is available for reading
-int ser_readable( ser_handler id )
+// Discard whatever has been received but not read yet
+void ser_flush_input( ser_handler id )
+{
+  PurgeComm( ( HANDLE )id, PURGE_RXCLEAR );
+}
+
+// Check if data is available for reading, waiting up to timeout ms
+// (SER_INF_TIMEOUT waits forever, SER_NO_TIMEOUT just polls). the wait is
+// an overlapped WaitCommEvent for EV_RXCHAR, so it sleeps until a byte
+// arrives or the time is up
+int ser_readable( ser_handler id, uint32_t timeout )
 {
   COMSTAT comStat;
   DWORD   dwErrors;
+  DWORD   dwEvtMask = 0;
+  DWORD   done;
+  OVERLAPPED ov;
   HANDLE hComm = ( HANDLE )id;
   
-  ClearCommError(hComm, &dwErrors, &comStat);
-  
+  SetCommMask( hComm, EV_RXCHAR );
+  ClearCommError( hComm, &dwErrors, &comStat );
+  if( comStat.cbInQue > 0 || timeout == SER_NO_TIMEOUT )
+    return ( comStat.cbInQue > 0 );
+
+  memset( &ov, 0, sizeof( ov ) );
+  if( ( ov.hEvent = CreateEvent( NULL, TRUE, FALSE, NULL ) ) == NULL )
+    return 0;
+  if( WaitCommEvent( hComm, &dwEvtMask, &ov ) == FALSE && GetLastError() == ERROR_IO_PENDING &&
+      WaitForSingleObject( ov.hEvent, timeout == SER_INF_TIMEOUT ? INFINITE : timeout ) != WAIT_OBJECT_0 )
+  {
+    // nothing came: changing the mask completes the pending wait, which
+    // must be over before ov goes out of scope
+    SetCommMask( hComm, EV_RXCHAR );
+    GetOverlappedResult( hComm, &ov, &done, TRUE );
+  }
+  CloseHandle( ov.hEvent );
+
+  ClearCommError( hComm, &dwErrors, &comStat );
   return ( comStat.cbInQue > 0 );
 }
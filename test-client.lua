@@ -82,3 +82,161 @@ for idx,val in ipairs(a) do
 end
 
 rpc.close (slave)
+
+--
+-- ENCODINGS
+--   each feature on a connection of its own, with the others off (but for
+--   those it needs, listed after its test)
+--
+
+-- true if a and b hold the same values (without cycles)
+local function same(a, b)
+  if type(a) ~= "table" or type(b) ~= "table" then
+    return a == b
+  end
+  for k, v in pairs(a) do
+    if not same(v, b[k]) then return false end
+  end
+  for k in pairs(b) do
+    if a[k] == nil then return false end
+  end
+  return true
+end
+
+local encodings = {}
+
+encodings[#encodings + 1] = {"refs", function(slave)
+  local t = {name = "loop"}
+  t.self = t
+  local back = slave.mirror(t)
+  assert(back.self == back and back.name == "loop", "cycle lost")
+  local shared = {1, 2, 3}
+  back = slave.mirror({a = shared, b = shared})
+  assert(back.a == back.b and same(back.a, shared), "shared table lost")
+end}
+
+encodings[#encodings + 1] = {"strings", function(slave)
+  local rows = {}
+  for i = 1, 300 do
+    rows[i] = {kind = "sensor", unit = "celsius", where = "room " .. i % 7, value = i}
+  end
+  assert(same(slave.mirror(rows), rows), "repeated strings lost")
+  local long = string.rep("abc", 100)
+  local back = slave.mirror({long, long, long, [long] = long})
+  assert(back[1] == long and back[3] == long and back[long] == long, "repeated long string lost")
+end}
+
+encodings[#encodings + 1] = {"dict", function(slave)
+  for i = 1, 100 do
+    local back = slave.mirror({name = "reading", unit = "celsius", value = i})
+    assert(back.name == "reading" and back.unit == "celsius" and back.value == i, "dictionary key lost")
+  end
+  -- more keys than the dictionary holds, twice, then the first keys again
+  local wide = {}
+  for i = 1, 100 do wide["key" .. i] = i end
+  assert(same(slave.mirror(wide), wide), "evicted key lost")
+  assert(same(slave.mirror(wide), wide), "evicted key lost")
+  assert(slave.mirror({name = "again"}).name == "again", "reused key lost")
+end}
+
+encodings[#encodings + 1] = {"cache", function(slave)
+  local big = {}
+  for i = 1, 4000 do big[i] = i end
+  for i = 1, 3 do
+    assert(slave.sum(big) == 4000 * 4001 / 2, "cached argument lost")
+  end
+  big[1] = 1001
+  assert(slave.sum(big) == 4000 * 4001 / 2 + 1000, "changed argument not resent")
+  -- more large arguments than the cache holds, then the first again
+  local others = {}
+  for n = 1, 9 do
+    others[n] = {}
+    for i = 1, 4000 do others[n][i] = n end
+    assert(slave.sum(others[n]) == 4000 * n, "cached argument lost")
+  end
+  assert(slave.sum(others[1]) == 4000, "evicted argument not resent")
+end}
+
+encodings[#encodings + 1] = {"arrays", function(slave)
+  local cases = {{}, {}, {}, {}, {}}
+  for i = 1, 1000 do
+    cases[1][i] = i % 200 - 100          -- 1 byte each
+    cases[2][i] = i * 30 - 15000         -- 2 bytes
+    cases[3][i] = i * 1000003            -- 4 bytes
+    cases[4][i] = i / 7                  -- 8 bytes
+    cases[5][i] = i % 3 == 0 and "x" or i
+  end
+  for _, t in ipairs(cases) do
+    assert(same(slave.mirror(t), t), "array lost")
+  end
+  local mixed = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, name = "keys too"}
+  assert(same(slave.mirror(mixed), mixed), "array with keys lost")
+  -- a fraction a float holds with an integer it does not
+  local wide = {0.5, 16777217, 1, 2, 3, 4, 5, 6, 7, 8}
+  assert(slave.mirror(wide)[2] == 16777217, "integer rounded in an array")
+end}
+
+encodings[#encodings + 1] = {"integers", function(slave)
+  local values = {0, 1, -1, 127, -128, 65536, 2^31, -2^40, 2^53, 1.5}
+  assert(same(slave.mirror(values), values), "number lost")
+  for _, v in ipairs(values) do
+    assert(slave.mirror(v) == v, "number lost")
+  end
+  if math.type then
+    -- Lua 5.3 and later: integers stay integers, exactly
+    for _, v in ipairs{3, math.maxinteger, math.mininteger, 9007199254740993} do
+      local back = slave.mirror(v)
+      assert(back == v and math.type(back) == "integer", "integer lost")
+    end
+    assert(math.type(slave.mirror(3.0)) == "float", "float arrived as integer")
+  end
+end}
+
+encodings[#encodings + 1] = {"float32", function(slave)
+  for _, v in ipairs{1/3, -2.718281828459045, 6.02e23, 1e-30} do
+    local back = slave.mirror(v)
+    assert(math.abs(back - v) <= math.abs(v) * 2^-24, "float32 error too large")
+  end
+  assert(slave.mirror(123456789) == 123456789, "integer not exact")
+  assert(slave.mirror(1e300) == 1e300, "number beyond a float not exact")
+  assert(slave.mirror(math.huge) == math.huge, "infinity lost")
+  local nan = slave.mirror(0/0)
+  assert(nan ~= nan, "NaN lost")
+  local back = slave.mirror({[0.1] = 0.1})
+  local k, v = next(back)
+  assert(k == 0.1 and math.abs(v - 0.1) <= 0.1 * 2^-24, "table key not exact")
+end}
+
+encodings[#encodings + 1] = {"series", function(slave)
+  local stamps, counts, readings, jumps = {}, {}, {}, {}
+  for i = 1, 2000 do
+    stamps[i] = 1500000000000 + i * 1000 + i % 3
+    counts[i] = i * i
+    readings[i] = 20 + math.floor(math.sin(i / 50) * 100) / 100
+    jumps[i] = (i % 2 == 0 and 1 or -1) * 2^40 / i
+  end
+  for _, t in ipairs{stamps, counts, readings, jumps} do
+    assert(same(slave.mirror(t), t), "series lost")
+  end
+  local long = {}
+  for i = 1, 70000 do long[i] = i end
+  assert(same(slave.mirror(long), long), "array beyond a series lost")
+end, {"arrays"}}
+
+if rpc.encoding then
+  local off = {}
+  for _, case in ipairs(encodings) do off[case[1]] = false end
+  for _, case in ipairs(encodings) do
+    local on = {}
+    for name in pairs(off) do on[name] = false end
+    on[case[1]] = true
+    for _, also in ipairs(case[3] or {}) do on[also] = true end
+    rpc.encoding(on)
+    local slave = assert(rpc.client("localhost", tonumber(arg[1])))
+    assert(rpc.encoding(slave)[case[1]], case[1] .. " not negotiated")
+    case[2](slave)
+    rpc.close(slave)
+    print(case[1] .. " ok")
+  end
+  rpc.encoding(off)
+end
@@ -36,6 +36,12 @@ function mirror( input )
 	return input
 end
 
+function sum( t )
+	local s = 0
+	for i = 1, #t do s = s + t[i] end
+	return s
+end
+
 
 yarg = {}
 
@@ -43,6 +49,11 @@ test = {1, 2, 3, 4, "234"}
 
 test.sval = 23
 
+-- the encodings test-client.lua tries, each on a connection of its own
+if rpc.encoding then
+  rpc.encoding{refs=true, strings=true, dict=true, cache=true, arrays=true, integers=true, float32=true, series=true}
+end
+
 
 io.write ("server started\n")
 